@@ -0,0 +1,481 @@
+// bench.cc
+// This file contains a benchmark suite for the infrastructure and the
+// branch predictor.  For each trace file named on the command line it
+// measures:
+//
+// - read: how fast read_traces reads traces from the trace file, in
+//   millions of traces per second
+// - decompress: how fast the trace file is decompressed, in megabytes of
+//   decompressed bytes per second
+// - decode: how fast the decompressed bytes are decoded into traces by
+//   read_traces, in millions of traces per second
+// - these two are left out for a version 2 trace, which is decoded
+//   straight from the file
+// - predict: the time my_predictor takes to predict and update, in
+//   nanoseconds per branch, calling it directly as simulate<my_predictor>
+//   does
+// - predict_virtual: the same through the virtual branch_predictor
+//   interface
+// - perceptron: the same for the perceptron predictor in perceptron.h,
+//   using AVX2 if the processor has it
+// - perceptron_scalar: the same without AVX2
+// - tage: the same for the TAGE predictor in tage.h
+// - history: the time to keep a 1024-bit global history, three folded
+//   copies of it, a path history and the call depth with the primitives in
+//   history.h, in nanoseconds per branch over the first 256K branches
+// - history_naive: the same with the history in an array that is shifted
+//   along for every branch and the folded copies recomputed from it
+//
+// Each measurement is run a few times to warm up and then repeated, and
+// the median and 95th percentile of the run times of the repeats are
+// reported, in the units above; so for a rate, the "p95" number is the
+// rate of a run slower than 95% of the others.  The results
+// are printed and also written as tab-separated lines to a file (bench.tsv
+// by default) so that numbers from different versions can be compared.
+// The label given with -l goes in the first column to tell them apart.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "predictor.h"
+#include "my_predictor.h"
+#include "perceptron.h"
+#include "tage.h"
+#include "history.h"
+#include "driver.h"
+
+// default number of warm-up and measured runs
+
+#define WARMUPS	1
+#define REPEATS	5
+
+static int warmups = WARMUPS, repeats = REPEATS;
+
+// a trace source for traces that are already in memory
+
+class memory_source {
+	trace *traces;
+	size_t ntraces, pos;
+
+public:
+	memory_source (trace *t, size_t n) : traces(t), ntraces(n), pos(0) {}
+
+	size_t next (trace **t) {
+		size_t n = ntraces - pos < TRACE_BATCH ? ntraces - pos : TRACE_BATCH;
+		*t = traces + pos;
+		pos += n;
+		return n;
+	}
+};
+
+// decompressed bytes in memory, fed to a decoder by next_bytes
+
+struct byte_source {
+	unsigned char *bytes;
+	size_t size, pos;
+};
+
+static size_t next_bytes (void *arg, unsigned char *dst, size_t size) {
+	byte_source *b = (byte_source *) arg;
+	size_t n = b->size - b->pos < size ? b->size - b->pos : size;
+	memcpy (dst, b->bytes + b->pos, n);
+	b->pos += n;
+	return n;
+}
+
+// wall clock time in seconds
+
+static double now (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the median and 95th percentile of the measured run times, converted
+// to the units of a benchmark
+
+struct summary {
+	double median, p95;
+};
+
+static int by_value (const void *a, const void *b) {
+	double x = *(double *) a, y = *(double *) b;
+	return x < y ? -1 : x > y;
+}
+
+// per_second is true for a rate, which is work / time; otherwise the
+// unit is time / work
+
+static summary summarize (double *v, int n, double work, bool per_second) {
+	qsort (v, n, sizeof (double), by_value);
+	double median = n % 2 ? v[n/2] : (v[n/2-1] + v[n/2]) / 2;
+	int k = (int) (0.95 * n + 0.999999) - 1;
+	double p95 = v[k < 0 ? 0 : k];
+	summary s;
+	s.median = per_second ? work / median : median / work;
+	s.p95 = per_second ? work / p95 : p95 / work;
+	return s;
+}
+
+// read a whole trace file once, keeping the traces if keep is given;
+// return the number of traces
+
+static size_t read_all (char *fname, trace **keep) {
+	static trace batch[TRACE_BATCH];
+	size_t total = 0, max = 0;
+	trace_reader *tr = open_trace (fname);
+	for (;;) {
+		size_t n = read_traces (tr, batch, TRACE_BATCH);
+		if (!n) break;
+		if (keep) {
+			if (total + n > max) {
+				max = max ? max * 2 : 1<<20;
+				*keep = (trace *) realloc (*keep, max * sizeof (trace));
+			}
+			memcpy (*keep + total, batch, n * sizeof (trace));
+		}
+		total += n;
+	}
+	close_trace (tr);
+	return total;
+}
+
+// decompress a whole trace file once, keeping the bytes if keep is given;
+// return the number of bytes
+
+static size_t decompress (char *fname, unsigned char **keep) {
+	static unsigned char chunk[1<<20];
+	size_t total = 0, max = 0;
+	trace_reader *tr = open_trace (fname);
+	for (;;) {
+		size_t n = read_trace_bytes (tr, chunk, sizeof (chunk));
+		if (!n) break;
+		if (keep) {
+			if (total + n > max) {
+				max = max ? max * 2 : 1<<24;
+				*keep = (unsigned char *) realloc (*keep, max);
+			}
+			memcpy (*keep + total, chunk, n);
+		}
+		total += n;
+	}
+	close_trace (tr);
+	return total;
+}
+
+// decode decompressed bytes in memory, keeping the traces if keep is
+// given; return the number of traces
+
+static size_t decode (unsigned char *bytes, size_t size, trace **keep) {
+	static trace batch[TRACE_BATCH];
+	byte_source b = { bytes, size, 0 };
+	size_t total = 0, max = 0;
+	trace_reader *tr = open_trace_decoder (next_bytes, &b);
+	for (;;) {
+		size_t n = read_traces (tr, batch, TRACE_BATCH);
+		if (!n) break;
+		if (keep) {
+			if (total + n > max) {
+				max = max ? max * 2 : 1<<20;
+				*keep = (trace *) realloc (*keep, max * sizeof (trace));
+			}
+			memcpy (*keep + total, batch, n * sizeof (trace));
+		}
+		total += n;
+	}
+	close_trace (tr);
+	return total;
+}
+
+// run my_predictor over the traces once, calling it as a P; return the
+// number of direction mispredictions
+
+template <class P>
+static long long int predict (trace *traces, size_t n) {
+	long long int tmiss = 0, dmiss = 0;
+	my_predictor *mp = new my_predictor ();
+	P *p = mp;
+	memory_source src (traces, n);
+	simulate (p, src, tmiss, dmiss);
+	delete mp;
+	return dmiss;
+}
+
+// run the perceptron predictor over the traces once, with or without
+// AVX2; return the number of direction mispredictions
+
+static long long int predict_perceptron (trace *traces, size_t n, bool avx2) {
+	long long int tmiss = 0, dmiss = 0;
+	perceptron_predictor *p = new perceptron_predictor (avx2);
+	memory_source src (traces, n);
+	simulate (p, src, tmiss, dmiss);
+	delete p;
+	return dmiss;
+}
+
+// run the TAGE predictor over the traces once; return the number of
+// direction mispredictions
+
+static long long int predict_tage (trace *traces, size_t n) {
+	long long int tmiss = 0, dmiss = 0;
+	tage_predictor *p = new tage_predictor ();
+	memory_source src (traces, n);
+	simulate (p, src, tmiss, dmiss);
+	delete p;
+	return dmiss;
+}
+
+// the branches to keep histories for, the length of the global history
+// and the widths it is folded to
+
+#define HISTORY_BRANCHES	(1<<18)
+#define HISTORY_LENGTH		1024
+
+static const int fold_widths[3] = { 10, 12, 16 };
+
+// a checksum of the histories after a branch, to check that both ways of
+// keeping them agree
+
+static inline unsigned long long int history_sum (unsigned int *f, unsigned int path, int depth) {
+	return f[0] ^ ((unsigned long long int) f[1] << 10) ^ ((unsigned long long int) f[2] << 22)
+		^ ((unsigned long long int) path << 38) ^ ((unsigned long long int) depth << 54);
+}
+
+// keep the histories over the traces with history.h; return the sum of
+// the checksums
+
+static unsigned long long int keep_history (trace *traces, size_t n) {
+	global_history<HISTORY_LENGTH> *h = new global_history<HISTORY_LENGTH> ();
+	path_history<16> path;
+	call_depth<> depth;
+	folded_history fold[3];
+	for (int j=0; j<3; j++) fold[j].init (HISTORY_LENGTH, fold_widths[j]);
+	unsigned long long int sum = 0;
+	for (size_t i=0; i<n; i++) {
+		trace *t = &traces[i];
+		h->push (t->taken);
+		unsigned int f[3];
+		for (int j=0; j<3; j++) {
+			fold[j].update (*h);
+			f[j] = fold[j].value ();
+		}
+		path.push (t->bi.address);
+		depth.update (t->bi);
+		sum += history_sum (f, path.value (), depth.value ());
+	}
+	delete h;
+	return sum;
+}
+
+// the same the obvious way
+
+static unsigned long long int keep_history_naive (trace *traces, size_t n) {
+	unsigned char *h = new unsigned char[HISTORY_LENGTH];
+	memset (h, 0, HISTORY_LENGTH);
+	unsigned int path = 0;
+	int depth = 0;
+	unsigned long long int sum = 0;
+	for (size_t i=0; i<n; i++) {
+		trace *t = &traces[i];
+		memmove (h + 1, h, HISTORY_LENGTH - 1);
+		h[0] = t->taken;
+		unsigned int f[3];
+		for (int j=0; j<3; j++) {
+			f[j] = 0;
+			for (int k=0, b=0; k<HISTORY_LENGTH; k++) {
+				f[j] ^= h[k] << b;
+				if (++b == fold_widths[j]) b = 0;
+			}
+		}
+		path = ((path << 1) ^ (t->bi.address & 1)) & 0xffff;
+		if (t->bi.br_flags & BR_CALL) {
+			if (depth < 255) depth++;
+		} else if (t->bi.br_flags & BR_RETURN) {
+			if (depth > 0) depth--;
+		}
+		sum += history_sum (f, path, depth);
+	}
+	delete[] h;
+	return sum;
+}
+
+// print a result and write it to the results file
+
+static FILE *results;
+static const char *label = "-";
+
+static void report (char *fname, const char *metric, summary s, const char *unit) {
+	printf ("%-40s %-16s %10.2f %10.2f  %s\n", fname, metric, s.median, s.p95, unit);
+	fprintf (results, "%s\t%s\t%s\t%0.3f\t%0.3f\t%s\n", label, fname, metric, s.median, s.p95, unit);
+	fflush (results);
+}
+
+// run all the benchmarks on one trace file
+
+static void bench_trace (char *fname) {
+	double *v = new double[repeats];
+
+	// reading; the first warm-up keeps the traces for predicting
+
+	trace *traces = NULL;
+	size_t ntraces = read_all (fname, &traces);
+	for (int i=1; i<warmups; i++) read_all (fname, NULL);
+	for (int i=0; i<repeats; i++) {
+		double start = now ();
+		read_all (fname, NULL);
+		v[i] = now () - start;
+	}
+	report (fname, "read", summarize (v, repeats, ntraces / 1e6, true), "Mtraces/s");
+
+	trace_reader *tr = open_trace (fname);
+	int version = trace_version (tr);
+	close_trace (tr);
+	if (version == 1) {
+
+		// decompression; the first warm-up keeps the bytes for
+		// decoding
+
+		unsigned char *bytes = NULL;
+		size_t nbytes = decompress (fname, &bytes);
+		for (int i=1; i<warmups; i++) decompress (fname, NULL);
+		for (int i=0; i<repeats; i++) {
+			double start = now ();
+			decompress (fname, NULL);
+			v[i] = now () - start;
+		}
+		report (fname, "decompress", summarize (v, repeats, nbytes / 1e6, true), "MB/s");
+
+		// decoding
+
+		for (int i=0; i<warmups; i++) decode (bytes, nbytes, NULL);
+		for (int i=0; i<repeats; i++) {
+			double start = now ();
+			decode (bytes, nbytes, NULL);
+			v[i] = now () - start;
+		}
+		report (fname, "decode", summarize (v, repeats, ntraces / 1e6, true), "Mtraces/s");
+		free (bytes);
+	}
+
+	// predicting and updating, both ways
+
+	long long int dmiss = 0;
+	for (int i=0; i<warmups; i++) dmiss = predict<my_predictor> (traces, ntraces);
+	for (int i=0; i<repeats; i++) {
+		double start = now ();
+		predict<my_predictor> (traces, ntraces);
+		v[i] = (now () - start) * 1e9;
+	}
+	report (fname, "predict", summarize (v, repeats, ntraces, false), "ns/branch");
+	for (int i=0; i<warmups; i++) 
+		if (predict<branch_predictor> (traces, ntraces) != dmiss) {
+			fprintf (stderr, "%s: static and virtual predictions disagree!\n", fname);
+			exit (1);
+		}
+	for (int i=0; i<repeats; i++) {
+		double start = now ();
+		predict<branch_predictor> (traces, ntraces);
+		v[i] = (now () - start) * 1e9;
+	}
+	report (fname, "predict_virtual", summarize (v, repeats, ntraces, false), "ns/branch");
+
+	// the perceptron predictor, both ways
+
+	for (int i=0; i<warmups; i++) dmiss = predict_perceptron (traces, ntraces, true);
+	for (int i=0; i<repeats; i++) {
+		double start = now ();
+		predict_perceptron (traces, ntraces, true);
+		v[i] = (now () - start) * 1e9;
+	}
+	report (fname, "perceptron", summarize (v, repeats, ntraces, false), "ns/branch");
+	for (int i=0; i<warmups; i++) 
+		if (predict_perceptron (traces, ntraces, false) != dmiss) {
+			fprintf (stderr, "%s: AVX2 and scalar perceptron predictions disagree!\n", fname);
+			exit (1);
+		}
+	for (int i=0; i<repeats; i++) {
+		double start = now ();
+		predict_perceptron (traces, ntraces, false);
+		v[i] = (now () - start) * 1e9;
+	}
+	report (fname, "perceptron_scalar", summarize (v, repeats, ntraces, false), "ns/branch");
+
+	// the TAGE predictor
+
+	for (int i=0; i<warmups; i++) dmiss = predict_tage (traces, ntraces);
+	for (int i=0; i<repeats; i++) {
+		double start = now ();
+		if (predict_tage (traces, ntraces) != dmiss) {
+			fprintf (stderr, "%s: TAGE predictions differ between runs!\n", fname);
+			exit (1);
+		}
+		v[i] = (now () - start) * 1e9;
+	}
+	report (fname, "tage", summarize (v, repeats, ntraces, false), "ns/branch");
+
+	// keeping histories, both ways
+
+	size_t nhist = ntraces < HISTORY_BRANCHES ? ntraces : HISTORY_BRANCHES;
+	unsigned long long int sum = 0;
+	for (int i=0; i<warmups; i++) sum = keep_history (traces, nhist);
+	for (int i=0; i<repeats; i++) {
+		double start = now ();
+		keep_history (traces, nhist);
+		v[i] = (now () - start) * 1e9;
+	}
+	report (fname, "history", summarize (v, repeats, nhist, false), "ns/branch");
+	for (int i=0; i<warmups; i++) 
+		if (keep_history_naive (traces, nhist) != sum) {
+			fprintf (stderr, "%s: history.h and naive histories disagree!\n", fname);
+			exit (1);
+		}
+	for (int i=0; i<repeats; i++) {
+		double start = now ();
+		keep_history_naive (traces, nhist);
+		v[i] = (now () - start) * 1e9;
+	}
+	report (fname, "history_naive", summarize (v, repeats, nhist, false), "ns/branch");
+	free (traces);
+	delete[] v;
+}
+
+static void usage (char *prog) {
+	fprintf (stderr, "Usage: %s [-w warmups] [-r repeats] [-o results.tsv] [-l label] <filename>.gz ...\n", prog);
+	exit (1);
+}
+
+int main (int argc, char *argv[]) {
+	const char *out = "bench.tsv";
+	int c;
+	while ((c = getopt (argc, argv, "w:r:o:l:")) != -1) {
+		switch (c) {
+		case 'w': warmups = atoi (optarg); break;
+		case 'r': repeats = atoi (optarg); break;
+		case 'o': out = optarg; break;
+		case 'l': label = optarg; break;
+		default: usage (argv[0]);
+		}
+	}
+	if (optind == argc || warmups < 1 || repeats < 1) usage (argv[0]);
+
+	// add to the results file so runs of different versions pile up
+	// in one place
+
+	results = fopen (out, "a");
+	if (!results) {
+		perror (out);
+		exit (1);
+	}
+	fseek (results, 0, SEEK_END);
+	if (ftell (results) == 0) 
+		fprintf (results, "label\ttrace\tmetric\tmedian\tp95\tunit\n");
+	printf ("%-40s %-16s %10s %10s\n", "trace", "metric", "median", "p95");
+	for (int i=optind; i<argc; i++) bench_trace (argv[i]);
+	fclose (results);
+	exit (0);
+}
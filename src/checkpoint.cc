@@ -0,0 +1,172 @@
+// checkpoint.cc
+// This file contains the checkpointing mode of the driver.  It simulates
+// a trace like the normal mode but every so many traces it writes the
+// state of the simulation to a checkpoint file: the statistics, the state
+// of the branch predictor (through its serialize method), and the position
+// in the trace file along with the state of the trace decoder.  A run that
+// is stopped can then resume from its last checkpoint instead of starting
+// over, and a run can be forked from a checkpoint by resuming from it with
+// a different checkpoint file.  A checkpoint can also just warm up a
+// predictor: the predictor's state is taken from it and the trace is
+// simulated from the beginning, so one warm-up can be reused for many
+// measurements.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "predictor.h"
+#include "my_predictor.h"
+#include "driver.h"
+
+// the start of a checkpoint file.  it is followed by the predictor's
+// state and then the trace_source's.
+
+#define CHECKPOINT_MAGIC	"BPCKPT\0\0"
+#define CHECKPOINT_VERSION	2
+
+struct checkpoint_header {
+	char magic[8];
+	unsigned int version, pad;
+
+	// size of the trace file, to catch resuming with the wrong file
+
+	long long int trace_size;
+
+	// statistics so far
+
+	long long int tmiss, dmiss;
+};
+
+// size of a file, or -1 if it can't be found
+
+static long long int file_size (char *fname) {
+	struct stat st;
+	if (stat (fname, &st) < 0) return -1;
+	return st.st_size;
+}
+
+// write a checkpoint.  it goes to a temporary file that is renamed when
+// it's complete so a run killed in the middle of writing still leaves
+// the previous checkpoint.
+
+static void save_checkpoint (char *save, char *fname, my_predictor *p, trace_source & src, 
+	long long int tmiss, long long int dmiss) {
+	char tmp[PATH_MAX+32];
+	snprintf (tmp, sizeof (tmp), "%s.%d.tmp", save, (int) getpid ());
+	FILE *f = fopen (tmp, "wb");
+	if (!f) {
+		perror (tmp);
+		exit (1);
+	}
+	checkpoint_header h;
+	memset (&h, 0, sizeof (h));
+	memcpy (h.magic, CHECKPOINT_MAGIC, 8);
+	h.version = CHECKPOINT_VERSION;
+	h.trace_size = file_size (fname);
+	h.tmiss = tmiss;
+	h.dmiss = dmiss;
+	if (fwrite (&h, sizeof (h), 1, f) != 1) {
+		perror (tmp);
+		exit (1);
+	}
+	if (!p->serialize (f)) {
+		fprintf (stderr, "%s: this predictor can't be checkpointed\n", tmp);
+		exit (1);
+	}
+	if (!src.save (f) || fclose (f) != 0) {
+		perror (tmp);
+		exit (1);
+	}
+	if (rename (tmp, save) < 0) {
+		perror (save);
+		exit (1);
+	}
+}
+
+// open a checkpoint and read its header and the predictor's state
+
+static FILE *load_checkpoint (char *name, checkpoint_header *h, my_predictor *p) {
+	FILE *f = fopen (name, "rb");
+	if (!f) {
+		perror (name);
+		exit (1);
+	}
+	if (fread (h, sizeof (*h), 1, f) != 1 || memcmp (h->magic, CHECKPOINT_MAGIC, 8) != 0
+	 || h->version != CHECKPOINT_VERSION) {
+		fprintf (stderr, "%s: not a checkpoint file\n", name);
+		exit (1);
+	}
+	if (!p->deserialize (f)) {
+		fprintf (stderr, "%s: can't read the predictor's state\n", name);
+		exit (1);
+	}
+	return f;
+}
+
+// simulate a trace file with the given checkpoint options
+
+void run_checkpoint (char *fname, checkpoint_options *opt) {
+	my_predictor *p = new my_predictor ();
+	trace_source src (fname);
+	long long int tmiss = 0, dmiss = 0;
+
+	if (opt->resume) {
+		checkpoint_header h;
+		FILE *f = load_checkpoint (opt->resume, &h, p);
+		if (h.trace_size != file_size (fname)) {
+			fprintf (stderr, "%s: checkpoint is not of %s\n", opt->resume, fname);
+			exit (1);
+		}
+		if (!src.restore (f)) {
+			fprintf (stderr, "%s: can't restore the position in %s\n", opt->resume, fname);
+			exit (1);
+		}
+		fclose (f);
+		tmiss = h.tmiss;
+		dmiss = h.dmiss;
+	} else if (opt->warm) {
+		checkpoint_header h;
+		fclose (load_checkpoint (opt->warm, &h, p));
+	}
+
+	// simulate up to the next checkpoint or stopping point at a time
+
+	long long int next_save = opt->every ? (src.position () / opt->every + 1) * opt->every : 0;
+	bool stopped = false;
+	for (;;) {
+		long long int stop = LLONG_MAX;
+		if (next_save) stop = next_save;
+		if (opt->until && opt->until < stop) stop = opt->until;
+		if (src.position () >= stop) {
+			stopped = true;
+			break;
+		}
+		trace *t;
+		size_t n = src.next (&t, stop - src.position () < TRACE_BATCH ? stop - src.position () : TRACE_BATCH);
+		if (!n) break;
+		for (size_t i=0; i<n; i++) predict_trace (p, &t[i], tmiss, dmiss);
+		if (opt->save && next_save && src.position () == next_save) {
+			save_checkpoint (opt->save, fname, p, src, tmiss, dmiss);
+			next_save += opt->every;
+		}
+		if (opt->until && src.position () >= opt->until) {
+			stopped = true;
+			break;
+		}
+	}
+
+	// always leave a checkpoint at the end
+
+	if (opt->save) save_checkpoint (opt->save, fname, p, src, tmiss, dmiss);
+	if (stopped)
+		printf ("stopped after %lld traces\n", src.position ());
+	else
+		printf ("%0.3f MPKI\n", 1000.0 * (dmiss / (double) src.ninstructions));
+	delete p;
+}
@@ -1,31 +1,52 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #include <zlib.h>
 #include <map>
 
 #include "branch.h"
 #include "trace.h"
 
-bool compressing = false;
+bool compressing = false, version2 = false;
+
+static void usage (char *name) {
+	fprintf (stderr, "Usage: %s [ -d | -c | -2 | -b [ -j <threads> ] ] <filename>.gz\n", name);
+	exit (1);
+}
 
 int main (int argc, char *argv[]) {
 	long long int ntraces = 0;
-	if (argc < 3) {
-		fprintf (stderr, "Usage: %s [ -d | -c ] <filename>.gz\n", argv[0]);
-		exit (1);
-	}
+	bool blocks = false;
+	int nthreads = sysconf (_SC_NPROCESSORS_ONLN), first = 2;
+	if (argc < 3) usage (argv[0]);
 	if (strcmp (argv[1], "-c") == 0) {
 		compressing = true;
+	} else if (strcmp (argv[1], "-2") == 0) {
+		compressing = true;
+		version2 = true;
+	} else if (strcmp (argv[1], "-b") == 0) {
+		compressing = true;
+		version2 = true;
+		blocks = true;
+		if (strcmp (argv[2], "-j") == 0) {
+			if (argc < 5) usage (argv[0]);
+			nthreads = atoi (argv[3]);
+			first = 4;
+		}
 	} else if (strcmp (argv[1], "-d") == 0) {
 		compressing = false;
-	} else {
-		fprintf (stderr, "Usage: %s [ -d | -c ] <filename>.gz\n", argv[0]);
-		exit (1);
-	}
-	for (int i=2; i<argc; i++) {
+	} else 
+		usage (argv[0]);
+	if (nthreads < 1) nthreads = 1;
+	for (int i=first; i<argc; i++) {
 		fprintf (stderr, "reading \"%s\"\n", argv[i]);
 		fflush (stderr);
+		if (blocks) {
+			ntraces += compress_blocks (argv[i], nthreads);
+			continue;
+		}
 		init_trace (argv[i]);
 		long long int tmiss = 0, dmiss = 0, branches = 0;
 		for (;;) {
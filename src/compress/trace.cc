@@ -2,14 +2,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include <map>
 
 #include "branch.h"
 #include "trace.h"
+#include "../trace2.h"
 
 #define BUFSIZE	10000000
 
-extern bool compressing;
+// bytes of output to collect before writing them
+
+#define OUTBUFSIZE	(1<<20)
+
+extern bool compressing, version2;
 
 FILE *tracefp;
 
@@ -50,14 +56,12 @@ struct remember {
 	bool taken;
 	unsigned char code;
 	unsigned int address, target;
-	unsigned int lru_time;
 
 	remember (void) {
 		code = 0;
 		address = 0;
 		target = 0;
 		taken = 0;
-		lru_time = 0;
 	}
 
 	remember (unsigned char c, unsigned int a, unsigned int t, bool ta) {
@@ -71,72 +75,358 @@ struct remember {
 		return
 		   r->code == code
 		&& r->taken == taken
-		&& r->address == address 
+		&& r->address == address
 		&& (ignore_target || r->target == target);
 	}
 };
 
-// a return address stack
-
 #define RAS_SIZE	100
+#define N_REMEMBER	(1<<16)
+#define ASSOC		8
+
+// one set of the table, with the fields of the ways in separate arrays
+// so a set is two cache lines.  every remembered trace is taken, so taken
+// isn't kept.  lru is a permutation of the ways, nibble 0 most recently
+// used and nibble 7 least; it starts with way 0 least recently used,
+// which is what the old all-zero time stamps gave, so the replacements
+// and therefore the output are exactly the same as before.
+
+struct remember_set {
+	unsigned char code[ASSOC];
+	unsigned int lru;
+	unsigned int address[ASSOC];
+
+	// the set's last symbol in the version 2 format; see ../trace2.h
+
+	unsigned char v2_last;
+	unsigned int target[ASSOC] __attribute__ ((aligned (64)));
+};
+
+// everything the prediction of traces depends on, and where its output
+// goes.  the traces of a file share one state; with -b each block has a
+// fresh one of its own.
+
+struct trace_state {
+
+	// a return address stack
+
+	unsigned int ras[RAS_SIZE];
+	int ras_top;
+
+	// the remember table
+
+	remember_set rtab[N_REMEMBER];
 
-unsigned int ras[RAS_SIZE];
-int ras_top = 100;
+	// false until the first update; the old first time stamp was 0, the
+	// same as an unused way's, so the first update didn't change the LRU
+	// order
 
-void init_ras (void) {
-	ras_top = RAS_SIZE;
+	bool lru_started;
+	remember last_one;
+
+	// the version 2 format; see ../trace2.h.  the symbols and varints of
+	// a chunk are collected here and written when the chunk is full.
+	// reset is true until the first chunk of a block is written.
+
+	trace2_model *v2_model;
+	trace2_tables *v2_tables;
+	trace2_event *v2_events;
+	unsigned char *v2_varints;
+	unsigned int v2_nsyms, v2_nvarints;
+	bool v2_reset;
+
+	// the output.  if flush is true it's written to stdout whenever it
+	// fills OUTBUFSIZE bytes; otherwise it grows to hold everything.
+
+	unsigned char *out;
+	size_t nout, maxout;
+	bool flush;
+
+	// statistics
+
+	unsigned int ntimes, nright, total_bytes, trace_bytes;
+	int ras_hits, ras_ntimes;
+	unsigned int classmispred[8];
+};
+
+// the state of the file read by read_trace
+
+static trace_state *the_state;
+
+void init_ras (trace_state *s) {
+	s->ras_top = RAS_SIZE;
 }
 
-void push_ras (unsigned int a) {
-	if (ras_top) ras[--ras_top] = a;
+void push_ras (trace_state *s, unsigned int a) {
+	if (s->ras_top) s->ras[--s->ras_top] = a;
 }
 
-unsigned int pop_ras (void) {
-	if (ras_top < RAS_SIZE) return ras[ras_top++];
+unsigned int pop_ras (trace_state *s) {
+	if (s->ras_top < RAS_SIZE) return s->ras[s->ras_top++];
 	return 0;
 }
 
-#define N_REMEMBER	(1<<16)
-#define ASSOC		8
+// calls push their return addresses
+
+void push_call (trace_state *s, unsigned char c, unsigned int address) {
+	if (c >> 4 == 5) push_ras (s, address + 5);
+	else if (c >> 4 == 6) push_ras (s, address + 2);
+}
+
+// start predicting from nothing, keeping the output buffer and statistics
+
+void reset_state (trace_state *s) {
+	memset (s->rtab, 0, sizeof (s->rtab));
+	for (int i=0; i<N_REMEMBER; i++) s->rtab[i].lru = 0x01234567;
+	s->lru_started = false;
+	s->last_one = remember ();
+	init_ras (s);
+	if (s->v2_model) init_model (s->v2_model);
+	s->v2_nsyms = 0;
+	s->v2_nvarints = 0;
+	s->v2_reset = true;
+}
+
+trace_state *new_state (bool flush) {
+	trace_state *s = new trace_state;
+	s->v2_model = NULL;
+	s->v2_tables = NULL;
+	s->v2_events = NULL;
+	s->v2_varints = NULL;
+	s->maxout = OUTBUFSIZE;
+	s->out = (unsigned char *) malloc (s->maxout);
+	s->nout = 0;
+	s->flush = flush;
+	s->ntimes = s->nright = s->total_bytes = s->trace_bytes = 0;
+	s->ras_hits = s->ras_ntimes = 0;
+	memset (s->classmispred, 0, sizeof (s->classmispred));
+	reset_state (s);
+	return s;
+}
+
+void free_state (trace_state *s) {
+	free (s->v2_model);
+	free (s->v2_tables);
+	free (s->v2_events);
+	free (s->v2_varints);
+	free (s->out);
+	delete s;
+}
+
+void flush_out (trace_state *s) {
+	fwrite (s->out, 1, s->nout, stdout);
+	s->nout = 0;
+}
 
-remember rtab[N_REMEMBER][ASSOC];
+void put_out (trace_state *s, const void *p, size_t n) {
+	if (s->nout + n > s->maxout) {
+		if (s->flush) flush_out (s);
+		while (s->nout + n > s->maxout) {
+			s->maxout *= 2;
+			s->out = (unsigned char *) realloc (s->out, s->maxout);
+		}
+	}
+	memcpy (s->out + s->nout, p, n);
+	s->nout += n;
+}
 
-static unsigned int now = 0;
-static remember last_one;
+void put_byte (trace_state *s, unsigned char c) {
+	if (s->nout == s->maxout) put_out (s, &c, 1);
+	else s->out[s->nout++] = c;
+}
 
-remember *predict_remember (void) {
-	unsigned int index = last_one.target & (N_REMEMBER-1);
-	remember *r = &rtab[index][0];
-	return r;
+remember_set *predict_remember (trace_state *s) {
+	return &s->rtab[s->last_one.target & (N_REMEMBER-1)];
 }
 
-int search_remember (remember & me, remember *r, bool ras_correct) {
-	for (int i=0; i<ASSOC; i++) if (me.equal (&r[i], ras_correct)) return i;
+int search_remember (remember & me, remember_set *r, bool ras_correct) {
+	for (int i=0; i<ASSOC; i++)
+		if (r->code[i] == me.code && r->address[i] == me.address
+		 && (ras_correct || r->target[i] == me.target)) return i;
 	return -1;
 }
 
-void update_remember (remember & me, remember *r, bool correct, int index) {
+// make a way the most recently used
+
+void touch_remember (trace_state *s, remember_set *r, unsigned int way) {
+	if (!s->lru_started) {
+		s->lru_started = true;
+		return;
+	}
+	if ((r->lru & 15) == way) return;
+	unsigned int x = r->lru ^ (way * 0x11111111u);
+	unsigned int pos = __builtin_ctz ((x - 0x11111111u) & ~x & 0x88888888u) & ~3;
+	unsigned long long int below = (1ull << pos) - 1;
+	unsigned long long int above = ~0ull << (pos + 4);
+	r->lru = (r->lru & above) | ((r->lru & below) << 4) | way;
+}
+
+void update_remember (trace_state *s, remember & me, remember_set *r, bool correct, int index) {
 	if (correct) {
-		r[index].lru_time = now++;
+		touch_remember (s, r, index);
 	} else {
 		// throw out the LRU item and replace it with me
-		int lru = 0;
-		for (int i=1; i<ASSOC; i++)
-			if (r[i].lru_time < r[lru].lru_time) lru = i;
-		r[lru] = me;
-		r[lru].lru_time = now++;
+		int lru = r->lru >> 28;
+		r->code[lru] = me.code;
+		r->address[lru] = me.address;
+		r->target[lru] = me.target;
+		touch_remember (s, r, lru);
 	}
-	last_one = me;
+	s->last_one = me;
 }
 
-static unsigned int ntimes = 0;
-static unsigned int nright = 0;
-static unsigned int total_bytes = 0, trace_bytes = 0;
+// the position of a way in the LRU order of its set; 0 is most recent
+
+int lru_rank (remember_set *r, int way) {
+	for (int i=0; i<ASSOC; i++) if (((r->lru >> (i*4)) & 15) == (unsigned int) way) return i;
+	assert (0);
+	return -1;
+}
+
+void v2_flush (trace_state *s) {
+	if (!s->v2_nsyms) return;
+
+	// the tables and varints, then the symbols encoded last to first.  a
+	// symbol takes at most 12 bits.
+
+	size_t max = TRACE2_CONTEXTS * 769 + 10 + s->v2_nvarints + (size_t) s->v2_nsyms * 2 + 16;
+	unsigned char *out = (unsigned char *) malloc (max);
+	unsigned char *p = write_tables (s->v2_tables, s->v2_events, s->v2_nsyms, out);
+	p = put_varint (p, s->v2_nvarints);
+	memcpy (p, s->v2_varints, s->v2_nvarints);
+	p += s->v2_nvarints;
+	unsigned char *q = out + max;
+	unsigned int x[2] = { TRACE2_RANS_L, TRACE2_RANS_L };
+	for (unsigned int i=s->v2_nsyms; i-->0;) {
+		trace2_event e = s->v2_events[i];
+		q = rans_encode (&x[(s->v2_nsyms - 1 - i) & 1], q, s->v2_tables->freq[e.context][e.sym], 
+			s->v2_tables->start[e.context][e.sym]);
+	}
+	q = rans_flush (x[1], q);
+	q = rans_flush (x[0], q);
+	memmove (p, q, out + max - q);
+	p += out + max - q;
+
+	trace2_chunk h;
+	h.ntraces = s->v2_nsyms;
+	h.flags = s->v2_reset ? TRACE2_RESET : 0;
+	h.bytes = p - out;
+	put_out (s, &h, sizeof (h));
+	put_out (s, out, h.bytes);
+	free (out);
+	s->v2_nsyms = 0;
+	s->v2_nvarints = 0;
+	s->v2_reset = false;
+}
+
+void v2_put (trace_state *s, int sym) {
+	if (!s->v2_model) {
+		s->v2_model = (trace2_model *) malloc (sizeof (trace2_model));
+		init_model (s->v2_model);
+		s->v2_tables = (trace2_tables *) malloc (sizeof (trace2_tables));
+		s->v2_events = (trace2_event *) malloc (TRACE2_CHUNK * sizeof (trace2_event));
+		s->v2_varints = (unsigned char *) malloc (TRACE2_CHUNK * 10);
+	}
+	s->v2_events[s->v2_nsyms++] = model_symbol (s->v2_model, &predict_remember (s)->v2_last, sym);
+}
+
+// end the chunk if it is full
+
+void v2_end_trace (trace_state *s) {
+	if (s->v2_nsyms == TRACE2_CHUNK) v2_flush (s);
+}
+
+void v2_miss (trace_state *s, remember_set *r, unsigned char code, unsigned int address, unsigned int target) {
+	unsigned int set = s->last_one.target & (N_REMEMBER-1);
+	int victim = s->v2_model ? find_victim (s->v2_model, set, code, address, target) : -1;
+	if (victim >= 0) {
+		v2_put (s, TRACE2_VICTIM + victim);
+		take_victim (s->v2_model, set, victim, &code, &address, &target);
+	} else {
+		v2_put (s, TRACE2_MISS + code - 0x10);
+		unsigned char *p = s->v2_varints + s->v2_nvarints;
+		p = put_varint (p, (int) (address - s->last_one.target));
+		p = put_varint (p, (int) (target - address));
+		s->v2_nvarints = p - s->v2_varints;
+	}
+
+	// the way about to be replaced becomes a victim
+
+	int lru = r->lru >> 28;
+	add_victim (s->v2_model, set, r->code[lru], r->address[lru], r->target[lru]);
+	v2_end_trace (s);
+}
+
+void v2_hit (trace_state *s, int rank, bool ras_correct, bool ras_offby2, bool ras_offby3) {
+	v2_put (s, rank + (ras_correct ? 8 : 0) + (ras_offby2 ? 16 : ras_offby3 ? 32 : 0));
+	v2_end_trace (s);
+}
+
+// predict a trace and write its compressed form; return whether the
+// prediction was correct
+
+bool compress_trace (trace_state *s, unsigned char c, unsigned int address, unsigned int target) {
+	s->ntimes++;
+	assert ((c & 0x80) == 0);
+	remember r(c, address, target, true);
+	remember_set *p = predict_remember (s);
+	bool ras_correct = false;
+	bool ras_offby2 = false;
+	bool ras_offby3 = false;
+	if (c == 0x70) {
+		unsigned int popd = pop_ras (s);
+		ras_correct = popd == target;
+		if (!ras_correct) {
+			if (target == popd + 2) {
+				ras_correct = true;
+				ras_offby2 = true;
+			} else if (target == popd - 3) {
+				ras_correct = true;
+				ras_offby3 = true;
+			}
+		}
+		s->ras_ntimes++;
+		if (!ras_correct)  {
+			//fprintf (stderr, "%x %x\n", popd, target);
+			init_ras (s);
+		}
+		else
+			s->ras_hits++;
+	}
+	int index = search_remember (r, p, ras_correct);
+	bool correct = index != -1;
+	if (version2) {
+		if (correct)
+			v2_hit (s, lru_rank (p, index), ras_correct, ras_offby2, ras_offby3);
+		else
+			v2_miss (s, p, c, address, target);
+	}
+	update_remember (s, r, p, correct, index);
+	if (version2) {
+		if (correct) s->nright++;
+	} else if (correct) {
+		if (ras_correct) index += ASSOC;
+		if (ras_offby2) put_byte (s, 0x82);
+		else if (ras_offby3) put_byte (s, 0x83);
+		put_byte (s, (unsigned char) index);
+		s->nright++;
+		s->total_bytes++;
+	} else {
+		put_byte (s, c);
+		put_out (s, &address, 4);
+		put_out (s, &target, 4);
+		s->total_bytes += 1 + 4 + 4;
+		s->trace_bytes += 1 + 4 + 4;
+	}
+	if (!correct) s->classmispred[c >> 4]++;
+	push_call (s, c, address);
+	return correct;
+}
 
 trace *read_trace (void) {
 	static trace t;
 	static trace last_trace;
-	static int ras_hits = 0, ras_ntimes = 0;
+	trace_state *s = the_state;
 	unsigned char c = read_byte ();
 	if (end_of_file) return NULL;
 	t.bi.br_flags = 0;
@@ -144,16 +434,20 @@ trace *read_trace (void) {
 	// pass along instruction counts unchanged (we don't care)
 	if (c == 0x87) {
 		int x = 0, y = 0;
-		fwrite (&c, 1, 1, stdout);
+		if (version2) {
+			fprintf (stderr, "instruction counts can't be kept in the version 2 format\n");
+			exit (1);
+		}
+		put_byte (s, c);
 		c = read_byte ();
 		x = c;
-		fwrite (&c, 1, 1, stdout);
+		put_byte (s, c);
 		c = read_byte ();
 		y = c;
 		y <<= 8;
 		x |= y;
 		//fprintf (stderr, "%d more insts\n", x);
-		fwrite (&c, 1, 1, stdout);
+		put_byte (s, c);
 		c = read_byte ();
 	}
 	if (compressing) {
@@ -161,71 +455,19 @@ trace *read_trace (void) {
 		t.target = read_uint ();
 		// all branches are taken except for conditional not taken branches
 		t.taken = true;
-	}
-	static unsigned int classmispred[8];
-	ntimes++;
-	bool correct;
-	if (compressing) {
-		assert ((c & 0x80) == 0);
-		remember r(c, t.bi.address, t.target, t.taken);
-		remember *p = predict_remember ();
-		bool ras_correct = false;
-		bool ras_offby2 = false;
-		bool ras_offby3 = false;
-		if (c == 0x70) {
-			unsigned int popd = pop_ras();
-			ras_correct = popd == t.target;
-			if (!ras_correct) {
-				if (t.target == popd + 2) {
-					ras_correct = true;
-					ras_offby2 = true;
-				} else if (t.target == popd - 3) {
-					ras_correct = true;
-					ras_offby3 = true;
-				}
-			}
-			ras_ntimes++;
-			if (!ras_correct)  {
-				//fprintf (stderr, "%x %x\n", popd, t.target);
-				init_ras ();
-			}
-			else
-				ras_hits++;
-		}
-		int index = search_remember (r, p, ras_correct);
-		correct = index != -1;
-		update_remember (r, p, correct, index);
-		if (correct) {
-			unsigned char out;
-			if (ras_correct) index += ASSOC;
-			if (ras_offby2) {
-				out = 0x82;
-				fwrite (&out, 1, 1, stdout);
-			} else if (ras_offby3) {
-				out = 0x83;
-				fwrite (&out, 1, 1, stdout);
-			}
-			out = (unsigned char) index;
-			fwrite (&out, 1, 1, stdout);
-			nright++; 
-			total_bytes++;
-		} else {
-			fwrite (&c, 1, 1, stdout);
-			fwrite (&t.bi.address, 4, 1, stdout);
-			fwrite (&t.target, 4, 1, stdout);
-			total_bytes += 1 + 4 + 4;
-			trace_bytes += 1 + 4 + 4;
-		}
-		if (ntimes % 1000000 == 0) {
-			fprintf (stderr, "%f %f\n", nright / (double) ntimes, trace_bytes / (double) total_bytes);
-			fprintf (stderr, "%f\n", ras_hits / (double) ras_ntimes);
+		compress_trace (s, c, t.bi.address, t.target);
+		if (s->ntimes % 1000000 == 0) {
+			fprintf (stderr, "%f %f\n", s->nright / (double) s->ntimes,
+				s->trace_bytes / (double) s->total_bytes);
+			fprintf (stderr, "%f\n", s->ras_hits / (double) s->ras_ntimes);
 			for (int i=1; i<=7; i++) {
-				fprintf (stderr, "%d %d\n", i, classmispred[i]);
+				fprintf (stderr, "%d %d\n", i, s->classmispred[i]);
 			}
 		}
 	} else {
+		s->ntimes++;
 		remember r;
-		remember *p = predict_remember ();
+		remember_set *p = predict_remember (s);
 		bool ras_offby2 = false, ras_offby3 = false;
 		if (c & 0x80) {
 			if (c == 0x82)
@@ -235,29 +477,29 @@ trace *read_trace (void) {
 			else assert (0);
 			c = read_byte ();
 		}
-		correct = c < ASSOC*2;
+		bool correct = c < ASSOC*2;
 		if (correct) {
 			bool ras_correct = c >= ASSOC;
 			if (ras_correct) c -= ASSOC;
-			r.address = p[c].address;
-			r.target = p[c].target;
-			r.taken = p[c].taken;
-			r.code = p[c].code;
+			r.address = p->address[c];
+			r.target = p->target[c];
+			r.taken = true;
+			r.code = p->code[c];
 			if (r.code == 0x70) {
-				unsigned int popd = pop_ras();
+				unsigned int popd = pop_ras (s);
 				if (ras_correct) {
 					r.target = popd;
 					if (ras_offby2) r.target += 2;
 					else if (ras_offby3) r.target -= 3;
 				}
 				else
-					init_ras();
+					init_ras (s);
 			}
-			assert (r.equal (&p[c], ras_correct));
+			assert (r.code == p->code[c] && r.address == p->address[c]);
 			t.bi.address = r.address;
 			t.target = r.target;
 			t.taken = r.taken;
-			update_remember (r, p, true, (int) c);
+			update_remember (s, r, p, true, (int) c);
 			c = r.code;
 		} else {
 			t.bi.address = read_uint ();
@@ -271,20 +513,21 @@ trace *read_trace (void) {
 			if (r.code == 0x70) {
 				// could be a correct RAS prediction
 				// but with incorrect call site???
-				unsigned int popd = pop_ras ();
+				unsigned int popd = pop_ras (s);
 				if (popd != t.target
 				&& popd != t.target - 2
-				&& popd != t.target + 3) init_ras();
+				&& popd != t.target + 3) init_ras (s);
 			}
-			update_remember (r, p, false, -1);
+			update_remember (s, r, p, false, -1);
+			s->classmispred[c >> 4]++;
 		}
-		fwrite (&c, 1, 1, stdout);
-		fwrite (&t.bi.address, 4, 1, stdout);
-		fwrite (&t.target, 4, 1, stdout);
+		put_byte (s, c);
+		put_out (s, &t.bi.address, 4);
+		put_out (s, &t.target, 4);
+		push_call (s, c, t.bi.address);
 	}
 	t.bi.opcode = c & 15;
 	c >>= 4;
-	if (!correct) classmispred[c]++;
 	switch (c) {
 	case 1: // taken conditional branch
 		t.bi.br_flags |= BR_CONDITIONAL;
@@ -300,11 +543,9 @@ trace *read_trace (void) {
 		break;
 	case 5: // call
 		t.bi.br_flags |= BR_CALL;
-		push_ras (t.bi.address + 5);
 		break;
 	case 6: // indirect call
 		t.bi.br_flags |= BR_CALL | BR_INDIRECT;
-		push_ras (t.bi.address + 2);
 		break;
 	case 7: // return
 		t.bi.br_flags |= BR_RETURN;
@@ -318,9 +559,20 @@ trace *read_trace (void) {
 #define GZIP_MAGIC     "\037\213"
 #define BZIP2_MAGIC	"BZ"
 
-void init_trace (char *fname) {
+// start reading the traces of a file through a pipe from a decompressor
+
+// ct only reads the original and the pre-processed formats; say so rather
+// than failing on the first byte of a version 2 trace, which is 0x89, a
+// code neither format has
+
+static void not_version2 (char *fname) {
+	fprintf (stderr, "%s: a version 2 trace; ct only reads the original and pre-processed formats\n", fname);
+	exit (1);
+}
+
+void open_input (char *fname) {
 	char *dc;
-	char s[2] = { 0, 0 };
+	char s[4] = { 0, 0, 0, 0 };
 	char cmd[1000];
 
 	// figure out the compression method from the magic number
@@ -328,14 +580,20 @@ void init_trace (char *fname) {
 	if (!strcmp (fname, "-")) {
 		fprintf (stderr, "reading from standard input\n");
 		tracefp = stdin;
+		int c = getc (stdin);
+		if (c == (unsigned char) TRACE2_MAGIC[0]) not_version2 (fname);
+		ungetc (c, stdin);
 	} else {
 	FILE *f = fopen (fname, "r");
 	if (!f) {
 		perror (fname);
+		exit (1);
 	}
-	fread (s, 1, 2, f);
+	fread (s, 1, 4, f);
 	fclose (f);
-	if (strncmp (s, GZIP_MAGIC, 2) == 0) 
+	if (memcmp (s, TRACE2_MAGIC, 4) == 0)
+		not_version2 (fname);
+	if (strncmp (s, GZIP_MAGIC, 2) == 0)
 		fprintf (stderr, "GZIP\n"), dc = ZCAT;
 	else if (strncmp (s, BZIP2_MAGIC, 2) == 0)
 		fprintf (stderr, "BZIP2\n"), dc = BZCAT;
@@ -357,12 +615,191 @@ void init_trace (char *fname) {
 	bufpos = 0;
 	bufsize = 0;
 	end_of_file = false;
-	memset (rtab, 0, sizeof (rtab));
-	now = 0;
-	init_ras();
 }
 
-void end_trace (void) {
-	if (compressing) fprintf (stderr, "pred rate: %f ; trace bytes rate: %f\n", nright / (double) ntimes, trace_bytes / (double) total_bytes);
+void close_input (void) {
 	if (tracefp != stdin) pclose (tracefp);
 }
+
+void init_trace (char *fname) {
+	open_input (fname);
+	the_state = new_state (true);
+	if (version2) put_out (the_state, TRACE2_MAGIC, 4);
+}
+
+void end_trace (void) {
+	trace_state *s = the_state;
+	if (version2) v2_flush (s);
+	flush_out (s);
+	if (compressing) fprintf (stderr, "pred rate: %f ; trace bytes rate: %f\n", s->nright / (double) s->ntimes, s->trace_bytes / (double) s->total_bytes);
+	close_input ();
+	free_state (s);
+	the_state = NULL;
+}
+
+// compressing a file into independent blocks with -b.  the main thread
+// reads the traces of each block, worker threads compress the blocks,
+// and the main thread writes them in order.  a block's slot is reused
+// once it has been written.
+
+struct raw_trace {
+	unsigned char code;
+	unsigned int address, target;
+};
+
+struct block_job {
+	raw_trace *traces;
+	unsigned int ntraces;
+
+	// the compressed block, when done is true
+
+	unsigned char *out;
+	size_t nout;
+	unsigned int nright;
+	bool queued, done;
+};
+
+static block_job *jobs;
+static int njobs;
+static long long int next_job, jobs_read;
+static bool no_more_jobs;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER, job_done = PTHREAD_COND_INITIALIZER;
+
+// a worker thread; keep compressing the next block read
+
+static void *block_worker (void *) {
+	trace_state *s = new_state (false);
+	for (;;) {
+		pthread_mutex_lock (&job_lock);
+		while (next_job == jobs_read && !no_more_jobs) pthread_cond_wait (&job_ready, &job_lock);
+		if (next_job == jobs_read) {
+			pthread_mutex_unlock (&job_lock);
+			break;
+		}
+		block_job *j = &jobs[next_job++ % njobs];
+		pthread_mutex_unlock (&job_lock);
+
+		reset_state (s);
+		s->nright = 0;
+		for (unsigned int i=0; i<j->ntraces; i++)
+			compress_trace (s, j->traces[i].code, j->traces[i].address, j->traces[i].target);
+		v2_flush (s);
+
+		// hand the output over to the job
+
+		pthread_mutex_lock (&job_lock);
+		j->out = s->out;
+		j->nout = s->nout;
+		j->nright = s->nright;
+		j->done = true;
+		s->maxout = OUTBUFSIZE;
+		s->out = (unsigned char *) malloc (s->maxout);
+		s->nout = 0;
+		pthread_cond_broadcast (&job_done);
+		pthread_mutex_unlock (&job_lock);
+	}
+	free_state (s);
+	return NULL;
+}
+
+// wait for a block to be compressed and write it
+
+static void write_block (block_job *j, long long int *offset, trace2_block *b, long long int *nright) {
+	pthread_mutex_lock (&job_lock);
+	while (!j->done) pthread_cond_wait (&job_done, &job_lock);
+	pthread_mutex_unlock (&job_lock);
+	b->offset = *offset;
+	fwrite (j->out, 1, j->nout, stdout);
+	*offset += j->nout;
+	*nright += j->nright;
+	free (j->out);
+	j->queued = false;
+}
+
+// compress a file into blocks of TRACE2_BLOCK traces with nthreads
+// threads, followed by the directory of the blocks; return the number
+// of traces
+
+long long int compress_blocks (char *fname, int nthreads) {
+	open_input (fname);
+	njobs = nthreads + 1;
+	jobs = new block_job[njobs];
+	for (int i=0; i<njobs; i++) {
+		jobs[i].traces = (raw_trace *) malloc (TRACE2_BLOCK * sizeof (raw_trace));
+		jobs[i].queued = false;
+	}
+	next_job = 0;
+	jobs_read = 0;
+	no_more_jobs = false;
+	pthread_t *threads = new pthread_t[nthreads];
+	for (int i=0; i<nthreads; i++) pthread_create (&threads[i], NULL, block_worker, NULL);
+
+	fwrite (TRACE2_MAGIC, 1, 4, stdout);
+	long long int offset = 4, ntraces = 0, nright = 0, nblocks = 0, written = 0;
+	trace2_block *blocks = NULL;
+	while (!end_of_file) {
+
+		// read a block into the next slot, writing the block that
+		// was in it first
+
+		block_job *j = &jobs[nblocks % njobs];
+		if (j->queued) {
+			write_block (j, &offset, &blocks[written], &nright);
+			written++;
+		}
+		j->ntraces = 0;
+		while (j->ntraces < TRACE2_BLOCK) {
+			unsigned char c = read_byte ();
+			if (end_of_file) break;
+			if (c & 0x80) {
+				fprintf (stderr, "instruction counts can't be kept in the version 2 format\n");
+				exit (1);
+			}
+			raw_trace *t = &j->traces[j->ntraces++];
+			t->code = c;
+			t->address = read_uint ();
+			t->target = read_uint ();
+		}
+		if (!j->ntraces) break;
+		blocks = (trace2_block *) realloc (blocks, (nblocks + 1) * sizeof (trace2_block));
+		blocks[nblocks].first = ntraces;
+		ntraces += j->ntraces;
+		nblocks++;
+		pthread_mutex_lock (&job_lock);
+		j->done = false;
+		j->queued = true;
+		jobs_read++;
+		pthread_cond_signal (&job_ready);
+		pthread_mutex_unlock (&job_lock);
+	}
+	pthread_mutex_lock (&job_lock);
+	no_more_jobs = true;
+	pthread_cond_broadcast (&job_ready);
+	pthread_mutex_unlock (&job_lock);
+	for (; written<nblocks; written++) write_block (&jobs[written % njobs], &offset, &blocks[written], &nright);
+	for (int i=0; i<nthreads; i++) pthread_join (threads[i], NULL);
+
+	// the directory, ending with where the last block ends, and where
+	// it starts
+
+	blocks = (trace2_block *) realloc (blocks, (nblocks + 1) * sizeof (trace2_block));
+	blocks[nblocks].offset = offset;
+	blocks[nblocks].first = ntraces;
+	trace2_chunk h;
+	h.ntraces = nblocks;
+	h.flags = TRACE2_DIRECTORY;
+	h.bytes = (nblocks + 1) * sizeof (trace2_block);
+	fwrite (&h, sizeof (h), 1, stdout);
+	fwrite (blocks, sizeof (trace2_block), nblocks + 1, stdout);
+	fwrite (&offset, sizeof (offset), 1, stdout);
+	fflush (stdout);
+	fprintf (stderr, "%lld blocks ; pred rate: %f\n", nblocks, nright / (double) ntraces);
+
+	for (int i=0; i<njobs; i++) free (jobs[i].traces);
+	delete[] jobs;
+	delete[] threads;
+	free (blocks);
+	close_input ();
+	return ntraces;
+}
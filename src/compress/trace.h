@@ -15,3 +15,4 @@ struct trace {
 void init_trace (char *);
 trace *read_trace (void);
 void end_trace (void);
+long long int compress_blocks (char *, int);
@@ -0,0 +1,243 @@
+// driver.h
+// This file contains the pieces of the driver shared by predict.cc and
+// the files implementing its other modes.
+
+// call a branch predictor's methods.  when the class of the predictor is
+// known at compile time, the calls go straight to that class's methods so
+// the compiler can inline them into the simulation loop; a predictor only
+// known as a branch_predictor is called through the virtual methods.  for
+// the sample my_predictor bench finds no difference between the two.
+
+template <class P>
+struct dispatch {
+	static branch_update *predict (P *p, branch_info & b) {
+		return p->P::predict (b);
+	}
+	static void update (P *p, branch_update *u, bool taken, unsigned int target) {
+		p->P::update (u, taken, target);
+	}
+	static void warm (P *p, branch_info & b, bool taken, unsigned int target) {
+		p->P::warm (b, taken, target);
+	}
+};
+
+template <>
+struct dispatch<branch_predictor> {
+	static branch_update *predict (branch_predictor *p, branch_info & b) {
+		return p->predict (b);
+	}
+	static void update (branch_predictor *p, branch_update *u, bool taken, unsigned int target) {
+		p->update (u, taken, target);
+	}
+	static void warm (branch_predictor *p, branch_info & b, bool taken, unsigned int target) {
+		p->warm (b, taken, target);
+	}
+};
+
+// feed one trace to the branch predictor and count its mispredictions
+
+template <class P>
+static inline void predict_trace (P *p, trace *t, 
+	long long int & tmiss, long long int & dmiss) {
+
+	// send this trace to the competitor's code for prediction
+
+	branch_update *u = dispatch<P>::predict (p, t->bi);
+
+	// collect statistics for a conditional branch trace
+
+	if (t->bi.br_flags & BR_CONDITIONAL) {
+
+		// count a direction misprediction
+
+		dmiss += u->direction_prediction () != t->taken;
+
+		// count a target misprediction
+
+		tmiss += u->target_prediction () != t->target;
+	}
+
+	// update competitor's state
+
+	dispatch<P>::update (p, u, t->taken, t->target);
+}
+
+// turn a trace from a trace cache back into a trace
+
+static inline void unpack_trace (trace & t, cached_trace & c) {
+	t.bi.address = c.address;
+	t.bi.opcode = c.opcode;
+	t.bi.br_flags = c.br_flags;
+	t.target = c.target;
+	t.taken = c.taken;
+}
+
+// where the traces of a trace file come from: the trace cache if there
+// is one, otherwise the file itself.  next gives back the traces a batch
+// at a time.  seek moves to another trace, using the trace file's index if
+// it has one.  save and restore write and read the position in the file
+// for a checkpoint.
+
+class trace_source {
+	trace_map m;
+	bool mapped;
+	long long int pos;
+	trace_reader *tr;
+	trace *batch;
+
+public:
+	long long int ninstructions;
+
+	trace_source (char *fname) : pos(0), tr(NULL), ninstructions(trace_file_instructions ()) {
+		batch = new trace[TRACE_BATCH];
+		mapped = map_trace (fname, &m);
+		if (mapped) 
+			ninstructions = m.ninstructions;
+		else
+			tr = open_trace (fname);
+	}
+
+	~trace_source (void) {
+		if (mapped) unmap_trace (&m);
+		else close_trace (tr);
+		delete[] batch;
+	}
+
+	// number of traces given out so far
+
+	long long int position (void) {
+		return pos;
+	}
+
+	// point t at the next batch of up to max traces and return how many
+	// there are; zero means the end of the trace file
+
+	size_t next (trace **t, size_t max = TRACE_BATCH) {
+		*t = batch;
+		if (max > TRACE_BATCH) max = TRACE_BATCH;
+		size_t n;
+		if (!mapped) 
+			n = read_traces (tr, batch, max);
+		else {
+			n = m.ntraces - pos < (long long int) max ? m.ntraces - pos : max;
+			for (size_t i=0; i<n; i++) unpack_trace (batch[i], m.traces[pos+i]);
+		}
+		pos += n;
+		return n;
+	}
+
+	// the number of traces in the file, or -1 if that can't be known
+	// without reading them all
+
+	long long int length (void) {
+		return mapped ? m.ntraces : count_traces (tr);
+	}
+
+	// move to trace number n; return the number moved to, which is
+	// less than n if the file has fewer traces
+
+	long long int seek (long long int n) {
+		if (!mapped) 
+			pos = seek_trace (tr, n);
+		else
+			pos = n < m.ntraces ? n : m.ntraces;
+		return pos;
+	}
+
+	// write the position to a checkpoint, with the decoder's state if
+	// the traces are being decoded
+
+	bool save (FILE *f) {
+		int decoding = !mapped;
+		return fwrite (&pos, sizeof (pos), 1, f) == 1
+			&& fwrite (&decoding, sizeof (decoding), 1, f) == 1
+			&& (!decoding || save_trace (tr, f));
+	}
+
+	// go to the position in a checkpoint.  from a trace cache that's
+	// just an index; otherwise the decoder's state is restored, or if
+	// the checkpoint doesn't have it the traces are decoded and thrown
+	// away.
+
+	bool restore (FILE *f) {
+		long long int n;
+		int decoding;
+		if (fread (&n, sizeof (n), 1, f) != 1 
+		 || fread (&decoding, sizeof (decoding), 1, f) != 1) return false;
+		if (mapped) {
+			if (n > m.ntraces) return false;
+			pos = n;
+			return true;
+		}
+		if (decoding) {
+			if (!restore_trace (tr, f)) return false;
+			pos = n;
+			return true;
+		}
+		while (pos < n) {
+			size_t k = read_traces (tr, batch, n - pos < TRACE_BATCH ? n - pos : TRACE_BATCH);
+			if (!k) return false;
+			pos += k;
+		}
+		return true;
+	}
+};
+
+// run a branch predictor over every trace from a source.  P is the class
+// of the predictor; use simulate<branch_predictor> for a predictor that
+// is only known through the virtual interface.  S is any class with a
+// next method like trace_source's.
+
+template <class P, class S>
+static void simulate (P *p, S & src, long long int & tmiss, long long int & dmiss) {
+	trace *t;
+	for (;;) {
+		size_t n = src.next (&t);
+		if (!n) break;
+		for (size_t i=0; i<n; i++) predict_trace (p, &t[i], tmiss, dmiss);
+	}
+}
+
+// the number of threads to use for a parallel mode
+
+static inline int processors (void) {
+	int n = sysconf (_SC_NPROCESSORS_ONLN);
+	return n < 1 ? 1 : n;
+}
+
+// the driver's other modes
+
+void run_sweep (char *, bool, int, char *[]);
+double run_pipeline (char *);
+void run_profile (char *, int);
+void run_targets (char *);
+void run_perf (char *);
+
+// options for running with checkpoints; see checkpoint.cc
+
+struct checkpoint_options {
+	char *save;		// file to write checkpoints to, or NULL
+	long long int every;	// traces between checkpoints; 0 for only at the end
+	long long int until;	// traces to stop after; 0 for the whole file
+	char *resume;		// checkpoint to continue from, or NULL
+	char *warm;		// checkpoint to take only the predictor from, or NULL
+};
+
+void run_checkpoint (char *, checkpoint_options *);
+
+// options for sampled simulation; see sample.cc
+
+struct sample_options {
+	long long int length;	// traces in an interval
+	long long int period;	// measure one interval out of this many
+	long long int warmup;	// traces to warm up before an interval, or -1 to warm all
+	char *weights;		// file of intervals and weights to measure, or NULL
+};
+
+void run_sample (char *, sample_options *);
+
+double run_parallel (char *, int, long long int, bool);
+
+// traces between decoder snapshots in an index made by --index
+
+#define INDEX_EVERY	(1<<20)
@@ -0,0 +1,109 @@
+// gen.cc
+// This file contains gen, which writes a synthetic trace made up by the
+// generator in generator.h.  "gen [-o <file>] [<knobs>]" writes the traces
+// to the file, or to standard output, in the original uncompressed format:
+// for each branch a code byte giving its kind, then its address and its
+// target, 4 bytes each, least significant byte first.  predict reads this
+// format as it is, so the output can be piped straight into it:
+//
+//	gen branches=0,static=100000 | predict /dev/stdin
+//
+// The format has no room for the number of instructions, which gen prints
+// at the end: "gap" instructions per branch.  predict takes a trace file to
+// be 100 million instructions long, so for the right MPKI tell it:
+//
+//	gen branches=2000000 | predict --instructions 10000000 /dev/stdin
+//
+// and it is also what "ct -c" compresses, so a smaller file for later is
+//
+//	gen branches=1000000000 | ct -c - | bzip2 > big.trace.bz2
+//
+// "gen -h" lists the knobs.  The traces are the same as
+// "predict --generate" simulates with the same knobs, without going through
+// a file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "generator.h"
+
+// the code byte of a trace: its kind in the high 4 bits and its opcode in
+// the low 4, as in compress/trace.cc
+
+static unsigned char trace_code (trace & t) {
+	int flags = t.bi.br_flags;
+	int kind;
+	if (flags & BR_CONDITIONAL)
+		kind = t.taken ? 1 : 2;
+	else if (flags & BR_RETURN)
+		return 0x70;
+	else if ((flags & BR_CALL) && (flags & BR_INDIRECT))
+		kind = 6;
+	else if (flags & BR_CALL)
+		kind = 5;
+	else if (flags & BR_INDIRECT)
+		kind = 4;
+	else
+		kind = 3;
+	return (kind << 4) | (t.bi.opcode & 15);
+}
+
+static void put_uint (unsigned char *p, unsigned int x) {
+	p[0] = x;
+	p[1] = x >> 8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+
+static void usage (char *name) {
+	fprintf (stderr, "Usage: %s [-o <filename>] [<knob>=<value>[,...]]\n", name);
+	fprintf (stderr, "knobs and their defaults:\n");
+	generator_help (stderr);
+	exit (1);
+}
+
+int main (int argc, char *argv[]) {
+	char *out = NULL, *spec = NULL;
+	for (int i=1; i<argc; i++) {
+		if (strcmp (argv[i], "-o") == 0 && i + 1 < argc)
+			out = argv[++i];
+		else if (argv[i][0] != '-' && !spec)
+			spec = argv[i];
+		else
+			usage (argv[0]);
+	}
+	generator_config config;
+	if (spec) parse_generator (spec, &config);
+
+	FILE *f = out ? fopen (out, "wb") : stdout;
+	if (!f) {
+		perror (out);
+		exit (1);
+	}
+	static unsigned char buf[TRACE_BATCH * 9];
+	trace_generator g (config);
+	trace *t;
+	size_t n;
+	while ((n = g.next (&t))) {
+		unsigned char *p = buf;
+		for (size_t i=0; i<n; i++) {
+			*p++ = trace_code (t[i]);
+			put_uint (p, t[i].bi.address);
+			put_uint (p + 4, t[i].target);
+			p += 8;
+		}
+		if (fwrite (buf, p - buf, 1, f) != 1) {
+			perror (out ? out : "standard output");
+			exit (1);
+		}
+	}
+	if (fclose (f) != 0) {
+		perror (out ? out : "standard output");
+		exit (1);
+	}
+	fprintf (stderr, "%lld branches, %lld instructions\n", g.position (), g.ninstructions);
+	return 0;
+}
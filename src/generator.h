@@ -0,0 +1,364 @@
+// generator.h
+// This file contains a generator of synthetic traces, for running
+// predictors and the driver over far more branches than the trace files
+// hold.  It walks a made-up program of static conditional branches grouped
+// into functions, calling and returning between them, and gives out the
+// traces a batch at a time like trace_source, so simulate can run a
+// predictor on it directly; gen.cc writes the same traces to a file.
+//
+// Each conditional branch behaves one of three ways, chosen when the
+// program is made up:
+//
+// - a loop branch closes a loop of from 2 to "trip" iterations: it is
+//   taken one less time than that and then not taken once, over and over
+// - a correlated branch is the xor of the outcomes of two of the last
+//   "distance" conditional branches, so only a predictor with enough
+//   global history gets it right
+// - any other branch is taken with probability "bias", so 0.5 is a coin
+//   and 1 always taken
+//
+// Between conditional branches the program calls another function with
+// probability "calls", returns with the same probability when it is
+// inside a call, and makes an indirect jump with probability "indirect".
+// Calls nest at most "depth" deep.  A fraction "indirect" of the calls are
+// indirect too.  Each indirect jump or call picks one of "fanout" targets
+// at random.  Returns go back to just after the call, the way the trace
+// decoder expects.
+//
+// The knobs are given as a string of name=value pairs separated by commas,
+// e.g. "static=65536,bias=0.95,loops=0.2"; see generator_knobs for all of
+// them and their defaults.  "branches=0" never ends.
+
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include <stddef.h>
+
+// conditional branches in each function of the made-up program
+
+#define GENERATOR_FUNCTION	16
+
+// where the program's code starts, and the bytes between functions
+
+#define GENERATOR_BASE		0x08048000u
+#define GENERATOR_STRIDE	0x400u
+
+// the knobs
+
+struct generator_config {
+	long long int branches;	// traces to give out, or 0 for no end
+	int statics;		// static conditional branches
+	double bias;		// probability an ordinary branch is taken
+	double loops;		// fraction of conditional branches that are loops
+	int trip;		// most iterations of a loop
+	double correlated;	// fraction that depend on the global history
+	int distance;		// furthest back in the history they look, up to 64
+	double calls;		// probability of a call, and of a return
+	int depth;		// deepest nesting of calls
+	double indirect;	// probability of an indirect jump; fraction of calls indirect
+	int fanout;		// targets of each indirect jump or call
+	int gap;		// instructions per branch, for MPKI
+	unsigned int seed;
+
+	generator_config (void) : branches(100000000LL), statics(4096), bias(0.9),
+		loops(0.1), trip(16), correlated(0.2), distance(16), calls(0.02),
+		depth(16), indirect(0.01), fanout(4), gap(5), seed(1) {}
+};
+
+// the knobs by name, for parsing a spec
+
+enum generator_type { GEN_LONG, GEN_INT, GEN_DOUBLE, GEN_UNSIGNED };
+
+struct generator_knob {
+	const char *name;
+	generator_type type;
+	size_t offset;
+	const char *help;
+};
+
+static const generator_knob generator_knobs[] = {
+	{ "branches", GEN_LONG, offsetof (generator_config, branches), "traces to generate, 0 for no end" },
+	{ "static", GEN_INT, offsetof (generator_config, statics), "static conditional branches" },
+	{ "bias", GEN_DOUBLE, offsetof (generator_config, bias), "probability an ordinary branch is taken" },
+	{ "loops", GEN_DOUBLE, offsetof (generator_config, loops), "fraction of branches that are loops" },
+	{ "trip", GEN_INT, offsetof (generator_config, trip), "most iterations of a loop" },
+	{ "correlated", GEN_DOUBLE, offsetof (generator_config, correlated), "fraction correlated with the history" },
+	{ "distance", GEN_INT, offsetof (generator_config, distance), "how far back they are correlated, up to 64" },
+	{ "calls", GEN_DOUBLE, offsetof (generator_config, calls), "probability of a call, and of a return" },
+	{ "depth", GEN_INT, offsetof (generator_config, depth), "deepest nesting of calls" },
+	{ "indirect", GEN_DOUBLE, offsetof (generator_config, indirect), "probability of an indirect jump" },
+	{ "fanout", GEN_INT, offsetof (generator_config, fanout), "targets of each indirect jump or call" },
+	{ "gap", GEN_INT, offsetof (generator_config, gap), "instructions per branch" },
+	{ "seed", GEN_UNSIGNED, offsetof (generator_config, seed), "random seed" },
+};
+
+#define GENERATOR_KNOBS	((int) (sizeof (generator_knobs) / sizeof (generator_knobs[0])))
+
+// print the knobs and their defaults
+
+static void generator_help (FILE *f) {
+	generator_config c;
+	for (int i=0; i<GENERATOR_KNOBS; i++) {
+		const generator_knob *k = &generator_knobs[i];
+		void *v = (char *) &c + k->offset;
+		fprintf (f, "  %-12s", k->name);
+		switch (k->type) {
+		case GEN_LONG: fprintf (f, "%-12lld", *(long long int *) v); break;
+		case GEN_INT: fprintf (f, "%-12d", *(int *) v); break;
+		case GEN_DOUBLE: fprintf (f, "%-12g", *(double *) v); break;
+		case GEN_UNSIGNED: fprintf (f, "%-12u", *(unsigned int *) v); break;
+		}
+		fprintf (f, "%s\n", k->help);
+	}
+}
+
+// set the knobs named in a spec like "static=1024,bias=0.8"; exit with a
+// message on anything wrong
+
+static void parse_generator (const char *spec, generator_config *c) {
+	char *s = strdup (spec);
+	for (char *save, *item = strtok_r (s, ",", &save); item; item = strtok_r (NULL, ",", &save)) {
+		char *eq = strchr (item, '=');
+		int i;
+		if (eq) {
+			*eq = 0;
+			for (i=0; i<GENERATOR_KNOBS; i++) if (strcmp (item, generator_knobs[i].name) == 0) break;
+		}
+		if (!eq || i == GENERATOR_KNOBS) {
+			fprintf (stderr, "generator: unknown knob \"%s\"; the knobs and their defaults are:\n", item);
+			generator_help (stderr);
+			exit (1);
+		}
+		const generator_knob *k = &generator_knobs[i];
+		void *v = (char *) c + k->offset;
+		char *end;
+		switch (k->type) {
+		case GEN_LONG: *(long long int *) v = strtoll (eq + 1, &end, 0); break;
+		case GEN_INT: *(int *) v = strtol (eq + 1, &end, 0); break;
+		case GEN_DOUBLE: *(double *) v = strtod (eq + 1, &end); break;
+		case GEN_UNSIGNED: *(unsigned int *) v = strtoul (eq + 1, &end, 0); break;
+		}
+		if (end == eq + 1 || *end) {
+			fprintf (stderr, "generator: bad value \"%s\" for %s\n", eq + 1, item);
+			exit (1);
+		}
+	}
+	free (s);
+	if (c->branches < 0 || c->statics < 1 || c->trip < 2 || c->trip > 65535 || c->distance < 2 || c->distance > 64
+	 || c->depth < 0 || c->fanout < 1 || c->gap < 1
+	 || c->bias < 0 || c->bias > 1 || c->loops < 0 || c->correlated < 0 || c->loops + c->correlated > 1
+	 || c->calls < 0 || c->indirect < 0 || 2 * c->calls + c->indirect > 1) {
+		fprintf (stderr, "generator: knobs out of range in \"%s\"\n", spec);
+		exit (1);
+	}
+}
+
+class trace_generator {
+
+	// one static conditional branch: how it behaves, and its state
+
+	enum { ORDINARY, LOOP, CORRELATED };
+
+	struct site {
+		unsigned char kind;
+		unsigned char a, b;	// for a correlated branch, the history bits it xors
+		unsigned short trip;	// for a loop, its iterations
+		unsigned short count;	// and how many it has done
+	};
+
+	// a call that hasn't returned: where it returns to, and where the
+	// caller goes on from
+
+	struct frame {
+		unsigned int return_address;
+		int function, branch;
+	};
+
+	generator_config c;
+	int nfunctions;
+	site *sites;
+	frame *stack;
+	int depth;
+
+	// the function running and its next conditional branch
+
+	int function, branch;
+
+	unsigned long long int history, state;
+	long long int pos;
+	trace *batch;
+
+	// a 64-bit xorshift random number, and one from 0 to 1
+
+	unsigned long long int random (void) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	double uniform (void) {
+		return (random () >> 11) * (1.0 / (1ull << 53));
+	}
+
+	// a number from 0 to n-1 fixed by a and b, for choosing the callee
+	// and targets of a call site
+
+	unsigned int pick (unsigned int a, unsigned int b, unsigned int n) {
+		unsigned long long int h = (a * 0x9e3779b97f4a7c15ull) ^ (b * 0xc2b2ae3d27d4eb4full) ^ c.seed;
+		h ^= h >> 29;
+		h *= 0xbf58476d1ce4e5b9ull;
+		h ^= h >> 32;
+		return h % n;
+	}
+
+	unsigned int entry (int f) { return GENERATOR_BASE + f * GENERATOR_STRIDE; }
+
+	// the address of conditional branch i of function f; the call,
+	// return and indirect jump sites come after it
+
+	unsigned int address (int f, int i) { return entry (f) + 0x10 + i * 0x20; }
+
+	// the outcome of a conditional branch
+
+	bool outcome (site *s) {
+		switch (s->kind) {
+		case LOOP:
+			if (++s->count < s->trip) return true;
+			s->count = 0;
+			return false;
+		case CORRELATED:
+			return ((history >> s->a) ^ (history >> s->b)) & 1;
+		default:
+			return uniform () < c.bias;
+		}
+	}
+
+	// make up a call from after conditional branch branch, to a callee
+	// fixed by the call site or, for an indirect call, to one of fanout
+
+	void call (trace & t) {
+		unsigned int a = address (function, branch) + 8;
+		int callee;
+		if (uniform () < c.indirect) {
+			t.bi.br_flags = BR_CALL | BR_INDIRECT;
+			callee = pick (a, random () % c.fanout, nfunctions);
+			stack[depth].return_address = a + 2;
+		} else {
+			t.bi.br_flags = BR_CALL;
+			callee = pick (a, 0, nfunctions);
+			stack[depth].return_address = a + 5;
+		}
+		stack[depth].function = function;
+		stack[depth].branch = branch;
+		depth++;
+		t.bi.address = a;
+		t.target = entry (callee);
+		function = callee;
+		branch = 0;
+	}
+
+	// make up a return to the caller
+
+	void ret (trace & t) {
+		depth--;
+		t.bi.br_flags = BR_RETURN;
+		t.bi.address = address (function, branch) + 0x10;
+		t.target = stack[depth].return_address;
+		function = stack[depth].function;
+		branch = stack[depth].branch;
+	}
+
+	// make up an indirect jump to one of fanout branches of this function
+
+	void jump (trace & t) {
+		unsigned int a = address (function, branch) + 0x18;
+		t.bi.br_flags = BR_INDIRECT;
+		t.bi.address = a;
+		branch = pick (a, random () % c.fanout, GENERATOR_FUNCTION);
+		t.target = address (function, branch) - 8;
+	}
+
+	// make up a conditional branch that falls through to the next one or
+	// jumps to the one after
+
+	void conditional (trace & t) {
+		site *s = &sites[function * GENERATOR_FUNCTION + branch];
+		int over = (branch + 2) % GENERATOR_FUNCTION;
+		t.bi.br_flags = BR_CONDITIONAL;
+		t.bi.opcode = 4 + (branch & 1);
+		t.bi.address = address (function, branch);
+		t.target = address (function, over) - 8;
+		t.taken = outcome (s);
+		history = (history << 1) | t.taken;
+		branch = t.taken ? over : (branch + 1) % GENERATOR_FUNCTION;
+	}
+
+	// make up the next trace.  a call too deep or a return with nothing
+	// to return to is a conditional branch instead.
+
+	void generate (trace & t) {
+		double r = uniform ();
+		t.bi.opcode = 0;
+		t.taken = true;
+		if (r < c.calls && depth < c.depth)
+			call (t);
+		else if (r >= c.calls && r < 2 * c.calls && depth > 0)
+			ret (t);
+		else if (r >= 2 * c.calls && r < 2 * c.calls + c.indirect)
+			jump (t);
+		else
+			conditional (t);
+	}
+
+public:
+	long long int ninstructions;
+
+	trace_generator (const generator_config & config) : c(config), depth(0), function(0), branch(0),
+		history(0), pos(0), ninstructions(0) {
+		nfunctions = (c.statics + GENERATOR_FUNCTION - 1) / GENERATOR_FUNCTION;
+		state = 0x9e3779b97f4a7c15ull ^ c.seed;
+		int n = nfunctions * GENERATOR_FUNCTION;
+		sites = new site[n];
+		for (int i=0; i<n; i++) {
+			site *s = &sites[i];
+			double r = uniform ();
+			s->kind = r < c.loops ? LOOP : r < c.loops + c.correlated ? CORRELATED : ORDINARY;
+			s->trip = 2 + random () % (c.trip - 1);
+			s->count = 0;
+			s->a = random () % c.distance;
+			s->b = (s->a + 1 + random () % (c.distance - 1)) % c.distance;
+		}
+		stack = new frame[c.depth + 1];
+		batch = new trace[TRACE_BATCH];
+	}
+
+	~trace_generator (void) {
+		delete[] sites;
+		delete[] stack;
+		delete[] batch;
+	}
+
+	// number of traces given out so far
+
+	long long int position (void) {
+		return pos;
+	}
+
+	// point t at the next batch of up to max traces and return how many
+	// there are; zero means the generator has given out all it was asked
+	// for
+
+	size_t next (trace **t, size_t max = TRACE_BATCH) {
+		*t = batch;
+		if (max > TRACE_BATCH) max = TRACE_BATCH;
+		size_t n = max;
+		if (c.branches && c.branches - pos < (long long int) max) n = c.branches - pos;
+		for (size_t i=0; i<n; i++) generate (batch[i]);
+		pos += n;
+		ninstructions = pos * c.gap;
+		return n;
+	}
+};
+
+#endif
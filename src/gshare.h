@@ -0,0 +1,142 @@
+// gshare.h
+// This file contains two gshare predictors.  gshare_predictor has its
+// table size and history length chosen at run time.  The sweep mode of
+// the driver simulates many configurations of it at once with its own
+// code in sweep.cc, which must make the same predictions as this;
+// "predict --sweep --check" makes sure it does.
+// gshare is a template with the table size, history length and counter
+// width fixed at compile time, for building predictors out of; the sample
+// my_predictor is a gshare<17,15,2>.  With the same table size and
+// history length and 2-bit counters, the two make exactly the same
+// predictions.
+
+#ifndef GSHARE_H
+#define GSHARE_H
+
+class gshare_update : public branch_update {
+public:
+	unsigned int index;
+};
+
+class gshare_predictor : public branch_predictor {
+public:
+	gshare_update u;
+	branch_info bi;
+	int table_bits, history_length;
+	unsigned int history;
+	unsigned char *tab;
+
+	gshare_predictor (int tb, int hl) : table_bits(tb), history_length(hl), history(0) {
+		tab = new unsigned char[1<<table_bits];
+		memset (tab, 0, 1<<table_bits);
+	}
+
+	~gshare_predictor (void) {
+		delete[] tab;
+	}
+
+	branch_update *predict (branch_info & b) {
+		bi = b;
+		if (b.br_flags & BR_CONDITIONAL) {
+			u.index = 
+				  (history << (table_bits - history_length)) 
+				^ (b.address & ((1<<table_bits)-1));
+			u.direction_prediction (tab[u.index] >> 1);
+		} else {
+			u.direction_prediction (true);
+		}
+		u.target_prediction (0);
+		return &u;
+	}
+
+	void update (branch_update *u, bool taken, unsigned int target) {
+		if (bi.br_flags & BR_CONDITIONAL) {
+			unsigned char *c = &tab[((gshare_update*)u)->index];
+			if (taken) {
+				if (*c < 3) (*c)++;
+			} else {
+				if (*c > 0) (*c)--;
+			}
+			history <<= 1;
+			history |= taken;
+			history &= (1<<history_length)-1;
+		}
+	}
+};
+
+// a table of 1<<TableBits CounterBits-bit saturating counters indexed by
+// the address of a branch xored with HistLen bits of global history.  the
+// counters are packed 8/CounterBits to a byte, so the default 2-bit
+// counters take a quarter of the space of one per byte.  an instance has
+// no state outside itself, so any number of them, with the same or
+// different parameters, can be used at once.
+
+template <int TableBits, int HistLen, int CounterBits = 2>
+class gshare {
+	static_assert (TableBits >= 1 && TableBits <= 30, "gshare table bits must be from 1 to 30");
+	static_assert (HistLen >= 0 && HistLen <= TableBits, "gshare history can't be longer than the index");
+	static_assert (CounterBits == 1 || CounterBits == 2 || CounterBits == 4 || CounterBits == 8,
+		"gshare counters must pack evenly into bytes");
+
+	static constexpr unsigned int table_mask = (1u << TableBits) - 1;
+	static constexpr unsigned int history_mask = (1u << HistLen) - 1;
+	static constexpr int per_byte = 8 / CounterBits;
+	static constexpr int per_byte_bits = CounterBits == 1 ? 3 : CounterBits == 2 ? 2 : CounterBits == 4 ? 1 : 0;
+	static constexpr unsigned int counter_max = (1u << CounterBits) - 1;
+	static constexpr size_t bytes = (((size_t) 1 << TableBits) + per_byte - 1) / per_byte;
+
+	unsigned char tab[bytes];
+	unsigned int history;
+
+	// the position of a counter in its byte
+
+	static unsigned int shift (unsigned int index) {
+		return (index & (per_byte - 1)) * CounterBits;
+	}
+
+public:
+	gshare (void) : history(0) {
+		memset (tab, 0, sizeof (tab));
+	}
+
+	// the index of the counter for a branch address
+
+	unsigned int index (unsigned int address) const {
+		return (history << (TableBits - HistLen)) ^ (address & table_mask);
+	}
+
+	// the counter at an index and its prediction, its top bit
+
+	unsigned int counter (unsigned int index) const {
+		return (tab[index >> per_byte_bits] >> shift (index)) & counter_max;
+	}
+
+	bool prediction (unsigned int index) const {
+		return counter (index) >> (CounterBits - 1);
+	}
+
+	// move the counter at an index toward the outcome of its branch
+	// without branching, and shift the outcome into the history
+
+	void update (unsigned int index, bool taken) {
+		unsigned char *p = &tab[index >> per_byte_bits];
+		unsigned int s = shift (index), c = (*p >> s) & counter_max;
+		c += (taken & (c != counter_max)) - (!taken & (c != 0));
+		*p = (*p & ~(counter_max << s)) | (c << s);
+		history = ((history << 1) | taken) & history_mask;
+	}
+
+	// the state for a checkpoint
+
+	bool serialize (FILE *f) {
+		return fwrite (&history, sizeof (history), 1, f) == 1
+			&& fwrite (tab, sizeof (tab), 1, f) == 1;
+	}
+
+	bool deserialize (FILE *f) {
+		return fread (&history, sizeof (history), 1, f) == 1
+			&& fread (tab, sizeof (tab), 1, f) == 1;
+	}
+};
+
+#endif
@@ -0,0 +1,186 @@
+// history.h
+// This file contains history registers for building predictors out of,
+// so that a predictor doesn't have to keep its own.  None of them
+// allocates memory, and each update takes the same few operations however
+// long the history is.
+//
+// - global_history<Length> keeps the last Length outcomes (or any other
+//   bits) in a circular buffer of bits, so adding one doesn't move the
+//   others
+// - path_history<Bits, Shift> keeps Shift low bits of the address of each
+//   of the last Bits/Shift branches
+// - folded_history is a global history of any length xored down to any
+//   width up to 31 bits, like a hash of the history to index or tag a
+//   table with, kept current as bits are added
+// - call_depth<Max> counts the calls that haven't returned yet
+//
+// Each has serialize and deserialize methods for checkpoints like gshare's.
+// bench compares their speed with the obvious way of keeping a long
+// history.
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+// the smallest power of 2 no less than n
+
+static constexpr int history_pow2 (int n) {
+	return n <= 1 ? 1 : 2 * history_pow2 ((n + 1) / 2);
+}
+
+// the last Length bits pushed, and one more so that a folded_history of
+// Length bits can find the bit leaving it.  bit(0) is the most recent.
+
+template <int Length>
+class global_history {
+	static_assert (Length >= 1 && Length <= (1<<24), "global history length must be from 1 to 1<<24");
+
+	// the buffer, in 64-bit words; the bits from pos on, wrapping
+	// around, are the history from the most recent back
+
+	static constexpr int size = history_pow2 (Length + 1) < 64 ? 64 : history_pow2 (Length + 1);
+	static constexpr unsigned int mask = size - 1;
+
+	unsigned long long int words[size / 64];
+	unsigned int pos;
+
+public:
+	global_history (void) : pos(0) {
+		memset (words, 0, sizeof (words));
+	}
+
+	static constexpr int length = Length;
+
+	void push (bool b) {
+		pos = (pos - 1) & mask;
+		unsigned long long int *w = &words[pos >> 6];
+		int s = pos & 63;
+		*w = (*w & ~(1ull << s)) | ((unsigned long long int) b << s);
+	}
+
+	// the bit pushed i pushes ago, for i from 0 to Length
+
+	unsigned int bit (int i) const {
+		unsigned int p = (pos + i) & mask;
+		return (words[p >> 6] >> (p & 63)) & 1;
+	}
+
+	// the n most recent bits, n up to 64 and Length + 1, with the most
+	// recent in bit 0 like a shift register
+
+	unsigned long long int recent (int n) const {
+		int s = pos & 63;
+		unsigned long long int v = words[pos >> 6] >> s;
+		if (s) v |= words[((pos >> 6) + 1) & (mask >> 6)] << (64 - s);
+		return n >= 64 ? v : v & ((1ull << n) - 1);
+	}
+
+	bool serialize (FILE *f) {
+		return fwrite (words, sizeof (words), 1, f) == 1
+			&& fwrite (&pos, sizeof (pos), 1, f) == 1;
+	}
+
+	bool deserialize (FILE *f) {
+		return fread (words, sizeof (words), 1, f) == 1
+			&& fread (&pos, sizeof (pos), 1, f) == 1 && pos <= mask;
+	}
+};
+
+// the Shift low bits of each branch address, Bits in all, the most recent
+// in the low bits
+
+template <int Bits, int Shift = 1>
+class path_history {
+	static_assert (Bits >= 1 && Bits <= 32 && Shift >= 1 && Shift <= Bits,
+		"path history must be from 1 to 32 bits, shifted by at most that");
+
+	static constexpr unsigned int mask = Bits == 32 ? ~0u : (1u << Bits) - 1;
+	static constexpr unsigned int low = Shift == 32 ? ~0u : (1u << Shift) - 1;
+
+	unsigned int h;
+
+public:
+	path_history (void) : h(0) {}
+
+	// shifted as 64 bits, since shifting 32 bits by 32 is undefined
+
+	void push (unsigned int address) {
+		h = (((unsigned long long int) h << Shift) ^ (address & low)) & mask;
+	}
+
+	unsigned int value (void) const { return h; }
+
+	bool serialize (FILE *f) { return fwrite (&h, sizeof (h), 1, f) == 1; }
+	bool deserialize (FILE *f) { return fread (&h, sizeof (h), 1, f) == 1; }
+};
+
+// the last original bits of a global history folded into compressed bits:
+// the bit pushed i pushes ago is xored into bit i % compressed.  update
+// keeps it current given the bit coming into the history and the one
+// original bits back that is leaving it.  the lengths are set at run time
+// so that a predictor can keep an array of these with different lengths.
+
+class folded_history {
+	unsigned int comp;
+	int original, compressed, outpoint;
+
+public:
+	folded_history (void) : comp(0), original(0), compressed(1), outpoint(0) {}
+
+	folded_history (int o, int c) {
+		init (o, c);
+	}
+
+	void init (int o, int c) {
+		comp = 0;
+		original = o;
+		compressed = c;
+		outpoint = o % c;
+	}
+
+	unsigned int value (void) const { return comp; }
+	int length (void) const { return original; }
+
+	void update (unsigned int in, unsigned int out) {
+		comp = (comp << 1) | in;
+		comp ^= out << outpoint;
+		comp ^= comp >> compressed;
+		comp &= (1u << compressed) - 1;
+	}
+
+	// the same right after a push to a global history at least
+	// original bits long
+
+	template <class H>
+	void update (const H & h) {
+		update (h.bit (0), h.bit (original));
+	}
+
+	bool serialize (FILE *f) { return fwrite (&comp, sizeof (comp), 1, f) == 1; }
+	bool deserialize (FILE *f) { return fread (&comp, sizeof (comp), 1, f) == 1; }
+};
+
+// the number of calls without returns, from 0 to Max.  a return at depth
+// 0, from a call before the start of the trace, leaves it at 0.
+
+template <int Max = 255>
+class call_depth {
+	int depth;
+
+public:
+	call_depth (void) : depth(0) {}
+
+	void update (const branch_info & b) {
+		if (b.br_flags & BR_CALL) {
+			if (depth < Max) depth++;
+		} else if (b.br_flags & BR_RETURN) {
+			if (depth > 0) depth--;
+		}
+	}
+
+	int value (void) const { return depth; }
+
+	bool serialize (FILE *f) { return fwrite (&depth, sizeof (depth), 1, f) == 1; }
+	bool deserialize (FILE *f) { return fread (&depth, sizeof (depth), 1, f) == 1; }
+};
+
+#endif
@@ -4,6 +4,8 @@
 // Note that this predictor doesn't use the whole 32 kilobytes available
 // for the CBP-2 contest; it is just an example.
 
+#include "gshare.h"
+
 class my_update : public branch_update {
 public:
 	unsigned int index;
@@ -11,24 +13,15 @@ public:
 
 class my_predictor : public branch_predictor {
 public:
-#define HISTORY_LENGTH	15
-#define TABLE_BITS	17
 	my_update u;
 	branch_info bi;
-	unsigned int history;
-	unsigned char tab[1<<TABLE_BITS]; // array
-
-	my_predictor (void) : history(0) { // constructor, initializes history to 0
-		memset (tab, 0, sizeof (tab)); // zeroes out prediction table
-	}
+	gshare<17, 15, 2> g; // 1<<17 2-bit counters and 15 bits of history
 
 	branch_update *predict (branch_info & b) {
 		bi = b;
 		if (b.br_flags & BR_CONDITIONAL) { // if a conditional jump (br instead of j)
-			u.index = 
-				  (history << (TABLE_BITS - HISTORY_LENGTH)) 
-				^ (b.address & ((1<<TABLE_BITS)-1));
-			u.direction_prediction (tab[u.index] >> 1);
+			u.index = g.index (b.address);
+			u.direction_prediction (g.prediction (u.index));
 		} else {
 			u.direction_prediction (true);
 		}
@@ -37,16 +30,18 @@ public:
 	}
 
 	void update (branch_update *u, bool taken, unsigned int target) {
-		if (bi.br_flags & BR_CONDITIONAL) {
-			unsigned char *c = &tab[((my_update*)u)->index];
-			if (taken) {
-				if (*c < 3) (*c)++;
-			} else {
-				if (*c > 0) (*c)--;
-			}
-			history <<= 1;
-			history |= taken;
-			history &= (1<<HISTORY_LENGTH)-1;
-		}
+		if (bi.br_flags & BR_CONDITIONAL) g.update (((my_update*)u)->index, taken);
+	}
+
+	void warm (branch_info & b, bool taken, unsigned int target) { // update without predicting
+		if (b.br_flags & BR_CONDITIONAL) g.update (g.index (b.address), taken);
+	}
+
+	bool serialize (FILE *f) { // saves the history and table to a checkpoint
+		return g.serialize (f);
+	}
+
+	bool deserialize (FILE *f) { // reads them back
+		return g.deserialize (f);
 	}
 };
@@ -0,0 +1,144 @@
+// parallel.cc
+// This file contains the parallel mode of the driver.  It cuts one trace
+// into as many contiguous segments as there are threads and simulates each
+// segment on its own thread with its own my_predictor.  A fresh predictor
+// would make more mispredictions at the start of its segment than the one
+// that had seen everything before, so each thread first warms its
+// predictor up on the traces just before its segment without counting
+// them.  The sum of the segments' mispredictions is close to, but not
+// exactly, what the ordinary serial simulation gives; the exact simulation
+// can be run alongside to see how close.  Finding the segments needs an
+// index (see --index) or the trace cache; a trace with neither is indexed
+// first, so that no thread has to decode everything before its segment.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "predictor.h"
+#include "my_predictor.h"
+#include "driver.h"
+
+// a segment of the trace and its thread
+
+struct segment {
+	char *fname;
+
+	// traces to warm up on and to measure
+
+	long long int warm_start, start, end;
+
+	// statistics for the measured traces
+
+	long long int tmiss, dmiss;
+	pthread_t thread;
+};
+
+// simulate one segment
+
+static void *run_segment (void *arg) {
+	segment *s = (segment *) arg;
+	my_predictor *p = new my_predictor ();
+	trace_source src (s->fname);
+	src.seek (s->warm_start);
+	trace *t;
+	while (src.position () < s->end) {
+		long long int pos = src.position ();
+		long long int stop = pos < s->start ? s->start : s->end;
+		size_t n = src.next (&t, stop - pos < TRACE_BATCH ? stop - pos : TRACE_BATCH);
+		if (!n) break;
+		if (pos < s->start) {
+			for (size_t i=0; i<n; i++) 
+				dispatch<my_predictor>::warm (p, t[i].bi, t[i].taken, t[i].target);
+		} else {
+			for (size_t i=0; i<n; i++) predict_trace (p, &t[i], s->tmiss, s->dmiss);
+		}
+	}
+	delete p;
+	return NULL;
+}
+
+// simulate the whole trace serially for comparison
+
+static void *run_exact (void *arg) {
+	segment *s = (segment *) arg;
+	my_predictor *p = new my_predictor ();
+	trace_source src (s->fname);
+	simulate (p, src, s->tmiss, s->dmiss);
+	delete p;
+	return NULL;
+}
+
+// simulate a trace file in k segments, each warmed up on the warmup
+// traces before it, and return its MPKI.  if exact is true, also run the
+// serial simulation and print how far off the parallel one was.
+
+double run_parallel (char *fname, int k, long long int warmup, bool exact) {
+	long long int ntraces, ninstructions;
+	{
+		trace_source src (fname);
+		ntraces = src.length ();
+		ninstructions = src.ninstructions;
+	}
+	if (ntraces < 0) {
+
+		// no index; build one so that each thread can start at its
+		// segment instead of decoding everything before it
+
+		fprintf (stderr, "%s: no index; building one\n", fname);
+		if (build_index (fname, INDEX_EVERY)) {
+			trace_source src (fname);
+			ntraces = src.length ();
+		}
+	}
+	if (ntraces < 0) {
+
+		// the index couldn't be written; count the traces the slow way
+
+		trace_source src (fname);
+		trace *t;
+		size_t n;
+		ntraces = 0;
+		while ((n = src.next (&t))) ntraces += n;
+	}
+	if (k > ntraces) k = ntraces > 0 ? ntraces : 1;
+
+	// the segments already keep the processors busy, so a trace written
+	// in blocks isn't decoded with more threads
+
+	trace_threads (1);
+
+	segment *segs = new segment[k + 1];
+	for (int i=0; i<=k; i++) {
+		segment *s = &segs[i];
+		s->fname = fname;
+		s->start = ntraces * i / k;
+		s->end = ntraces * (i + 1) / k;
+		s->warm_start = s->start > warmup ? s->start - warmup : 0;
+		s->tmiss = 0;
+		s->dmiss = 0;
+	}
+	segment *serial = &segs[k];
+	if (exact) pthread_create (&serial->thread, NULL, run_exact, serial);
+	for (int i=0; i<k; i++) pthread_create (&segs[i].thread, NULL, run_segment, &segs[i]);
+	long long int dmiss = 0;
+	for (int i=0; i<k; i++) {
+		pthread_join (segs[i].thread, NULL);
+		dmiss += segs[i].dmiss;
+	}
+	double mpki = 1000.0 * (dmiss / (double) ninstructions);
+	if (exact) {
+		pthread_join (serial->thread, NULL);
+		double exact_mpki = 1000.0 * (serial->dmiss / (double) ninstructions);
+		printf ("exact %0.3f MPKI; %d segments are off by %+0.3f MPKI (%+0.2f%%)\n", 
+			exact_mpki, k, mpki - exact_mpki, 
+			exact_mpki ? 100.0 * (mpki - exact_mpki) / exact_mpki : 0);
+	}
+	delete[] segs;
+	return mpki;
+}
@@ -0,0 +1,173 @@
+// perceptron.h
+// This file contains a perceptron predictor (Jimenez and Lin, "Dynamic
+// Branch Prediction with Perceptrons", HPCA 2001) to compare other
+// predictors against; run it with "predict --predictor perceptron".  Each
+// static branch hashes to a row of 8-bit weights, one for each of the
+// last HistLen conditional branch outcomes and one bias weight.  The
+// prediction is the sign of the bias plus the sum of the weights, each
+// added if its branch was taken and subtracted if not.  When the
+// prediction is wrong or the sum is within a threshold of 0, every weight
+// moves one step toward agreeing with the outcome, saturating at the
+// limits of a signed byte.
+//
+// On processors with AVX2 the sum and the training are done 32 weights at
+// a time; otherwise the same thing is done one weight at a time.  Either
+// way the predictions are exactly the same.
+
+#include <immintrin.h>
+
+class perceptron_update : public branch_update {
+public:
+	unsigned int row;
+	int output;
+};
+
+// the sum of the weights w against the outcomes h, bytes of 0 or 1: the
+// weights of taken branches minus those of not taken branches
+
+static inline int perceptron_dot (const signed char *w, const unsigned char *h, int n) {
+	int y = 0;
+	for (int i=0; i<n; i++) y += h[i] ? w[i] : -w[i];
+	return y;
+}
+
+// the same with AVX2.  _mm256_maddubs_epi16 multiplies the unsigned
+// outcomes by the signed weights and adds pairs, giving the sum of the
+// weights of taken branches in 16-bit lanes; against all ones it gives the
+// sum of all the weights, and the result is twice the one minus the other.
+// a lane holds at most 3 * 2 * 128 for every 32 weights, so n can be up to
+// 1024 without overflow.
+
+__attribute__((target("avx2")))
+static int perceptron_dot_avx2 (const signed char *w, const unsigned char *h, int n) {
+	__m256i ones = _mm256_set1_epi8 (1);
+	__m256i taken = _mm256_setzero_si256 (), all = _mm256_setzero_si256 ();
+	for (int i=0; i<n; i+=32) {
+		__m256i wv = _mm256_load_si256 ((__m256i *) (w + i));
+		__m256i hv = _mm256_loadu_si256 ((__m256i *) (h + i));
+		taken = _mm256_add_epi16 (taken, _mm256_maddubs_epi16 (hv, wv));
+		all = _mm256_add_epi16 (all, _mm256_maddubs_epi16 (ones, wv));
+	}
+	__m256i s = _mm256_sub_epi16 (_mm256_add_epi16 (taken, taken), all);
+	s = _mm256_madd_epi16 (s, _mm256_set1_epi16 (1));
+	__m128i x = _mm_add_epi32 (_mm256_castsi256_si128 (s), _mm256_extracti128_si256 (s, 1));
+	x = _mm_add_epi32 (x, _mm_shuffle_epi32 (x, 0x4e));
+	x = _mm_add_epi32 (x, _mm_shuffle_epi32 (x, 0xb1));
+	return _mm_cvtsi128_si32 (x);
+}
+
+// move each weight one step toward agreeing with the outcome, saturating
+
+static inline void perceptron_train (signed char *w, const unsigned char *h, int n, bool taken) {
+	for (int i=0; i<n; i++) {
+		int v = w[i] + (h[i] == taken ? 1 : -1);
+		w[i] = v > 127 ? 127 : v < -128 ? -128 : v;
+	}
+}
+
+// the same with AVX2.  an outcome xored with not taken is 1 where the
+// weight should go up, so twice that minus 1 is the step for
+// _mm256_adds_epi8.
+
+__attribute__((target("avx2")))
+static void perceptron_train_avx2 (signed char *w, const unsigned char *h, int n, bool taken) {
+	__m256i ones = _mm256_set1_epi8 (1);
+	__m256i not_taken = _mm256_set1_epi8 (!taken);
+	for (int i=0; i<n; i+=32) {
+		__m256i wv = _mm256_load_si256 ((__m256i *) (w + i));
+		__m256i up = _mm256_xor_si256 (_mm256_loadu_si256 ((__m256i *) (h + i)), not_taken);
+		__m256i step = _mm256_sub_epi8 (_mm256_add_epi8 (up, up), ones);
+		_mm256_store_si256 ((__m256i *) (w + i), _mm256_adds_epi8 (wv, step));
+	}
+}
+
+// a perceptron predictor with 1<<RowBits rows of HistLen weights
+
+template <int RowBits, int HistLen>
+class perceptron : public branch_predictor {
+	static_assert (RowBits >= 0 && RowBits <= 20, "perceptron row bits must be from 0 to 20");
+	static_assert (HistLen >= 32 && HistLen <= 1024 && HistLen % 32 == 0,
+		"perceptron history must be a multiple of 32 up to 1024");
+
+	static constexpr unsigned int row_mask = (1u << RowBits) - 1;
+
+	// train when the sum is no further than this from 0; the best
+	// threshold found in the paper
+
+	static constexpr int theta = (int) (1.93 * HistLen + 14);
+
+	signed char weights[1<<RowBits][HistLen] __attribute__ ((aligned (32)));
+	signed char bias[1<<RowBits];
+
+	// the outcomes of the last HistLen conditional branches, most recent
+	// first from hist + pos.  each outcome is stored twice, HistLen
+	// bytes apart, so they are always in one piece without being moved.
+
+	unsigned char hist[2*HistLen];
+	int pos;
+
+	bool avx2;
+	perceptron_update u;
+	branch_info bi;
+
+public:
+
+	// use AVX2 if use_avx2 is true and the processor has it
+
+	perceptron (bool use_avx2 = true) : pos(0) {
+		memset (weights, 0, sizeof (weights));
+		memset (bias, 0, sizeof (bias));
+		memset (hist, 0, sizeof (hist));
+		avx2 = use_avx2 && __builtin_cpu_supports ("avx2");
+	}
+
+	branch_update *predict (branch_info & b) {
+		bi = b;
+		if (b.br_flags & BR_CONDITIONAL) {
+			u.row = (b.address ^ (b.address >> RowBits)) & row_mask;
+			signed char *w = weights[u.row];
+			u.output = bias[u.row] + (avx2
+				? perceptron_dot_avx2 (w, hist + pos, HistLen)
+				: perceptron_dot (w, hist + pos, HistLen));
+			u.direction_prediction (u.output >= 0);
+		} else {
+			u.direction_prediction (true);
+		}
+		u.target_prediction (0);
+		return &u;
+	}
+
+	void update (branch_update *bu, bool taken, unsigned int target) {
+		if (!(bi.br_flags & BR_CONDITIONAL)) return;
+		perceptron_update *pu = (perceptron_update *) bu;
+		if ((pu->output >= 0) != taken || (pu->output <= theta && pu->output >= -theta)) {
+			signed char *b = &bias[pu->row];
+			if (taken ? *b < 127 : *b > -128) *b += taken ? 1 : -1;
+			if (avx2)
+				perceptron_train_avx2 (weights[pu->row], hist + pos, HistLen, taken);
+			else
+				perceptron_train (weights[pu->row], hist + pos, HistLen, taken);
+		}
+		pos = (pos ? pos : HistLen) - 1;
+		hist[pos] = hist[pos+HistLen] = taken;
+	}
+
+	bool serialize (FILE *f) {
+		return fwrite (weights, sizeof (weights), 1, f) == 1
+			&& fwrite (bias, sizeof (bias), 1, f) == 1
+			&& fwrite (hist, sizeof (hist), 1, f) == 1
+			&& fwrite (&pos, sizeof (pos), 1, f) == 1;
+	}
+
+	bool deserialize (FILE *f) {
+		return fread (weights, sizeof (weights), 1, f) == 1
+			&& fread (bias, sizeof (bias), 1, f) == 1
+			&& fread (hist, sizeof (hist), 1, f) == 1
+			&& fread (&pos, sizeof (pos), 1, f) == 1 && pos >= 0 && pos < HistLen;
+	}
+};
+
+// the configuration run by "predict --predictor perceptron": 512 rows of
+// 64 weights, 32.5KB
+
+typedef perceptron<9, 64> perceptron_predictor;
@@ -0,0 +1,381 @@
+// perf.cc
+// This file contains the perf mode of the driver.  It runs my_predictor on
+// a trace like the normal mode while counting, with the processor's
+// performance counters, the cycles, instructions, L1 data cache read
+// misses, last-level cache misses and branch mispredictions spent in each
+// phase of the simulation: decompressing the trace file, decoding the
+// traces, and the predictor's predict and update.  It prints each phase's
+// time and counts per branch, so that when a simulation gets slower it
+// shows whether the predictor's tables outgrew a cache or the trace reading
+// is the bottleneck.
+//
+// The counters are opened with perf_event_open for this thread only,
+// counting only user mode, so the trace is read in this thread.  Where a
+// counter can't be opened, e.g. with no hardware counters in a virtual
+// machine or when perf_event_paranoid forbids it, its column is left out
+// and the times are still reported.  Times come from the time stamp
+// counter, calibrated against the clock over the run.
+//
+// The counters are opened separately, so the kernel may multiplex them
+// when there are more than the processor has; each count is then scaled
+// by how long its counter was enabled over how long it was running, and a
+// note says so.
+//
+// Decompression and decoding are measured a megabyte or a batch of traces
+// at a time.  The "predictor" line has predict and update together,
+// measured a batch at a time in all but one batch out of PERF_SAMPLE_EVERY,
+// with nothing in between to disturb them; its seconds are its time per
+// branch times all the branches.  predict and update alternate every
+// branch, so they can only be told apart by measuring around every call,
+// which costs about as much as the calls themselves.  That is done in the
+// remaining batches, but only to find what share of the time and counts
+// goes to each: the "predict" and "update" lines are those shares of the
+// predictor line and add up to it.  Counts are only split if the kernel
+// lets the counters be read with rdpmc, which is cheap enough to do every
+// call.  A version 2 trace has no decompression phase; reading the file is
+// part of decoding.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <x86intrin.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "predictor.h"
+#include "my_predictor.h"
+#include "driver.h"
+
+// measure predict and update separately in one batch of traces out of
+// this many
+
+#define PERF_SAMPLE_EVERY	16
+
+// the counters
+
+struct perf_counter {
+	const char *name;	// column heading, per branch or per kilo-branch
+	unsigned int type;
+	unsigned long long int config;
+	double scale;		// 1 for per branch, 1000 for per kilo-branch
+	int fd;			// -1 if it couldn't be opened
+	bool multiplexed;	// ever enabled without running
+	perf_event_mmap_page *page;	// for rdpmc, or NULL
+};
+
+#define HW_CACHE(cache, op, result) \
+	((cache) | ((op) << 8) | ((result) << 16))
+
+static perf_counter counters[] = {
+	{ "cyc/br", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1, -1, false, NULL },
+	{ "ins/br", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 1, -1, false, NULL },
+	{ "L1D/kbr", PERF_TYPE_HW_CACHE,
+		HW_CACHE (PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS),
+		1000, -1, false, NULL },
+	{ "LLC/kbr", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 1000, -1, false, NULL },
+	{ "brmiss/kbr", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 1000, -1, false, NULL },
+};
+
+#define NCOUNTERS	((int) (sizeof (counters) / sizeof (counters[0])))
+
+// can every open counter be read with rdpmc?
+
+static bool fast_counters;
+
+// open whatever counters can be opened
+
+static void open_counters (void) {
+	int opened = 0, err = 0;
+	fast_counters = true;
+	for (int i=0; i<NCOUNTERS; i++) {
+		perf_event_attr a;
+		memset (&a, 0, sizeof (a));
+		a.size = sizeof (a);
+		a.type = counters[i].type;
+		a.config = counters[i].config;
+		a.exclude_kernel = 1;
+		a.exclude_hv = 1;
+		a.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		counters[i].fd = syscall (SYS_perf_event_open, &a, 0, -1, -1, 0);
+		if (counters[i].fd < 0) {
+			err = errno;
+			continue;
+		}
+		opened++;
+		void *p = mmap (NULL, sysconf (_SC_PAGESIZE), PROT_READ, MAP_SHARED, counters[i].fd, 0);
+		counters[i].page = p == MAP_FAILED ? NULL : (perf_event_mmap_page *) p;
+		if (!counters[i].page || !counters[i].page->cap_user_rdpmc || !counters[i].page->cap_user_time)
+			fast_counters = false;
+	}
+	if (opened < NCOUNTERS)
+		fprintf (stderr, "perf: %d of %d counters unavailable (%s)%s\n", NCOUNTERS - opened,
+			NCOUNTERS, strerror (err), opened ? "" : "; reporting times only");
+}
+
+static void close_counters (void) {
+	for (int i=0; i<NCOUNTERS; i++) {
+		if (counters[i].page) munmap (counters[i].page, sysconf (_SC_PAGESIZE));
+		if (counters[i].fd >= 0) close (counters[i].fd);
+	}
+}
+
+// the time stamp counter and the counters at some moment, each with the
+// nanoseconds it has been enabled and running
+
+struct perf_sample {
+	unsigned long long int tsc;
+	unsigned long long int v[NCOUNTERS];
+	unsigned long long int enabled[NCOUNTERS], running[NCOUNTERS];
+};
+
+// read the counters with system calls
+
+static void read_sample (perf_sample *s) {
+	for (int i=0; i<NCOUNTERS; i++) {
+		unsigned long long int r[3] = { 0, 0, 0 };
+		if (counters[i].fd >= 0 && read (counters[i].fd, r, sizeof (r)) != sizeof (r))
+			r[0] = r[1] = r[2] = 0;
+		s->v[i] = r[0];
+		s->enabled[i] = r[1];
+		s->running[i] = r[2];
+	}
+	s->tsc = __rdtsc ();
+}
+
+// read a counter and its times with rdpmc, as described in
+// linux/perf_event.h
+
+static inline void rdpmc_counter (perf_event_mmap_page *pc, unsigned long long int *count, 
+	unsigned long long int *enabled, unsigned long long int *running) {
+	unsigned int seq;
+	do {
+		seq = pc->lock;
+		__asm__ __volatile__ ("" ::: "memory");
+		unsigned int idx = pc->index;
+		*count = pc->offset;
+		*enabled = pc->time_enabled;
+		*running = pc->time_running;
+		if (pc->cap_user_time) {
+			unsigned long long int cyc = __rdtsc ();
+			unsigned long long int quot = cyc >> pc->time_shift;
+			unsigned long long int rem = cyc & (((unsigned long long int) 1 << pc->time_shift) - 1);
+			unsigned long long int delta = pc->time_offset + quot * pc->time_mult 
+				+ ((rem * pc->time_mult) >> pc->time_shift);
+			*enabled += delta;
+			if (idx) *running += delta;
+		}
+		if (pc->cap_user_rdpmc && idx) {
+			long long int pmc = __rdpmc (idx - 1);
+			pmc <<= 64 - pc->pmc_width;
+			pmc >>= 64 - pc->pmc_width;
+			*count += pmc;
+		}
+		__asm__ __volatile__ ("" ::: "memory");
+	} while (pc->lock != seq);
+}
+
+// read the time stamp counter, and the counters too if that is cheap
+
+static inline void read_fast (perf_sample *s) {
+	if (fast_counters)
+		for (int i=0; i<NCOUNTERS; i++) {
+			s->v[i] = s->enabled[i] = s->running[i] = 0;
+			if (counters[i].page) 
+				rdpmc_counter (counters[i].page, &s->v[i], &s->enabled[i], &s->running[i]);
+		}
+	s->tsc = __rdtsc ();
+}
+
+// the phases and what was spent in each
+
+#define PHASE_DECOMPRESS	0
+#define PHASE_DECODE		1
+#define PHASE_PREDICTOR		2	// predict and update together
+#define PHASE_PREDICT		3	// only for predict's share of the predictor
+#define PHASE_UPDATE		4	// only for update's share of the predictor
+#define PHASE_SAMPLED		5	// the batches measured call by call, not reported
+#define NPHASES			6
+
+static const char *phase_names[NPHASES] = {
+	"decompress", "decode", "predictor", "  predict", "  update", "sampled",
+};
+
+struct perf_total {
+	double tsc;
+	double v[NCOUNTERS];
+	double enabled[NCOUNTERS], running[NCOUNTERS];
+	long long int branches;	// branches measured
+};
+
+static perf_total totals[NPHASES];
+
+static void add (int phase, perf_sample *a, perf_sample *b, perf_sample *overhead) {
+	perf_total *t = &totals[phase];
+	t->tsc += (double) (b->tsc - a->tsc) - (overhead ? overhead->tsc : 0);
+	for (int i=0; i<NCOUNTERS; i++) {
+		t->v[i] += (double) (b->v[i] - a->v[i]) - (overhead ? overhead->v[i] : 0);
+		t->enabled[i] += b->enabled[i] - a->enabled[i];
+		t->running[i] += b->running[i] - a->running[i];
+	}
+}
+
+// a phase's count scaled up for the time its counter wasn't running, or -1
+// if it never ran
+
+static double scaled (perf_total *t, int i) {
+	if (t->running[i] <= 0) return -1;
+	if (t->running[i] < t->enabled[i]) counters[i].multiplexed = true;
+	return t->v[i] * (t->enabled[i] / t->running[i]);
+}
+
+// the phase being measured a megabyte or a batch at a time and when it
+// started
+
+static int current;
+static perf_sample current_start;
+
+static void switch_phase (int phase) {
+	perf_sample s;
+	read_sample (&s);
+	add (current, &current_start, &s, NULL);
+	current = phase;
+	current_start = s;
+}
+
+// give the decoder decompressed bytes, counting the decompression
+// separately
+
+static size_t perf_bytes (void *arg, unsigned char *dst, size_t size) {
+	switch_phase (PHASE_DECOMPRESS);
+	size_t n = read_trace_bytes ((trace_reader *) arg, dst, size);
+	switch_phase (PHASE_DECODE);
+	return n;
+}
+
+// the cost of a read_fast, from many back to back
+
+static void calibrate (perf_sample *overhead) {
+	const int n = 100000;
+	perf_sample first, last;
+	read_fast (&first);
+	for (int i=0; i<n; i++) read_fast (&last);
+	overhead->tsc = (last.tsc - first.tsc) / n;
+	for (int i=0; i<NCOUNTERS; i++) overhead->v[i] = (last.v[i] - first.v[i]) / n;
+}
+
+// x's share of x and y together, where either may have come out below zero
+// after taking off the cost of measuring
+
+static double share (double x, double a, double b) {
+	if (x < 0) x = 0;
+	if (a < 0) a = 0;
+	if (b < 0) b = 0;
+	return a + b > 0 ? x / (a + b) : 0.5;
+}
+
+// nanoseconds on the clock
+
+static double clock_ns (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void run_perf (char *fname) {
+	open_counters ();
+	perf_sample overhead;
+	calibrate (&overhead);
+
+	// read the trace in this thread so that the counters see it
+
+	trace_threads (1);
+	trace_reader *file = open_trace (fname);
+	bool v1 = trace_version (file) == 1;
+	trace_reader *tr = v1 ? open_trace_decoder (perf_bytes, file) : file;
+	my_predictor *p = new my_predictor ();
+	static trace batch[TRACE_BATCH];
+	long long int ntraces = 0, nbatches = 0, dmiss = 0;
+
+	memset (totals, 0, sizeof (totals));
+	double start_ns = clock_ns ();
+	unsigned long long int start_tsc = __rdtsc ();
+	current = PHASE_DECODE;
+	read_sample (&current_start);
+	for (;;) {
+		size_t n = read_traces (tr, batch, TRACE_BATCH);
+		bool sampled = nbatches++ % PERF_SAMPLE_EVERY == 0;
+		switch_phase (sampled ? PHASE_SAMPLED : PHASE_PREDICTOR);
+		if (!n) break;
+		ntraces += n;
+		if (sampled) {
+			for (size_t i=0; i<n; i++) {
+				trace *t = &batch[i];
+				perf_sample a, b, c;
+				read_fast (&a);
+				branch_update *u = dispatch<my_predictor>::predict (p, t->bi);
+				read_fast (&b);
+				dispatch<my_predictor>::update (p, u, t->taken, t->target);
+				read_fast (&c);
+				add (PHASE_PREDICT, &a, &b, &overhead);
+				add (PHASE_UPDATE, &b, &c, &overhead);
+				if (t->bi.br_flags & BR_CONDITIONAL) dmiss += u->direction_prediction () != t->taken;
+			}
+		} else {
+			totals[PHASE_PREDICTOR].branches += n;
+			long long int tmiss = 0;
+			for (size_t i=0; i<n; i++) predict_trace (p, &batch[i], tmiss, dmiss);
+		}
+		switch_phase (PHASE_DECODE);
+	}
+	double ns_per_tsc = (clock_ns () - start_ns) / (double) (__rdtsc () - start_tsc);
+	totals[PHASE_DECOMPRESS].branches = totals[PHASE_DECODE].branches = ntraces;
+	if (v1) close_trace (tr);
+	close_trace (file);
+	delete p;
+	close_counters ();
+
+	// the report, per branch
+
+	printf ("%0.3f MPKI\n", 1000.0 * (dmiss / (double) trace_file_instructions ()));
+	printf ("%lld branches\n", ntraces);
+	printf ("%-12s %10s %10s", "phase", "seconds", "ns/br");
+	for (int i=0; i<NCOUNTERS; i++) if (counters[i].fd >= 0) printf (" %10s", counters[i].name);
+	printf ("\n");
+	perf_total *pr = &totals[PHASE_PREDICT], *up = &totals[PHASE_UPDATE];
+	for (int ph=0; ph<=PHASE_UPDATE; ph++) {
+		perf_total *t = &totals[ph];
+		if (ph == PHASE_DECOMPRESS && !v1) continue;
+
+		// predict and update get their shares of the predictor line
+
+		bool split = ph == PHASE_PREDICT || ph == PHASE_UPDATE;
+		perf_total *whole = split ? &totals[PHASE_PREDICTOR] : t;
+		if (!whole->branches) continue;
+		double ns = whole->tsc * ns_per_tsc / whole->branches;
+		if (split) ns *= share (t->tsc, pr->tsc, up->tsc);
+		printf ("%-12s %10.3f %10.2f", phase_names[ph], ns * ntraces * 1e-9, ns);
+		for (int i=0; i<NCOUNTERS; i++) {
+			if (counters[i].fd < 0) continue;
+			double v = scaled (whole, i);
+			if (split) {
+				double a = scaled (pr, i), b = scaled (up, i);
+				v = fast_counters && v >= 0 && a >= 0 && b >= 0 ? v * share (scaled (t, i), a, b) : -1;
+			}
+			if (v >= 0)
+				printf (" %10.2f", v * counters[i].scale / whole->branches);
+			else
+				printf (" %10s", "-");
+		}
+		printf ("\n");
+	}
+	for (int i=0; i<NCOUNTERS; i++)
+		if (counters[i].multiplexed)
+			fprintf (stderr, "perf: %s was multiplexed with other counters; its counts are scaled estimates\n",
+				counters[i].name);
+}
@@ -0,0 +1,131 @@
+// pipeline.cc
+// This file contains the pipelined mode of the driver.  Reading a trace is
+// split into three stages, each in its own thread: one decompresses the
+// trace file, one decodes the decompressed bytes into traces, and the main
+// thread runs the branch predictor on them.  The stages hand their work
+// along through lock-free rings, so for a slow branch predictor the
+// simulation takes about as long as the slowest stage rather than the sum
+// of all three.  A version 2 trace has no decompressed bytes, so for it
+// the second stage reads the traces straight from the file and there is
+// no first stage.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "predictor.h"
+#include "my_predictor.h"
+#include "driver.h"
+#include "ring.h"
+
+// size of a chunk of decompressed bytes
+
+#define CHUNK_SIZE	(1<<20)
+
+// number of chunks or batches of traces that can be in flight between
+// two stages
+
+#define PIPELINE_DEPTH	8
+
+// a chunk of decompressed bytes; a chunk with no bytes ends the trace
+
+struct byte_chunk {
+	size_t n;
+	unsigned char bytes[CHUNK_SIZE];
+};
+
+// a batch of decoded traces; an empty batch ends the trace
+
+struct trace_batch {
+	size_t n;
+	trace traces[TRACE_BATCH];
+};
+
+static spsc_ring<byte_chunk, PIPELINE_DEPTH> *chunks;
+static spsc_ring<trace_batch, PIPELINE_DEPTH> *batches;
+
+// the first stage: decompress the trace file into chunks
+
+static void *decompress_stage (void *arg) {
+	trace_reader *tr = (trace_reader *) arg;
+	for (;;) {
+		byte_chunk *c = chunks->producer_slot ();
+		c->n = read_trace_bytes (tr, c->bytes, CHUNK_SIZE);
+		chunks->push ();
+		if (!c->n) break;
+	}
+	close_trace (tr);
+	return NULL;
+}
+
+// the bytes the decoder hasn't used yet from the chunk at the head of
+// the ring
+
+static size_t chunk_pos;
+
+// give the decoder bytes from the chunks
+
+static size_t next_bytes (void *, unsigned char *dst, size_t size) {
+	byte_chunk *c = chunks->consumer_slot ();
+	if (!c->n) return 0;
+	size_t n = c->n - chunk_pos;
+	if (n > size) n = size;
+	memcpy (dst, c->bytes + chunk_pos, n);
+	chunk_pos += n;
+	if (chunk_pos == c->n) {
+		chunks->pop ();
+		chunk_pos = 0;
+	}
+	return n;
+}
+
+// the second stage: decode the chunks into batches of traces, or read
+// them from a version 2 trace given as arg
+
+static void *decode_stage (void *arg) {
+	trace_reader *tr = arg ? (trace_reader *) arg : open_trace_decoder (next_bytes, NULL);
+	for (;;) {
+		trace_batch *b = batches->producer_slot ();
+		b->n = read_traces (tr, b->traces, TRACE_BATCH);
+		batches->push ();
+		if (!b->n) break;
+	}
+	close_trace (tr);
+	return NULL;
+}
+
+// run the branch predictor on a trace file with decompression, decoding
+// and prediction in separate threads; return the mispredictions per
+// kilo-instruction
+
+double run_pipeline (char *fname) {
+	chunks = new spsc_ring<byte_chunk, PIPELINE_DEPTH>;
+	batches = new spsc_ring<trace_batch, PIPELINE_DEPTH>;
+	chunk_pos = 0;
+	trace_reader *tr = open_trace (fname);
+	bool v2 = trace_version (tr) == 2;
+	pthread_t decompressor, decoder;
+	if (!v2) pthread_create (&decompressor, NULL, decompress_stage, tr);
+	pthread_create (&decoder, NULL, decode_stage, v2 ? tr : NULL);
+
+	// the last stage: predict the traces
+
+	branch_predictor *p = new my_predictor ();
+	long long int tmiss = 0, dmiss = 0;
+	for (;;) {
+		trace_batch *b = batches->consumer_slot ();
+		if (!b->n) break;
+		for (size_t i=0; i<b->n; i++) predict_trace (p, &b->traces[i], tmiss, dmiss);
+		batches->pop ();
+	}
+	pthread_join (decoder, NULL);
+	if (!v2) pthread_join (decompressor, NULL);
+	delete p;
+	delete chunks;
+	delete batches;
+	return 1000.0 * (dmiss / (double) trace_file_instructions ());
+}
@@ -2,34 +2,66 @@
 // This file contains the main function.  The program accepts a single 
 // parameter: the name of a trace file.  It drives the branch predictor
 // simulation by reading the trace file and feeding the traces one at a time
-// to the branch predictor.
+// to the branch predictor.  With "--all <directory>" it instead simulates
+// every trace file in the directory at once, one thread per processor.
+// With "--sweep" it simulates many gshare configurations in one pass over
+// the trace; see sweep.cc.  With "--pipeline" it decompresses, decodes and
+// predicts in three threads; see pipeline.cc.  With "--profile" it also
+// reports the static branches with the most mispredictions; see profile.cc.
+// With "--checkpoint", "--resume" or "--warm" it saves or restores the state
+// of the simulation; see checkpoint.cc.  With "--sample" it only measures
+// some intervals of the trace; see sample.cc.  With "--index" it writes an
+// index for each trace file that lets it be read from the middle.  With
+// "--parallel" it simulates segments of one trace on separate threads; see
+// parallel.cc.  "--predictor perceptron" or "--predictor tage" before a
+// trace file or "--all" runs the predictor in perceptron.h or tage.h
+// instead of my_predictor.  With "--targets" it measures how well
+// my_predictor and some reference predictors predict branch targets; see
+// target.cc.  With "--perf" it measures the time and hardware events
+// spent in each phase of the simulation; see perf.cc.  "--shm" first has
+// the modes that can use the trace cache decode each trace into shared
+// memory instead, once for all the runs using it at the same time.
+// "--instructions <n>" gives the number of instructions in a trace file
+// that isn't one of the CBP-2 traces, for the MPKI.  With
+// "--generate" it runs the predictor on synthetic traces made up as it
+// goes by the generator in generator.h, with no trace file at all.
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> // in case you want to use e.g. memset
 #include <assert.h>
+#include <math.h>
+#include <fnmatch.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "branch.h"
 #include "trace.h"
 #include "predictor.h"
 #include "my_predictor.h"
+#include "perceptron.h"
+#include "tage.h"
+#include "driver.h"
+#include "generator.h"
 
-int main (int argc, char *argv[]) {
+// the predictor to run, my_predictor unless --predictor says otherwise
 
-	// make sure there is one parameter
+static const char *predictor_name = "my_predictor";
 
-	if (argc != 2) {
-		fprintf (stderr, "Usage: %s <filename>.gz\n", argv[0]);
-		exit (1);
-	}
+// run a branch predictor of class P on one trace file and return its
+// mispredictions per kilo-instruction.  this uses no global state, so it
+// can run on many trace files at once in different threads.
 
-	// open the trace file for reading
-
-	init_trace (argv[1]);
+template <class P>
+static double simulate_with (char *fname) {
 
 	// initialize competitor's branch prediction code
 
-	branch_predictor *p = new my_predictor ();
+	P *p = new P ();
 
 	// some statistics to keep, currently just for conditional branches
 
@@ -37,48 +69,341 @@ int main (int argc, char *argv[]) {
 		tmiss = 0, 	// number of target mispredictions
 		dmiss = 0; 	// number of direction mispredictions
 
-	// keep looping until end of file
+	// get the traces from the trace cache or the trace file and send
+	// them to the predictor
+
+	trace_source src (fname);
+	simulate (p, src, tmiss, dmiss);
+	delete p;
+
+	// mispredictions per kilo-instruction
+
+	return 1000.0 * (dmiss / (double) src.ninstructions);
+}
+
+// run the chosen branch predictor on one trace file
+
+double simulate_trace (char *fname) {
+	if (strcmp (predictor_name, "perceptron") == 0) return simulate_with<perceptron_predictor> (fname);
+	if (strcmp (predictor_name, "tage") == 0) return simulate_with<tage_predictor> (fname);
+	return simulate_with<my_predictor> (fname);
+}
+
+// report progress on stderr every this many generated traces
+
+#define GENERATE_REPORT	(1LL<<28)
+
+// run a branch predictor of class P on traces from the generator and
+// print its mispredictions per kilo-instruction.  a long run reports how
+// far it has got, how fast it is going and how much memory it has used.
+
+template <class P>
+static void generate_with (generator_config *c) {
+	P *p = new P ();
+	long long int tmiss = 0, dmiss = 0;
+	trace_generator g (*c);
+	struct timespec start, now;
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	trace *t;
+	size_t n;
+	while ((n = g.next (&t))) {
+		for (size_t i=0; i<n; i++) predict_trace (p, &t[i], tmiss, dmiss);
+		if (g.position () % GENERATE_REPORT == 0) {
+			struct rusage ru;
+			getrusage (RUSAGE_SELF, &ru);
+			clock_gettime (CLOCK_MONOTONIC, &now);
+			double secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9;
+			fprintf (stderr, "%lld branches %0.3f MPKI %0.1f million branches/s %ldKB\n", g.position (),
+				1000.0 * (dmiss / (double) g.ninstructions), g.position () / secs * 1e-6, ru.ru_maxrss);
+		}
+	}
+	delete p;
+	printf ("%0.3f MPKI\n", 1000.0 * (dmiss / (double) g.ninstructions));
+}
+
+// the trace files found by run_all, in sorted order
+
+struct trace_job {
+	char *name;
+	long long int size;
+	double mpki;
+};
+
+static trace_job *jobs;
+static int njobs, maxjobs;
+
+// the next job to start, in order of decreasing size
+
+static trace_job **job_queue;
+static int next_job;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// nftw callback collecting trace files like "find -name '*.trace.*'"
+
+static int find_trace (const char *path, const struct stat *st, int type, struct FTW *) {
+	const char *base = strrchr (path, '/');
+	base = base ? base + 1 : path;
+	if (type == FTW_F && fnmatch ("*.trace.*", base, 0) == 0 
+	 && fnmatch ("*.idx", base, 0) != 0) {
+		if (njobs == maxjobs) {
+			maxjobs = maxjobs ? maxjobs * 2 : 64;
+			jobs = (trace_job *) realloc (jobs, maxjobs * sizeof (trace_job));
+		}
+		jobs[njobs].name = strdup (path);
+		jobs[njobs].size = st->st_size;
+		jobs[njobs].mpki = 0;
+		njobs++;
+	}
+	return 0;
+}
+
+static int by_name (const void *a, const void *b) {
+	return strcmp (((trace_job *) a)->name, ((trace_job *) b)->name);
+}
+
+static int by_size (const void *a, const void *b) {
+	long long int sa = (*(trace_job **) a)->size, sb = (*(trace_job **) b)->size;
+	return sa > sb ? -1 : sa < sb;
+}
+
+// a worker thread for run_all; keep taking the biggest trace left
+
+static void *run_jobs (void *) {
+	for (;;) {
+		pthread_mutex_lock (&job_lock);
+		trace_job *j = next_job < njobs ? job_queue[next_job++] : NULL;
+		pthread_mutex_unlock (&job_lock);
+		if (!j) break;
+		j->mpki = simulate_trace (j->name);
+	}
+	return NULL;
+}
+
+// simulate every trace file under a directory, one thread per processor,
+// and print the results like the run script does
 
+void run_all (char *dir) {
+	if (nftw (dir, find_trace, 16, 0) != 0) {
+		perror (dir);
+		exit (1);
+	}
+	qsort (jobs, njobs, sizeof (trace_job), by_name);
+
+	// start the biggest traces first so they don't hold up the end
+
+	job_queue = new trace_job *[njobs];
+	for (int i=0; i<njobs; i++) job_queue[i] = &jobs[i];
+	qsort (job_queue, njobs, sizeof (trace_job *), by_size);
+	int nthreads = processors ();
+	if (nthreads > njobs) nthreads = njobs;
+	if (nthreads < 1) nthreads = 1;
+	trace_threads (1);
+	pthread_t *threads = new pthread_t[nthreads];
+	for (int i=0; i<nthreads; i++) 
+		pthread_create (&threads[i], NULL, run_jobs, NULL);
+	for (int i=0; i<nthreads; i++) pthread_join (threads[i], NULL);
+
+	// print the results in name order.  like the run script, the
+	// average is taken over the printed values and truncated to three
+	// places.
+
+	long long int sum = 0;
+	for (int i=0; i<njobs; i++) {
+		printf ("%-40s\t%0.3f\n", jobs[i].name, jobs[i].mpki);
+		sum += llround (jobs[i].mpki * 1000);
+	}
+	if (njobs) {
+		long long int avg = sum / njobs;
+		printf ("average MPKI: %lld.%03lld\n", avg / 1000, avg % 1000);
+	}
+	delete[] threads;
+	delete[] job_queue;
+}
+
+// tell how to run the program and exit
+
+static void usage (char *name) {
+	fprintf (stderr, "Usage: %s [--shm] [--predictor perceptron|tage] <filename>.gz\n", name);
+	fprintf (stderr, "       %s [--shm] [--predictor perceptron|tage] --all <trace-file-directory>\n", name);
+	fprintf (stderr, "       %s [--predictor perceptron|tage] --generate [<knob>=<value>[,...]]\n", name);
+	fprintf (stderr, "       %s [--shm] [--instructions <n>] <any of the options below>\n", name);
+	fprintf (stderr, "       %s --sweep [--check] <bits>:<history>[,...] <filename>.gz ...\n", name);
+	fprintf (stderr, "       %s --pipeline <filename>.gz\n", name);
+	fprintf (stderr, "       %s --profile [<number of branches>] <filename>.gz\n", name);
+	fprintf (stderr, "       %s [--checkpoint <file> [--every <traces>] [--until <traces>]]\n", name);
+	fprintf (stderr, "          [--resume <file> | --warm <file>] <filename>.gz\n");
+	fprintf (stderr, "       %s --sample <interval length> [--period <intervals>] [--warmup <traces>]\n", name);
+	fprintf (stderr, "          [--weights <file>] <filename>.gz\n");
+	fprintf (stderr, "       %s --index [--every <traces>] <filename>.gz ...\n", name);
+	fprintf (stderr, "       %s --targets <filename>.gz\n", name);
+	fprintf (stderr, "       %s --perf <filename>.gz\n", name);
+	fprintf (stderr, "       %s --parallel [--threads <n>] [--warmup <traces>] [--exact] <filename>.gz\n", name);
+	exit (1);
+}
+
+int main (int argc, char *argv[]) {
+
+	// share decoded traces with other runs, take the trace files to be
+	// some other number of instructions long, and run a different
+	// predictor?
+
+	bool chose_predictor = false;
 	for (;;) {
+		int shift;
+		if (argc > 1 && strcmp (argv[1], "--shm") == 0) {
+			trace_shared (true);
+			shift = 1;
+		} else if (argc > 2 && strcmp (argv[1], "--instructions") == 0) {
+			long long int n = atoll (argv[2]);
+			if (n < 1) usage (argv[0]);
+			trace_instructions (n);
+			shift = 2;
+		} else if (argc > 2 && strcmp (argv[1], "--predictor") == 0) {
+			if (strcmp (argv[2], "perceptron") != 0 && strcmp (argv[2], "tage") != 0) usage (argv[0]);
+			predictor_name = argv[2];
+			chose_predictor = true;
+			shift = 2;
+		} else {
+			break;
+		}
+		argv[shift] = argv[0];
+		argc -= shift;
+		argv += shift;
+	}
+	if (chose_predictor && argc != 2 && !(argc == 3 && strcmp (argv[1], "--all") == 0)
+	 && !(argc == 3 && strcmp (argv[1], "--generate") == 0)) usage (argv[0]);
+
+	// simulate synthetic traces?
+
+	if ((argc == 2 || argc == 3) && strcmp (argv[1], "--generate") == 0) {
+		generator_config c;
+		if (argc == 3) parse_generator (argv[2], &c);
+		if (strcmp (predictor_name, "perceptron") == 0) generate_with<perceptron_predictor> (&c);
+		else if (strcmp (predictor_name, "tage") == 0) generate_with<tage_predictor> (&c);
+		else generate_with<my_predictor> (&c);
+		exit (0);
+	}
+
+	// run every trace in a directory?
+
+	if (argc == 3 && strcmp (argv[1], "--all") == 0) {
+		run_all (argv[2]);
+		exit (0);
+	}
+
+	// sweep over gshare configurations?
+
+	if (argc >= 4 && strcmp (argv[1], "--sweep") == 0) {
+		bool check = strcmp (argv[2], "--check") == 0;
+		if (check && argc < 5) usage (argv[0]);
+		run_sweep (argv[2 + check], check, argc - 3 - check, argv + 3 + check);
+		exit (0);
+	}
+
+	// run the stages of the simulation in separate threads?
+
+	if (argc == 3 && strcmp (argv[1], "--pipeline") == 0) {
+		printf ("%0.3f MPKI\n", run_pipeline (argv[2]));
+		exit (0);
+	}
 
-		// get a trace
+	// profile the mispredictions by static branch?
 
-		trace *t = read_trace ();
+	if ((argc == 3 || argc == 4) && strcmp (argv[1], "--profile") == 0) {
+		run_profile (argv[argc-1], argc == 4 ? atoi (argv[2]) : 50);
+		exit (0);
+	}
 
-		// NULL means end of file
+	// measure target predictions?
 
-		if (!t) break;
+	if (argc == 3 && strcmp (argv[1], "--targets") == 0) {
+		run_targets (argv[2]);
+		exit (0);
+	}
 
-		// send this trace to the competitor's code for prediction
+	// count time and hardware events by phase?
 
-		branch_update *u = p->predict (t->bi);
+	if (argc == 3 && strcmp (argv[1], "--perf") == 0) {
+		run_perf (argv[2]);
+		exit (0);
+	}
 
-		// collect statistics for a conditional branch trace
+	// save or restore checkpoints?
 
-		if (t->bi.br_flags & BR_CONDITIONAL) {
+	if (argc > 3 && argc % 2 == 0 && (strcmp (argv[1], "--checkpoint") == 0
+	 || strcmp (argv[1], "--resume") == 0 || strcmp (argv[1], "--warm") == 0)) {
+		checkpoint_options opt;
+		memset (&opt, 0, sizeof (opt));
+		for (int i=1; i<argc-1; i+=2) {
+			if (strcmp (argv[i], "--checkpoint") == 0) opt.save = argv[i+1];
+			else if (strcmp (argv[i], "--every") == 0) opt.every = atoll (argv[i+1]);
+			else if (strcmp (argv[i], "--until") == 0) opt.until = atoll (argv[i+1]);
+			else if (strcmp (argv[i], "--resume") == 0) opt.resume = argv[i+1];
+			else if (strcmp (argv[i], "--warm") == 0) opt.warm = argv[i+1];
+			else usage (argv[0]);
+		}
+		if ((opt.resume && opt.warm) || ((opt.every || opt.until) && !opt.save)) usage (argv[0]);
+		run_checkpoint (argv[argc-1], &opt);
+		exit (0);
+	}
 
-			// count a direction misprediction
+	// index trace files?
 
-			dmiss += u->direction_prediction () != t->taken;
+	if (argc > 2 && strcmp (argv[1], "--index") == 0) {
+		long long int every = INDEX_EVERY;
+		int i = 2;
+		if (argc > 4 && strcmp (argv[2], "--every") == 0) {
+			every = atoll (argv[3]);
+			i = 4;
+		}
+		if (every < 1) usage (argv[0]);
+		for (; i<argc; i++) if (!build_index (argv[i], every)) exit (1);
+		exit (0);
+	}
 
-			// count a target misprediction
+	// simulate segments of the trace in parallel?
 
-			tmiss += u->target_prediction () != t->target;
+	if (argc > 2 && strcmp (argv[1], "--parallel") == 0) {
+		int k = processors ();
+		long long int warmup = 4000000;
+		bool exact = false;
+		int i;
+		for (i=2; i<argc-1; i++) {
+			if (strcmp (argv[i], "--exact") == 0) exact = true;
+			else if (strcmp (argv[i], "--threads") == 0 && i < argc-2) k = atoi (argv[++i]);
+			else if (strcmp (argv[i], "--warmup") == 0 && i < argc-2) warmup = atoll (argv[++i]);
+			else usage (argv[0]);
 		}
+		if (k < 1 || warmup < 0) usage (argv[0]);
+		printf ("%0.3f MPKI\n", run_parallel (argv[argc-1], k, warmup, exact));
+		exit (0);
+	}
 
-		// update competitor's state
+	// measure only some intervals of the trace?
 
-		p->update (u, t->taken, t->target);
+	if (argc > 3 && argc % 2 == 0 && strcmp (argv[1], "--sample") == 0) {
+		sample_options opt;
+		opt.length = atoll (argv[2]);
+		opt.period = 10;
+		opt.warmup = -1;
+		opt.weights = NULL;
+		for (int i=3; i<argc-1; i+=2) {
+			if (strcmp (argv[i], "--period") == 0) opt.period = atoll (argv[i+1]);
+			else if (strcmp (argv[i], "--warmup") == 0) opt.warmup = atoll (argv[i+1]);
+			else if (strcmp (argv[i], "--weights") == 0) opt.weights = argv[i+1];
+			else usage (argv[0]);
+		}
+		if (opt.length < 1 || opt.period < 1 || opt.warmup < -1) usage (argv[0]);
+		run_sample (argv[argc-1], &opt);
+		exit (0);
 	}
 
-	// done reading traces
+	// otherwise make sure there is one parameter
 
-	end_trace ();
+	if (argc != 2) usage (argv[0]);
 
 	// give final mispredictions per kilo-instruction and exit.
-	// each trace represents exactly 100 million instructions.
 
-	printf ("%0.3f MPKI\n", 1000.0 * (dmiss / 1e8));
-	delete p;
+	printf ("%0.3f MPKI\n", simulate_trace (argv[1]));
 	exit (0);
 }
@@ -9,7 +9,7 @@ public:
 	bool direction_prediction () { return _direction_prediction; }
 	void direction_prediction (bool b) { _direction_prediction = b; }
 
-	bool target_prediction () { return _target_prediction; }
+	unsigned int target_prediction () { return _target_prediction; }
 	void target_prediction (unsigned int t) { _target_prediction = t; }
 
 	branch_update (void) : 
@@ -20,5 +20,21 @@ class branch_predictor {
 public:
 	virtual branch_update *predict (branch_info &) = 0;
 	virtual void update (branch_update *, bool, unsigned int) {}
+
+	// tell the predictor the outcome of a branch without asking for a
+	// prediction, to warm it up between sampled intervals.  by default
+	// this is just predict and update, but a predictor can do something
+	// cheaper as long as it leaves its state the same.
+
+	virtual void warm (branch_info & b, bool taken, unsigned int target) {
+		update (predict (b), taken, target);
+	}
+
+	// write the predictor's state to a file or read it back, for
+	// checkpoints; return false if that can't be done.  a predictor
+	// that doesn't override these can't be checkpointed.
+
+	virtual bool serialize (FILE *) { return false; }
+	virtual bool deserialize (FILE *) { return false; }
 	virtual ~branch_predictor (void) {}
 };
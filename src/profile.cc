@@ -0,0 +1,131 @@
+// profile.cc
+// This file contains the profiling mode of the driver.  It runs the
+// branch predictor on a trace like the normal mode and also counts
+// executions, taken branches and mispredictions for every static branch,
+// conditional branch opcode and kind of branch.  Then it prints the static
+// branches with the most mispredictions, which is where tuning a branch
+// predictor usually starts, followed by the totals by opcode and kind.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "predictor.h"
+#include "my_predictor.h"
+#include "driver.h"
+#include "profile.h"
+
+static const char *opcode_names[16] = {
+	"JO", "JNO", "JC", "JNC", "JZ", "JNZ", "JBE", "JA",
+	"JS", "JNS", "JP", "JNP", "JL", "JGE", "JLE", "JG",
+};
+
+// a name for a combination of BR_ flags
+
+static const char *flags_name (unsigned int f) {
+	switch (f) {
+	case 0: return "unconditional";
+	case BR_CONDITIONAL: return "conditional";
+	case BR_INDIRECT: return "indirect";
+	case BR_CALL: return "call";
+	case BR_CALL | BR_INDIRECT: return "indirect call";
+	case BR_RETURN: return "return";
+	default: return "other";
+	}
+}
+
+// the same loop as simulate in driver.h, counting each branch in the
+// profile
+
+template <class P>
+static void profile_simulate (P *p, trace_source & src, branch_profile & prof, 
+	long long int & dmiss) {
+	trace *t;
+	for (;;) {
+		size_t n = src.next (&t);
+		if (!n) break;
+		for (size_t i=0; i<n; i++) {
+			branch_update *u = dispatch<P>::predict (p, t[i].bi);
+			bool miss = (t[i].bi.br_flags & BR_CONDITIONAL) 
+				&& u->direction_prediction () != t[i].taken;
+			dmiss += miss;
+			prof.add (t[i].bi, t[i].taken, miss);
+			dispatch<P>::update (p, u, t[i].taken, t[i].target);
+		}
+	}
+}
+
+static int by_misses (const void *a, const void *b) {
+	const branch_entry *x = (const branch_entry *) a, *y = (const branch_entry *) b;
+	if (x->n.misses != y->n.misses) return x->n.misses > y->n.misses ? -1 : 1;
+	if (x->n.execs != y->n.execs) return x->n.execs > y->n.execs ? -1 : 1;
+	return x->address < y->address ? -1 : x->address > y->address;
+}
+
+// percentage, or 0 when there's nothing to take a percentage of
+
+static double percent (unsigned long long int a, unsigned long long int b) {
+	return b ? 100.0 * a / b : 0;
+}
+
+// print one line of counts
+
+static void print_counts (const char *name, branch_counts & c, long long int dmiss, 
+	long long int ninstructions) {
+	printf ("  %-14s %12llu %7.2f%% %10llu %7.2f%% %8.3f\n", name, c.execs, 
+		percent (c.taken, c.execs), c.misses, percent (c.misses, dmiss),
+		1000.0 * (c.misses / (double) ninstructions));
+}
+
+// simulate a trace file with profiling and print the top worst static
+// branches
+
+void run_profile (char *fname, int top) {
+	my_predictor *p = new my_predictor ();
+	branch_profile prof;
+	long long int dmiss = 0;
+	trace_source src (fname);
+	profile_simulate (p, src, prof, dmiss);
+	delete p;
+
+	printf ("%0.3f MPKI\n", 1000.0 * (dmiss / (double) src.ninstructions));
+
+	// the static branches with the most mispredictions
+
+	branch_entry *e;
+	unsigned int n = prof.entries (&e);
+	qsort (e, n, sizeof (branch_entry), by_misses);
+	if ((unsigned int) top > n) top = n;
+	printf ("\n%u static branches; the %d with the most mispredictions:\n", n, top);
+	printf ("  %-10s %-14s %12s %8s %10s %8s %8s\n", 
+		"address", "kind", "executions", "taken", "mispreds", "of all", "cum");
+	unsigned long long int cum = 0;
+	for (int i=0; i<top; i++) {
+		char kind[32];
+		if (e[i].br_flags & BR_CONDITIONAL) 
+			snprintf (kind, sizeof (kind), "%s", opcode_names[e[i].opcode & 15]);
+		else
+			snprintf (kind, sizeof (kind), "%s", flags_name (e[i].br_flags));
+		cum += e[i].n.misses;
+		printf ("  0x%08x %-14s %12llu %7.2f%% %10llu %7.2f%% %7.2f%%\n", 
+			e[i].address, kind, e[i].n.execs, percent (e[i].n.taken, e[i].n.execs),
+			e[i].n.misses, percent (e[i].n.misses, dmiss), percent (cum, dmiss));
+	}
+	delete[] e;
+
+	// the totals
+
+	branch_counts by_opcode[16], by_flags[16];
+	prof.totals (by_opcode, by_flags);
+	printf ("\nconditional branches by opcode:\n");
+	printf ("  %-14s %12s %8s %10s %8s %8s\n", "opcode", "executions", "taken", "mispreds", "of all", "MPKI");
+	for (int i=0; i<16; i++) if (by_opcode[i].execs) 
+		print_counts (opcode_names[i], by_opcode[i], dmiss, src.ninstructions);
+	printf ("\nbranches by kind:\n");
+	printf ("  %-14s %12s %8s %10s %8s %8s\n", "kind", "executions", "taken", "mispreds", "of all", "MPKI");
+	for (int i=0; i<16; i++) if (by_flags[i].execs) 
+		print_counts (flags_name (i), by_flags[i], dmiss, src.ninstructions);
+}
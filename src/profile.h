@@ -0,0 +1,113 @@
+// profile.h
+// This file contains the tables for the profiling mode of the driver:
+// counts of executions, taken branches and mispredictions for every
+// static branch, every conditional branch opcode and every kind of branch.
+// Static branches are kept in a flat open-addressed hash table keyed by
+// branch address so that counting costs little more than a memory access;
+// the totals by opcode and kind are summed from it afterward.
+
+// counts for a group of branches
+
+struct branch_counts {
+	unsigned long long int execs, taken, misses;
+};
+
+// counts for one static branch
+
+struct branch_entry {
+	unsigned int address, br_flags, opcode;
+	branch_counts n;
+};
+
+class branch_profile {
+	branch_entry *tab;
+	unsigned int bits, used;
+
+	unsigned int slot (unsigned int address) {
+		return (address * 0x9e3779b1u) >> (32 - bits);
+	}
+
+	// double the size of the table
+
+	void grow (void) {
+		branch_entry *old = tab;
+		unsigned int oldsize = 1 << bits;
+		bits++;
+		tab = new branch_entry[1<<bits];
+		memset (tab, 0, sizeof (branch_entry) << bits);
+		for (unsigned int i=0; i<oldsize; i++) if (old[i].n.execs) {
+			unsigned int j = slot (old[i].address);
+			while (tab[j].n.execs) j = (j + 1) & ((1<<bits)-1);
+			tab[j] = old[i];
+		}
+		delete[] old;
+	}
+
+public:
+	branch_profile (void) : bits(12), used(0) {
+		tab = new branch_entry[1<<bits];
+		memset (tab, 0, sizeof (branch_entry) << bits);
+	}
+
+	~branch_profile (void) {
+		delete[] tab;
+	}
+
+	// count one execution of a branch
+
+	void add (branch_info & bi, bool taken, bool miss) {
+		unsigned int j = slot (bi.address);
+		while (tab[j].n.execs && tab[j].address != bi.address) 
+			j = (j + 1) & ((1<<bits)-1);
+		branch_entry *e = &tab[j];
+		if (!e->n.execs) {
+
+			// a new branch; make room for it first if the table
+			// would be more than half full
+
+			if ((used + 1) * 2 > (1u << bits)) {
+				grow ();
+				add (bi, taken, miss);
+				return;
+			}
+			used++;
+			e->address = bi.address;
+			e->br_flags = bi.br_flags;
+			e->opcode = bi.opcode;
+		}
+		e->n.execs++;
+		e->n.taken += taken;
+		e->n.misses += miss;
+	}
+
+	// copy the static branches into an array; return how many there are
+
+	unsigned int entries (branch_entry **out) {
+		*out = new branch_entry[used];
+		unsigned int k = 0;
+		for (unsigned int i=0; i<(1u<<bits); i++) 
+			if (tab[i].n.execs) (*out)[k++] = tab[i];
+		return k;
+	}
+
+	// sum the static branches by opcode for conditional branches and
+	// by br_flags; the sums are done here rather than in add to keep
+	// counting cheap
+
+	void totals (branch_counts by_opcode[16], branch_counts by_flags[16]) {
+		memset (by_opcode, 0, sizeof (branch_counts) * 16);
+		memset (by_flags, 0, sizeof (branch_counts) * 16);
+		for (unsigned int i=0; i<(1u<<bits); i++) if (tab[i].n.execs) {
+			branch_counts *c = &by_flags[tab[i].br_flags & 15];
+			c->execs += tab[i].n.execs;
+			c->taken += tab[i].n.taken;
+			c->misses += tab[i].n.misses;
+			if (tab[i].br_flags & BR_CONDITIONAL) {
+				c = &by_opcode[tab[i].opcode & 15];
+				c->execs += tab[i].n.execs;
+				c->taken += tab[i].n.taken;
+				c->misses += tab[i].n.misses;
+			}
+		}
+	}
+};
@@ -0,0 +1,65 @@
+// ring.h
+// This file contains a bounded single-producer/single-consumer ring of
+// slots for handing work from one thread to another without locks.  The
+// producer fills the slot returned by producer_slot and then calls push;
+// the consumer uses the slot returned by consumer_slot and then calls pop.
+// The slots themselves never move, so big buffers are handed over without
+// being copied.  A thread waiting for a slot spins for a while and then
+// yields the processor.
+
+#include <atomic>
+#include <sched.h>
+
+template <class T, unsigned int N>
+class spsc_ring {
+	T slots[N];
+
+	// head is the next slot to consume and tail the next slot to
+	// produce; each is written by only one thread.  they're on their
+	// own cache lines so the threads don't fight over them.
+
+	alignas(64) std::atomic<unsigned long int> head;
+	alignas(64) std::atomic<unsigned long int> tail;
+
+	// wait a little while for the other thread
+
+	static void wait (int & spins) {
+		if (++spins < 1000) {
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause ();
+#endif
+		} else
+			sched_yield ();
+	}
+
+public:
+	spsc_ring (void) : head(0), tail(0) {}
+
+	// wait for an empty slot and return it
+
+	T *producer_slot (void) {
+		unsigned long int t = tail.load (std::memory_order_relaxed);
+		for (int spins=0; t - head.load (std::memory_order_acquire) == N;) wait (spins);
+		return &slots[t % N];
+	}
+
+	// hand the slot from producer_slot to the consumer
+
+	void push (void) {
+		tail.store (tail.load (std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// wait for a full slot and return it
+
+	T *consumer_slot (void) {
+		unsigned long int h = head.load (std::memory_order_relaxed);
+		for (int spins=0; tail.load (std::memory_order_acquire) == h;) wait (spins);
+		return &slots[h % N];
+	}
+
+	// give the slot from consumer_slot back to the producer
+
+	void pop (void) {
+		head.store (head.load (std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+};
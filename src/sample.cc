@@ -0,0 +1,221 @@
+// sample.cc
+// This file contains the sampling mode of the driver.  The trace is cut
+// into intervals of a fixed number of traces and only some of them are
+// measured: one out of every so many (systematic sampling) or those listed
+// in a weights file, e.g. from SimPoint.  Only the measured intervals get
+// the full predict and update with statistics.  Between them the traces
+// are still decoded, but are either given to the predictor's cheaper warm
+// method (functional warming) or skipped entirely apart from a warm-up
+// just before each measured interval; if the trace file has an index
+// the skipped traces don't even have to be decoded.  The result is the MPKI of each
+// measured interval and an estimate of the whole trace's MPKI with a 95%
+// confidence interval, which makes it practical to try predictors that are
+// too slow to run on every branch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "predictor.h"
+#include "my_predictor.h"
+#include "driver.h"
+
+// an interval to measure and what was measured in it
+
+struct sample_interval {
+	long long int index;
+	double weight;
+	long long int ntraces, dmiss;
+};
+
+static sample_interval *intervals;
+static int nintervals;
+
+// what to do with the traces in a stretch of the trace file
+
+enum sample_phase { SKIP, WARM, MEASURE };
+
+static int by_index (const void *a, const void *b) {
+	const sample_interval *x = (const sample_interval *) a, *y = (const sample_interval *) b;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// add an interval to measure
+
+static void add_interval (long long int index, double weight) {
+	intervals = (sample_interval *) realloc (intervals, (nintervals + 1) * sizeof (sample_interval));
+	sample_interval *s = &intervals[nintervals++];
+	s->index = index;
+	s->weight = weight;
+	s->ntraces = 0;
+	s->dmiss = 0;
+}
+
+// read a weights file: each line is an interval number (counting from 0)
+// and its weight.  blank lines and lines starting with # are ignored.
+
+static void read_weights (char *fname) {
+	FILE *f = fopen (fname, "r");
+	if (!f) {
+		perror (fname);
+		exit (1);
+	}
+	char line[1000];
+	int lineno = 0;
+	while (fgets (line, sizeof (line), f)) {
+		lineno++;
+		char *p = line + strspn (line, " \t");
+		if (*p == '#' || *p == '\n' || !*p) continue;
+		long long int index;
+		double weight;
+		if (sscanf (p, "%lld %lf", &index, &weight) != 2 || index < 0 || weight < 0) {
+			fprintf (stderr, "%s:%d: expected an interval and a weight\n", fname, lineno);
+			exit (1);
+		}
+		add_interval (index, weight);
+	}
+	fclose (f);
+	qsort (intervals, nintervals, sizeof (sample_interval), by_index);
+	for (int i=1; i<nintervals; i++) if (intervals[i].index == intervals[i-1].index) {
+		fprintf (stderr, "%s: interval %lld is listed twice\n", fname, intervals[i].index);
+		exit (1);
+	}
+}
+
+// the measured interval at or after interval i, or NULL if there are no
+// more.  next is where the search starts; intervals are visited in order.
+// with systematic sampling the intervals are made as they are reached.
+
+static sample_interval *next_interval (sample_options *opt, long long int i, int *next) {
+	if (!opt->weights) {
+		long long int j = i + (opt->period - 1 - i % opt->period);
+		if (!nintervals || intervals[nintervals-1].index != j) add_interval (j, 1);
+		*next = nintervals - 1;
+	}
+	while (*next < nintervals && intervals[*next].index < i) (*next)++;
+	return *next < nintervals ? &intervals[*next] : NULL;
+}
+
+// sample a trace file with the given options
+
+void run_sample (char *fname, sample_options *opt) {
+	my_predictor *p = new my_predictor ();
+	trace_source src (fname);
+	if (opt->weights) read_weights (opt->weights);
+	long long int L = opt->length, tmiss = 0, detailed = 0;
+	int next = 0;
+
+	// the number of traces in the file if the index or trace cache has
+	// it; otherwise the whole file has to be read to count them
+
+	long long int total = src.length ();
+
+	// go through the trace a stretch at a time, where a stretch is
+	// either part of a measured interval or all the traces before one
+	// or its warm-up, stopping after the last whole interval to measure
+	// if the number of traces is known
+
+	for (;;) {
+		long long int pos = src.position (), i = pos / L, end;
+		sample_interval *s = next_interval (opt, i, &next);
+		if (total >= 0 && (!s || (s->index + 1) * L > total)) break;
+		sample_phase phase;
+		if (s && s->index == i) {
+			phase = MEASURE;
+			end = (i + 1) * L;
+		} else if (opt->warmup < 0) {
+			phase = WARM;
+			end = (i + 1) * L;
+		} else if (!s) {
+			phase = SKIP;
+			end = LLONG_MAX;
+		} else {
+			long long int start = s->index * L - opt->warmup;
+			if (pos < start) {
+				phase = SKIP;
+				end = start;
+			} else {
+				phase = WARM;
+				end = s->index * L;
+			}
+		}
+
+		// skip straight to the next warm-up, through the trace file's
+		// index if there is one
+
+		if (phase == SKIP && end != LLONG_MAX) {
+			if (src.seek (end) < end) break;
+			continue;
+		}
+		trace *t;
+		size_t n = src.next (&t, end - pos < TRACE_BATCH ? end - pos : TRACE_BATCH);
+		if (!n) break;
+		switch (phase) {
+		case MEASURE:
+			for (size_t j=0; j<n; j++) predict_trace (p, &t[j], tmiss, s->dmiss);
+			s->ntraces += n;
+			break;
+		case WARM:
+			for (size_t j=0; j<n; j++) 
+				dispatch<my_predictor>::warm (p, t[j].bi, t[j].taken, t[j].target);
+			break;
+		case SKIP:
+			break;
+		}
+	}
+	delete p;
+
+	// the number of instructions per trace is only known for the whole
+	// file, so each interval gets its share of them by number of traces.
+	// a partial interval at the end of the file isn't counted.
+
+	if (total < 0) total = src.position ();
+	double per_trace = src.ninstructions / (double) total;
+	double sum = 0, wsum = 0;
+	int n = 0;
+	printf ("interval\tMPKI\n");
+	for (int i=0; i<nintervals; i++) {
+		sample_interval *s = &intervals[i];
+		if (s->ntraces < L) continue;
+		double mpki = 1000.0 * s->dmiss / (s->ntraces * per_trace);
+		printf ("%lld\t%0.3f\n", s->index, mpki);
+		sum += s->weight * mpki;
+		wsum += s->weight;
+		detailed += s->ntraces;
+		n++;
+	}
+	if (!n || wsum == 0) {
+		fprintf (stderr, "%s: no whole intervals were measured\n", fname);
+		exit (1);
+	}
+
+	// the estimate is the weighted mean of the intervals' MPKIs.  the
+	// error bound is from the normal approximation; with systematic
+	// sampling it is corrected for the part of the trace measured.
+
+	double mean = sum / wsum, var = 0;
+	for (int i=0; i<nintervals; i++) {
+		sample_interval *s = &intervals[i];
+		if (s->ntraces < L) continue;
+		double w = s->weight / wsum, d = 1000.0 * s->dmiss / (s->ntraces * per_trace) - mean;
+		var += w * w * d * d;
+	}
+	long long int N = total / L;
+	printf ("estimated MPKI: %0.3f ", mean);
+
+	// one interval gives no idea of the spread, so no bound
+
+	if (n > 1) {
+		double bound = 1.96 * sqrt (var * n / (n - 1));
+		if (!opt->weights && N > 0) bound *= sqrt (1 - n / (double) (N > n ? N : n));
+		printf ("+/- %0.3f (95%% confidence)", bound);
+	} else
+		printf ("+/- n/a (one interval)");
+	printf (", %d of %lld intervals, %0.2f%% of branches measured\n", n, N, 100.0 * detailed / total);
+	free (intervals);
+}
@@ -0,0 +1,413 @@
+// sweep.cc
+// This file contains the sweep mode of the driver.  It decodes a trace
+// once and feeds every trace to a whole set of gshare predictors with
+// different table sizes and history lengths, each keeping its own
+// misprediction counts.  The predictors are divided among threads that
+// all work on the same batch of decoded traces while the main thread
+// decodes the next batch.
+//
+// The configurations are given as a comma-separated list of
+// <table bits>:<history length> pairs, where either number can be a
+// range, e.g. "10-17:0-16,18:12".  Pairs in a range with a history longer
+// than the table index are skipped.  A history length of 0 gives a
+// bimodal predictor.
+//
+// The predictors are simulated in groups of eight that share one global
+// history.  On processors with AVX2 the eight indices of a group are
+// computed, their counters gathered and the new counter values computed
+// with vector instructions; otherwise the same thing is done one
+// configuration at a time.  Either way the predictions are exactly those
+// of gshare_predictor in gshare.h.  With "--check" the sweep then runs a
+// gshare_predictor for each configuration through the ordinary simulation
+// loop and stops with an error if any count differs; that decodes the
+// trace again for every configuration, so it is only for testing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <immintrin.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "predictor.h"
+#include "gshare.h"
+#include "driver.h"
+
+// number of traces decoded at once for all the predictors
+
+#define SWEEP_BATCH	(TRACE_BATCH*16)
+
+// number of configurations in a group, and the most counters in a group
+// so that the vector code can index them with 32-bit offsets
+
+#define LANES		8
+#define GROUP_BYTES	(1<<30)
+
+// one gshare configuration and its statistics
+
+struct sweep_point {
+	int table_bits, history_length;
+	long long int tmiss, dmiss;
+};
+
+static sweep_point *points;
+static int npoints;
+
+// a group of up to LANES configurations.  their tables of 2-bit counters
+// are laid out one after another in tab; lane k's index into it is
+// offset[k] + ((history & history_mask[k]) << shift[k]) ^ (address & address_mask[k]).
+// unused lanes have all zeros and are never stored.  a gshare always
+// predicts a target of 0, so the target mispredictions are the same for
+// every lane and are counted once.
+
+struct sweep_group {
+	unsigned int offset[LANES], shift[LANES], history_mask[LANES], address_mask[LANES];
+	int n, point[LANES];
+	unsigned char *tab;
+	size_t size;
+	unsigned int history;
+	long long int tmiss, dmiss[LANES];
+};
+
+static sweep_group *groups;
+static int ngroups;
+
+// use the AVX2 version of the simulation?
+
+static bool use_avx2;
+
+// the decoded traces; the main thread fills one batch while the workers
+// predict the other
+
+static trace *batch[2];
+static size_t batch_size[2];
+static pthread_barrier_t batch_ready;
+
+// the trace cache, if there is one
+
+static trace_map map;
+static bool mapped;
+
+// number of worker threads
+
+static int nworkers;
+
+// parse a number or a range of numbers like "10-17"
+
+static void parse_range (char *s, int *lo, int *hi) {
+	char *end;
+	*lo = *hi = strtol (s, &end, 10);
+	if (*end == '-') *hi = strtol (end + 1, &end, 10);
+	if (end == s || *end || *lo > *hi) {
+		fprintf (stderr, "bad sweep range \"%s\"\n", s);
+		exit (1);
+	}
+}
+
+// parse the list of configurations into points
+
+static void parse_sweep (char *spec) {
+	char *list = strdup (spec), *save;
+	for (char *item = strtok_r (list, ",", &save); item; item = strtok_r (NULL, ",", &save)) {
+		char *colon = strchr (item, ':');
+		if (!colon) {
+			fprintf (stderr, "bad sweep configuration \"%s\"\n", item);
+			exit (1);
+		}
+		*colon = 0;
+		int tlo, thi, hlo, hhi;
+		parse_range (item, &tlo, &thi);
+		parse_range (colon + 1, &hlo, &hhi);
+		bool single = tlo == thi && hlo == hhi;
+		for (int tb=tlo; tb<=thi; tb++) for (int hl=hlo; hl<=hhi; hl++) {
+			if (tb < 1 || tb > 30 || hl < 0 || hl > tb || hl > 31) {
+				if (!single) continue;
+				fprintf (stderr, "can't make a gshare with %d table bits and history length %d\n", tb, hl);
+				exit (1);
+			}
+			points = (sweep_point *) realloc (points, (npoints + 1) * sizeof (sweep_point));
+			points[npoints].table_bits = tb;
+			points[npoints].history_length = hl;
+			points[npoints].tmiss = 0;
+			points[npoints].dmiss = 0;
+			npoints++;
+		}
+	}
+	free (list);
+}
+
+// put the points into groups of up to LANES with at most GROUP_BYTES
+// counters each
+
+static void make_groups (void) {
+	for (int k=0; k<npoints; k++) {
+		size_t size = (size_t) 1 << points[k].table_bits;
+		sweep_group *g = ngroups ? &groups[ngroups-1] : NULL;
+		if (!g || g->n == LANES || g->size + size > GROUP_BYTES) {
+			groups = (sweep_group *) realloc (groups, (ngroups + 1) * sizeof (sweep_group));
+			g = &groups[ngroups++];
+			memset (g, 0, sizeof (sweep_group));
+		}
+		int tb = points[k].table_bits, hl = points[k].history_length;
+		g->offset[g->n] = g->size;
+		g->shift[g->n] = tb - hl;
+		g->history_mask[g->n] = (1u << hl) - 1;
+		g->address_mask[g->n] = (1u << tb) - 1;
+		g->point[g->n] = k;
+		g->n++;
+		g->size += size;
+	}
+
+	// the vector code reads four bytes at a time, so pad the tables
+
+	for (int i=0; i<ngroups; i++) groups[i].tab = new unsigned char[groups[i].size + 4];
+}
+
+// clear the tables and statistics of a group for a new trace
+
+static void reset_group (sweep_group *g) {
+	memset (g->tab, 0, g->size + 4);
+	g->history = 0;
+	g->tmiss = 0;
+	memset (g->dmiss, 0, sizeof (g->dmiss));
+}
+
+// predict n traces with one group, one configuration at a time.  the
+// loop goes over the traces for each group rather than the other way
+// around so each group's tables stay in the cache for the whole batch.
+
+static void sweep_batch (sweep_group *g, trace *t, size_t n) {
+	unsigned int history = g->history;
+	for (size_t i=0; i<n; i++) {
+		if (!(t[i].bi.br_flags & BR_CONDITIONAL)) continue;
+		bool taken = t[i].taken;
+		g->tmiss += t[i].target != 0;
+		for (int k=0; k<g->n; k++) {
+			unsigned char *c = &g->tab[g->offset[k] 
+				+ (((history & g->history_mask[k]) << g->shift[k]) 
+				^ (t[i].bi.address & g->address_mask[k]))];
+			g->dmiss[k] += (*c >> 1) != taken;
+			if (taken) {
+				if (*c < 3) (*c)++;
+			} else {
+				if (*c > 0) (*c)--;
+			}
+		}
+		history = (history << 1) | taken;
+	}
+	g->history = history;
+}
+
+// the same with AVX2.  the counters are gathered four bytes at a time and
+// masked to the low byte; there is no scatter, so the new values are
+// stored one lane at a time.
+
+__attribute__((target("avx2")))
+static void sweep_batch_avx2 (sweep_group *g, trace *t, size_t n) {
+	__m256i offset = _mm256_loadu_si256 ((__m256i *) g->offset);
+	__m256i shift = _mm256_loadu_si256 ((__m256i *) g->shift);
+	__m256i history_mask = _mm256_loadu_si256 ((__m256i *) g->history_mask);
+	__m256i address_mask = _mm256_loadu_si256 ((__m256i *) g->address_mask);
+	__m256i zero = _mm256_setzero_si256 ();
+	__m256i one = _mm256_set1_epi32 (1);
+	__m256i three = _mm256_set1_epi32 (3);
+	__m256i low_byte = _mm256_set1_epi32 (0xff);
+	__m256i misses = zero;
+	unsigned int index[LANES] __attribute__((aligned(32)));
+	unsigned int counter[LANES] __attribute__((aligned(32)));
+	unsigned int history = g->history;
+	int nlanes = g->n;
+	for (size_t i=0; i<n; i++) {
+		if (!(t[i].bi.br_flags & BR_CONDITIONAL)) continue;
+		bool taken = t[i].taken;
+		g->tmiss += t[i].target != 0;
+		__m256i h = _mm256_and_si256 (_mm256_set1_epi32 (history), history_mask);
+		__m256i a = _mm256_and_si256 (_mm256_set1_epi32 (t[i].bi.address), address_mask);
+		__m256i x = _mm256_add_epi32 (offset, _mm256_xor_si256 (_mm256_sllv_epi32 (h, shift), a));
+		__m256i c = _mm256_and_si256 (
+			_mm256_i32gather_epi32 ((const int *) g->tab, x, 1), low_byte);
+
+		// a misprediction is when the high bit of the counter isn't
+		// the outcome
+
+		__m256i tk = _mm256_set1_epi32 (-(int) taken);
+		misses = _mm256_add_epi32 (misses, 
+			_mm256_xor_si256 (_mm256_srli_epi32 (c, 1), _mm256_and_si256 (tk, one)));
+
+		// saturating increment or decrement
+
+		__m256i up = _mm256_min_epi32 (_mm256_add_epi32 (c, one), three);
+		__m256i down = _mm256_max_epi32 (_mm256_sub_epi32 (c, one), zero);
+		c = _mm256_blendv_epi8 (down, up, tk);
+		_mm256_store_si256 ((__m256i *) index, x);
+		_mm256_store_si256 ((__m256i *) counter, c);
+		for (int k=0; k<nlanes; k++) g->tab[index[k]] = counter[k];
+		history = (history << 1) | taken;
+	}
+	g->history = history;
+	_mm256_store_si256 ((__m256i *) counter, misses);
+	for (int k=0; k<nlanes; k++) g->dmiss[k] += counter[k];
+}
+
+static void predict_batch (sweep_group *g, trace *t, size_t n) {
+	if (use_avx2) 
+		sweep_batch_avx2 (g, t, n);
+	else
+		sweep_batch (g, t, n);
+}
+
+// a worker thread; it handles every nworkers'th group
+
+static void *sweep_worker (void *arg) {
+	long int id = (long int) arg;
+	if (mapped) {
+
+		// with a trace cache the traces are all in memory already
+
+		trace *t = new trace[SWEEP_BATCH];
+		for (long long int i=0; i<map.ntraces; i+=SWEEP_BATCH) {
+			size_t n = map.ntraces - i < SWEEP_BATCH ? map.ntraces - i : SWEEP_BATCH;
+			for (size_t j=0; j<n; j++) unpack_trace (t[j], map.traces[i+j]);
+			for (int k=id; k<ngroups; k+=nworkers) predict_batch (&groups[k], t, n);
+		}
+		delete[] t;
+		return NULL;
+	}
+	for (int cur=0;; cur^=1) {
+		pthread_barrier_wait (&batch_ready);
+		if (!batch_size[cur]) break;
+		for (int k=id; k<ngroups; k+=nworkers) 
+			predict_batch (&groups[k], batch[cur], batch_size[cur]);
+	}
+	return NULL;
+}
+
+// simulate every group on one trace file; return the number of
+// instructions in it
+
+static long long int sweep_trace (char *fname) {
+	for (int i=0; i<ngroups; i++) reset_group (&groups[i]);
+	long long int ninstructions = trace_file_instructions ();
+	mapped = map_trace (fname, &map);
+
+	pthread_t *threads = new pthread_t[nworkers];
+	pthread_barrier_init (&batch_ready, NULL, nworkers + 1);
+	for (long int i=0; i<nworkers; i++) 
+		pthread_create (&threads[i], NULL, sweep_worker, (void *) i);
+
+	if (!mapped) {
+
+		// decode the next batch while the workers predict this one.
+		// a barrier separates each step; an empty batch means the
+		// end of the trace.
+
+		trace_reader *tr = open_trace (fname);
+		batch[0] = new trace[SWEEP_BATCH];
+		batch[1] = new trace[SWEEP_BATCH];
+		batch_size[0] = read_traces (tr, batch[0], SWEEP_BATCH);
+		for (int cur=0;; cur^=1) {
+			pthread_barrier_wait (&batch_ready);
+			if (!batch_size[cur]) break;
+			batch_size[cur^1] = read_traces (tr, batch[cur^1], SWEEP_BATCH);
+		}
+		close_trace (tr);
+		delete[] batch[0];
+		delete[] batch[1];
+	}
+	for (int i=0; i<nworkers; i++) pthread_join (threads[i], NULL);
+	pthread_barrier_destroy (&batch_ready);
+	delete[] threads;
+	if (mapped) unmap_trace (&map);
+
+	for (int i=0; i<ngroups; i++) for (int k=0; k<groups[i].n; k++) {
+		points[groups[i].point[k]].tmiss = groups[i].tmiss;
+		points[groups[i].point[k]].dmiss = groups[i].dmiss[k];
+	}
+	return ninstructions;
+}
+
+// run gshare_predictor over a trace file for each point and make sure it
+// gets the same counts as the sweep did
+
+static void check_sweep (char *fname) {
+	for (int k=0; k<npoints; k++) {
+		gshare_predictor *p = new gshare_predictor (points[k].table_bits, points[k].history_length);
+		trace_source src (fname);
+		long long int tmiss = 0, dmiss = 0;
+		simulate (p, src, tmiss, dmiss);
+		delete p;
+		if (tmiss != points[k].tmiss || dmiss != points[k].dmiss) {
+			fprintf (stderr, "%s: sweep of %d:%d got %lld/%lld mispredictions, gshare_predictor %lld/%lld\n",
+				fname, points[k].table_bits, points[k].history_length,
+				points[k].dmiss, points[k].tmiss, dmiss, tmiss);
+			exit (1);
+		}
+	}
+	fprintf (stderr, "%s: all %d configurations match gshare_predictor\n", fname, npoints);
+}
+
+// print the MPKI of every point, then as a grid of table bits by history
+// length if the points cover more than one of each
+
+static void print_sweep (long long int ninstructions) {
+	for (int k=0; k<npoints; k++) 
+		printf ("%d\t%d\t%0.3f MPKI\n", points[k].table_bits, points[k].history_length,
+			1000.0 * (points[k].dmiss / (double) ninstructions));
+
+	int tlo = 31, thi = 0, hlo = 32, hhi = -1;
+	for (int k=0; k<npoints; k++) {
+		if (points[k].table_bits < tlo) tlo = points[k].table_bits;
+		if (points[k].table_bits > thi) thi = points[k].table_bits;
+		if (points[k].history_length < hlo) hlo = points[k].history_length;
+		if (points[k].history_length > hhi) hhi = points[k].history_length;
+	}
+	if (tlo == thi || hlo == hhi) return;
+	double grid[31][32];
+	for (int tb=0; tb<31; tb++) for (int hl=0; hl<32; hl++) grid[tb][hl] = -1;
+	for (int k=0; k<npoints; k++) 
+		grid[points[k].table_bits][points[k].history_length] = 
+			1000.0 * (points[k].dmiss / (double) ninstructions);
+	printf ("\nbits\\hist");
+	for (int hl=hlo; hl<=hhi; hl++) printf ("\t%d", hl);
+	printf ("\n");
+	for (int tb=tlo; tb<=thi; tb++) {
+		printf ("%d", tb);
+		for (int hl=hlo; hl<=hhi; hl++) {
+			if (grid[tb][hl] < 0) 
+				printf ("\t-");
+			else
+				printf ("\t%0.3f", grid[tb][hl]);
+		}
+		printf ("\n");
+	}
+}
+
+// simulate every configuration in spec on each trace file and print the
+// mispredictions per kilo-instruction for each, checking them against
+// gshare_predictor if check is true
+
+void run_sweep (char *spec, bool check, int nfiles, char *fnames[]) {
+	parse_sweep (spec);
+	if (!npoints) {
+		fprintf (stderr, "no configurations in \"%s\"\n", spec);
+		exit (1);
+	}
+	make_groups ();
+	use_avx2 = __builtin_cpu_supports ("avx2");
+	nworkers = processors ();
+	if (nworkers > ngroups) nworkers = ngroups;
+
+	for (int i=0; i<nfiles; i++) {
+		long long int ninstructions = sweep_trace (fnames[i]);
+		if (check) check_sweep (fnames[i]);
+		if (nfiles > 1) printf ("%s%s\n", i ? "\n" : "", fnames[i]);
+		print_sweep (ninstructions);
+		fflush (stdout);
+	}
+
+	for (int i=0; i<ngroups; i++) delete[] groups[i].tab;
+	free (groups);
+	free (points);
+}
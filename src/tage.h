@@ -0,0 +1,264 @@
+// tage.h
+// This file contains a TAGE predictor (Seznec and Michaud, "A case for
+// (partially) TAgged GEometric history length branch prediction", JILP
+// 2006) to compare other predictors against; run it with "predict
+// --predictor tage".  A bimodal table gives the prediction unless one of
+// eight tagged tables, indexed with global histories of geometrically
+// increasing length from 4 up to 640 branches, has an entry for the branch;
+// then the entry with the longest history gives it.  A misprediction
+// allocates an entry in a table with a longer history than the one that
+// gave the prediction.
+//
+// The histories are kept with the primitives in history.h: the global
+// history is a circular buffer of outcomes, so a history of any length
+// costs nothing to keep, and the indices and tags are hashes of the history
+// "folded" down to their width by xoring its pieces together, kept in
+// registers that are updated in a few operations for each branch rather
+// than recomputed from the whole history.  Besides the
+// outcomes of conditional branches, the history gets a bit of the target
+// of every other branch, and a path history gets a bit of the address of
+// every branch.
+
+#include "gshare.h"
+#include "history.h"
+
+#define TAGE_TABLES	8	// tagged tables
+#define TAGE_LOG_ENTRIES	10	// log2 of the entries in a tagged table
+#define TAGE_LOG_BASE	14	// log2 of the entries in the bimodal table
+#define TAGE_MAX_HISTORY	640	// the longest history
+#define TAGE_PATH_BITS	16	// bits of path history
+#define TAGE_U_RESET	(1<<18)	// conditional branches between agings of the useful bits
+
+// the history lengths and tag widths of the tagged tables
+
+static const int tage_history_length[TAGE_TABLES] = { 4, 8, 17, 35, 73, 150, 310, TAGE_MAX_HISTORY };
+static const int tage_tag_bits[TAGE_TABLES] = { 8, 8, 9, 9, 10, 11, 11, 12 };
+
+// an entry of a tagged table: a partial tag, a 3-bit signed counter whose
+// sign is the prediction, and a 2-bit count of how useful the entry has
+// been.  sixteen fit in a cache line.
+
+struct tage_entry {
+	unsigned short tag;
+	signed char ctr;
+	unsigned char u;
+};
+
+class tage_update : public branch_update {
+public:
+	unsigned int base_index;
+	unsigned int index[TAGE_TABLES];
+	unsigned short tag[TAGE_TABLES];
+	int hit, alt;		// tables giving the prediction and the alternate, or -1
+	bool provider_pred, alt_pred;
+};
+
+class tage_predictor : public branch_predictor {
+	tage_entry table[TAGE_TABLES][1<<TAGE_LOG_ENTRIES] __attribute__ ((aligned (64)));
+	gshare<TAGE_LOG_BASE, 0, 2> base;	// bimodal: no history
+
+	global_history<TAGE_MAX_HISTORY> ghist;
+	path_history<TAGE_PATH_BITS> phist;
+	folded_history index_fold[TAGE_TABLES], tag_fold[TAGE_TABLES][2];
+
+	// whether to trust a newly allocated entry or the alternate
+	// prediction, a 4-bit signed counter
+
+	int use_alt_on_na;
+	unsigned int tick, seed;
+
+	tage_update u;
+	branch_info bi;
+
+	// the hash of the path history for table i
+
+	unsigned int path_hash (int i) const {
+		int n = tage_history_length[i] < TAGE_PATH_BITS ? tage_history_length[i] : TAGE_PATH_BITS;
+		unsigned int p = phist.value () & ((1u << n) - 1);
+		return p ^ (p >> (TAGE_LOG_ENTRIES - i % 4));
+	}
+
+	// add an outcome to the global history
+
+	void push (bool bit) {
+		ghist.push (bit);
+		for (int i=0; i<TAGE_TABLES; i++) {
+			unsigned int out = ghist.bit (tage_history_length[i]);
+			index_fold[i].update (bit, out);
+			tag_fold[i][0].update (bit, out);
+			tag_fold[i][1].update (bit, out);
+		}
+	}
+
+	static void bump (signed char & c, bool up, int min, int max) {
+		if (up) {
+			if (c < max) c++;
+		} else {
+			if (c > min) c--;
+		}
+	}
+
+	// a small pseudo-random number for choosing where to allocate
+
+	unsigned int random (void) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed;
+	}
+
+public:
+	tage_predictor (void) : use_alt_on_na(0), tick(0), seed(0x2545f491) {
+		memset (table, 0, sizeof (table));
+		for (int i=0; i<TAGE_TABLES; i++) {
+			index_fold[i].init (tage_history_length[i], TAGE_LOG_ENTRIES);
+			tag_fold[i][0].init (tage_history_length[i], tage_tag_bits[i]);
+			tag_fold[i][1].init (tage_history_length[i], tage_tag_bits[i] - 1);
+		}
+	}
+
+	branch_update *predict (branch_info & b) {
+		bi = b;
+		if (b.br_flags & BR_CONDITIONAL) {
+			unsigned int pc = b.address;
+			u.base_index = base.index (pc);
+			for (int i=0; i<TAGE_TABLES; i++) {
+				u.index[i] = (pc ^ (pc >> (TAGE_LOG_ENTRIES - i)) ^ index_fold[i].value () ^ path_hash (i))
+					& ((1u << TAGE_LOG_ENTRIES) - 1);
+				u.tag[i] = (pc ^ tag_fold[i][0].value () ^ (tag_fold[i][1].value () << 1))
+					& ((1u << tage_tag_bits[i]) - 1);
+			}
+
+			// the longest matching history gives the prediction and
+			// the next longest the alternate
+
+			u.hit = u.alt = -1;
+			for (int i=TAGE_TABLES-1; i>=0; i--)
+				if (table[i][u.index[i]].tag == u.tag[i]) {
+					if (u.hit < 0) u.hit = i;
+					else {
+						u.alt = i;
+						break;
+					}
+				}
+			bool base_pred = base.prediction (u.base_index);
+			u.alt_pred = u.alt >= 0 ? table[u.alt][u.index[u.alt]].ctr >= 0 : base_pred;
+			if (u.hit >= 0) {
+				tage_entry *e = &table[u.hit][u.index[u.hit]];
+				u.provider_pred = e->ctr >= 0;
+				bool newly = (e->ctr == 0 || e->ctr == -1) && e->u == 0;
+				u.direction_prediction (newly && use_alt_on_na >= 0 ? u.alt_pred : u.provider_pred);
+			} else {
+				u.provider_pred = base_pred;
+				u.direction_prediction (base_pred);
+			}
+		} else {
+			u.direction_prediction (true);
+		}
+		u.target_prediction (0);
+		return &u;
+	}
+
+	void update (branch_update *bu, bool taken, unsigned int target) {
+		if (bi.br_flags & BR_CONDITIONAL) {
+			tage_update *tu = (tage_update *) bu;
+			int hit = tu->hit;
+
+			// learn whether to trust new entries
+
+			if (hit >= 0) {
+				tage_entry *e = &table[hit][tu->index[hit]];
+				if ((e->ctr == 0 || e->ctr == -1) && e->u == 0 && tu->provider_pred != tu->alt_pred) {
+					if (tu->alt_pred == taken) {
+						if (use_alt_on_na < 7) use_alt_on_na++;
+					} else {
+						if (use_alt_on_na > -8) use_alt_on_na--;
+					}
+				}
+			}
+
+			// on a misprediction, allocate an entry with a longer
+			// history, starting one table further up now and then so
+			// that the tables above don't all fill with the same
+			// branches.  if none is free, make them all a bit more
+			// likely to be replaced next time.
+
+			if (tu->direction_prediction () != taken && hit < TAGE_TABLES - 1) {
+				int start = hit + 1 + (hit + 2 < TAGE_TABLES && (random () & 3) == 0);
+				int i;
+				for (i=start; i<TAGE_TABLES; i++) {
+					tage_entry *e = &table[i][tu->index[i]];
+					if (e->u == 0) {
+						e->tag = tu->tag[i];
+						e->ctr = taken ? 0 : -1;
+						break;
+					}
+				}
+				if (i == TAGE_TABLES)
+					for (i=hit+1; i<TAGE_TABLES; i++) {
+						tage_entry *e = &table[i][tu->index[i]];
+						if (e->u) e->u--;
+					}
+			}
+
+			// train the provider, and the alternate as well if the
+			// provider is still new to the job; an entry is useful
+			// when it is right and the alternate isn't
+
+			if (hit >= 0) {
+				tage_entry *e = &table[hit][tu->index[hit]];
+				if (e->u == 0) {
+					if (tu->alt >= 0) bump (table[tu->alt][tu->index[tu->alt]].ctr, taken, -4, 3);
+					else base.update (tu->base_index, taken);
+				}
+				bump (e->ctr, taken, -4, 3);
+				if (tu->provider_pred != tu->alt_pred) {
+					if (tu->provider_pred == taken) {
+						if (e->u < 3) e->u++;
+					} else {
+						if (e->u > 0) e->u--;
+					}
+				}
+			} else {
+				base.update (tu->base_index, taken);
+			}
+
+			// age the useful bits now and then so that stale entries
+			// can be replaced
+
+			if (++tick == TAGE_U_RESET) {
+				tick = 0;
+				for (int i=0; i<TAGE_TABLES; i++)
+					for (int j=0; j<(1<<TAGE_LOG_ENTRIES); j++) table[i][j].u >>= 1;
+			}
+			push (taken);
+		} else {
+			push ((target >> 2) & 1);
+		}
+		phist.push (bi.address);
+	}
+
+	bool serialize (FILE *f) {
+		if (!(fwrite (table, sizeof (table), 1, f) == 1
+		 && base.serialize (f) && ghist.serialize (f) && phist.serialize (f)
+		 && fwrite (&use_alt_on_na, sizeof (use_alt_on_na), 1, f) == 1
+		 && fwrite (&tick, sizeof (tick), 1, f) == 1
+		 && fwrite (&seed, sizeof (seed), 1, f) == 1)) return false;
+		for (int i=0; i<TAGE_TABLES; i++)
+			if (!(index_fold[i].serialize (f) && tag_fold[i][0].serialize (f)
+			 && tag_fold[i][1].serialize (f))) return false;
+		return true;
+	}
+
+	bool deserialize (FILE *f) {
+		if (!(fread (table, sizeof (table), 1, f) == 1
+		 && base.deserialize (f) && ghist.deserialize (f) && phist.deserialize (f)
+		 && fread (&use_alt_on_na, sizeof (use_alt_on_na), 1, f) == 1
+		 && fread (&tick, sizeof (tick), 1, f) == 1
+		 && fread (&seed, sizeof (seed), 1, f) == 1)) return false;
+		for (int i=0; i<TAGE_TABLES; i++)
+			if (!(index_fold[i].deserialize (f) && tag_fold[i][0].deserialize (f)
+			 && tag_fold[i][1].deserialize (f))) return false;
+		return true;
+	}
+};
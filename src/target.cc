@@ -0,0 +1,91 @@
+// target.cc
+// This file contains the target mode of the driver.  It runs my_predictor
+// and the target predictors in target.h side by side over a trace and
+// reports how well each predicts the targets of indirect jumps, indirect
+// calls and returns, separately: the mispredictions per kilo-instruction
+// and the percentage of those branches mispredicted.  A predictor gives a
+// target with branch_update::target_prediction; the sample my_predictor
+// doesn't, so it misses them all.  The reference predictors are:
+//
+// - btb: a BTB for indirect branches and returns
+// - btb+ras: a BTB for indirect branches and a return stack for returns
+// - ittage+ras: an ITTAGE for indirect branches and a return stack
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "predictor.h"
+#include "my_predictor.h"
+#include "target.h"
+#include "driver.h"
+
+// the kinds of branches scored
+
+#define TARGET_JUMP	0	// indirect jumps
+#define TARGET_CALL	1	// indirect calls
+#define TARGET_RETURN	2	// returns
+#define TARGET_KINDS	3
+
+static const char *kind_names[TARGET_KINDS] = {
+	"indirect jumps", "indirect calls", "returns",
+};
+
+// the kind of a branch, or -1 if its target isn't scored
+
+static int target_kind (const branch_info & b) {
+	if (b.br_flags & BR_RETURN) return TARGET_RETURN;
+	if (!(b.br_flags & BR_INDIRECT)) return -1;
+	return (b.br_flags & BR_CALL) ? TARGET_CALL : TARGET_JUMP;
+}
+
+#define TARGET_PREDICTORS	4
+
+static const char *predictor_names[TARGET_PREDICTORS] = {
+	"my_predictor", "btb", "btb+ras", "ittage+ras",
+};
+
+void run_targets (char *fname) {
+	branch_predictor *p[TARGET_PREDICTORS] = {
+		new my_predictor (), new btb_predictor (false), new btb_predictor (true),
+		new ittage_predictor (),
+	};
+	long long int count[TARGET_KINDS], miss[TARGET_PREDICTORS][TARGET_KINDS];
+	memset (count, 0, sizeof (count));
+	memset (miss, 0, sizeof (miss));
+
+	trace_source src (fname);
+	trace *t;
+	for (;;) {
+		size_t n = src.next (&t);
+		if (!n) break;
+		for (size_t i=0; i<n; i++) {
+			int k = target_kind (t[i].bi);
+			if (k >= 0) count[k]++;
+			for (int j=0; j<TARGET_PREDICTORS; j++) {
+				branch_update *u = p[j]->predict (t[i].bi);
+				if (k >= 0) miss[j][k] += u->target_prediction () != t[i].target;
+				p[j]->update (u, t[i].taken, t[i].target);
+			}
+		}
+	}
+
+	// a column of MPKI and miss rate for each kind
+
+	printf ("%-14s", "");
+	for (int k=0; k<TARGET_KINDS; k++) printf ("  %18s", kind_names[k]);
+	printf ("\n%-14s", "branches");
+	for (int k=0; k<TARGET_KINDS; k++) printf ("  %18lld", count[k]);
+	printf ("\n");
+	for (int j=0; j<TARGET_PREDICTORS; j++) {
+		printf ("%-14s", predictor_names[j]);
+		for (int k=0; k<TARGET_KINDS; k++) 
+			printf ("  %8.3f MPKI %3.0f%%", 1000.0 * (miss[j][k] / (double) src.ninstructions),
+				count[k] ? 100.0 * miss[j][k] / count[k] : 0);
+		printf ("\n");
+		delete p[j];
+	}
+}
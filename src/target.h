@@ -0,0 +1,372 @@
+// target.h
+// This file contains predictors of branch targets to compare others
+// against in the target mode of the driver ("predict --targets"; see
+// target.cc).  They predict the targets of indirect jumps, indirect calls
+// and returns, the branches whose targets aren't in the instruction, and
+// leave the directions of conditional branches alone.
+//
+// - btb_predictor remembers the last target of each indirect branch in a
+//   4-way set-associative branch target buffer, and with a return stack
+//   predicts returns from the calls that came before them
+// - ittage_predictor is an ITTAGE (Seznec, "A 64-Kbytes ITTAGE indirect
+//   branch predictor", JWAC-2 2011) with four tagged tables of targets
+//   indexed with global histories of 4 to 64 branches over a BTB, and a
+//   return stack for returns
+//
+// The parts are classes of their own so that they can go into other
+// predictors.
+
+#include "history.h"
+
+// a branch whose target this predicts: an indirect jump or call
+
+static inline bool target_indirect (const branch_info & b) {
+	return (b.br_flags & BR_INDIRECT) && !(b.br_flags & BR_RETURN);
+}
+
+// a branch target buffer with 4<<LogSets entries, four to a 32-byte set.
+// the ways of a set are kept in order of use so that the least recently
+// used one is replaced.
+
+struct btb_entry {
+	unsigned int address, target;
+};
+
+template <int LogSets>
+class btb {
+	btb_entry sets[1<<LogSets][4] __attribute__ ((aligned (32)));
+
+	static unsigned int set (unsigned int address) {
+		return (address ^ (address >> LogSets)) & ((1u << LogSets) - 1);
+	}
+
+public:
+	btb (void) {
+		memset (sets, 0, sizeof (sets));
+	}
+
+	// the last target of a branch, or 0 if it isn't there
+
+	unsigned int lookup (unsigned int address) const {
+		const btb_entry *s = sets[set (address)];
+		for (int i=0; i<4; i++) if (s[i].address == address) return s[i].target;
+		return 0;
+	}
+
+	void update (unsigned int address, unsigned int target) {
+		btb_entry *s = sets[set (address)];
+		int i;
+		for (i=0; i<3; i++) if (s[i].address == address) break;
+		for (; i>0; i--) s[i] = s[i-1];
+		s[0].address = address;
+		s[0].target = target;
+	}
+
+	bool serialize (FILE *f) { return fwrite (sets, sizeof (sets), 1, f) == 1; }
+	bool deserialize (FILE *f) { return fread (sets, sizeof (sets), 1, f) == 1; }
+};
+
+// a return address stack of RAS_ENTRIES entries that wraps around when
+// it overflows.  the traces don't give the lengths of call instructions,
+// so the return address of a call is its address plus the length seen
+// the last time it returned, or a guess the first time; in these traces
+// it is almost always 5 for a direct call and 2 for an indirect one.
+
+#define RAS_ENTRIES	32
+#define RAS_LENGTHS	4096	// call instructions whose lengths are kept
+
+class return_stack {
+	unsigned int calls[RAS_ENTRIES], returns[RAS_ENTRIES];
+	unsigned char lengths[RAS_LENGTHS];
+	int top;
+
+	static unsigned int length_index (unsigned int address) {
+		return (address ^ (address >> 12)) & (RAS_LENGTHS - 1);
+	}
+
+public:
+	return_stack (void) : top(0) {
+		memset (calls, 0, sizeof (calls));
+		memset (returns, 0, sizeof (returns));
+		memset (lengths, 0, sizeof (lengths));
+	}
+
+	void call (const branch_info & b) {
+		top = (top + 1) % RAS_ENTRIES;
+		calls[top] = b.address;
+		unsigned int n = lengths[length_index (b.address)];
+		returns[top] = b.address + (n ? n : (b.br_flags & BR_INDIRECT) ? 2 : 5);
+	}
+
+	// the return address of the last call, or 0 if there isn't one
+
+	unsigned int predict (void) const {
+		return returns[top];
+	}
+
+	// pop the last call, learning its length from where it returned to
+
+	void ret (unsigned int target) {
+		unsigned int d = target - calls[top];
+		if (calls[top] && d >= 1 && d <= 15) lengths[length_index (calls[top])] = d;
+		calls[top] = returns[top] = 0;
+		top = (top + RAS_ENTRIES - 1) % RAS_ENTRIES;
+	}
+
+	bool serialize (FILE *f) {
+		return fwrite (calls, sizeof (calls), 1, f) == 1
+			&& fwrite (returns, sizeof (returns), 1, f) == 1
+			&& fwrite (lengths, sizeof (lengths), 1, f) == 1
+			&& fwrite (&top, sizeof (top), 1, f) == 1;
+	}
+
+	bool deserialize (FILE *f) {
+		return fread (calls, sizeof (calls), 1, f) == 1
+			&& fread (returns, sizeof (returns), 1, f) == 1
+			&& fread (lengths, sizeof (lengths), 1, f) == 1
+			&& fread (&top, sizeof (top), 1, f) == 1 && top >= 0 && top < RAS_ENTRIES;
+	}
+};
+
+// a BTB for indirect branches, and optionally a return stack for returns;
+// without one, returns are predicted by the BTB like indirect branches
+
+class btb_predictor : public branch_predictor {
+	btb<8> b;
+	return_stack ras;
+	bool use_ras;
+	branch_update u;
+	branch_info bi;
+
+public:
+	btb_predictor (bool r = true) : use_ras(r) {}
+
+	branch_update *predict (branch_info & x) {
+		bi = x;
+		u.direction_prediction (true);
+		if (use_ras && (x.br_flags & BR_RETURN))
+			u.target_prediction (ras.predict ());
+		else if (target_indirect (x) || (x.br_flags & BR_RETURN))
+			u.target_prediction (b.lookup (x.address));
+		else
+			u.target_prediction (0);
+		return &u;
+	}
+
+	void update (branch_update *, bool taken, unsigned int target) {
+		if (use_ras && (bi.br_flags & BR_RETURN))
+			ras.ret (target);
+		else if (target_indirect (bi) || (bi.br_flags & BR_RETURN))
+			b.update (bi.address, target);
+		if (use_ras && (bi.br_flags & BR_CALL)) ras.call (bi);
+	}
+
+	bool serialize (FILE *f) {
+		return b.serialize (f) && ras.serialize (f);
+	}
+
+	bool deserialize (FILE *f) {
+		return b.deserialize (f) && ras.deserialize (f);
+	}
+};
+
+// the tagged tables of ittage_predictor: their history lengths and tag
+// widths
+
+#define ITTAGE_TABLES	4
+#define ITTAGE_LOG_ENTRIES	9	// log2 of the entries in a table
+#define ITTAGE_MAX_HISTORY	64
+#define ITTAGE_U_RESET	(1<<16)	// indirect branches between agings of the useful bits
+
+static const int ittage_history_length[ITTAGE_TABLES] = { 4, 10, 24, ITTAGE_MAX_HISTORY };
+static const int ittage_tag_bits[ITTAGE_TABLES] = { 9, 10, 11, 12 };
+
+// an entry of a tagged table, eight to a cache line: a partial tag, the
+// target, a 2-bit confidence in it and a 2-bit count of how useful the
+// entry has been
+
+struct ittage_entry {
+	unsigned short tag;
+	unsigned char ctr, u;
+	unsigned int target;
+};
+
+class ittage_update : public branch_update {
+public:
+	unsigned int index[ITTAGE_TABLES];
+	unsigned short tag[ITTAGE_TABLES];
+	int hit, alt;		// tables giving the target and the alternate, or -1
+};
+
+class ittage_predictor : public branch_predictor {
+	ittage_entry table[ITTAGE_TABLES][1<<ITTAGE_LOG_ENTRIES] __attribute__ ((aligned (64)));
+	btb<8> base;
+	return_stack ras;
+
+	// the global history gets the outcome of each conditional branch and
+	// two bits of the target of every other branch
+
+	global_history<ITTAGE_MAX_HISTORY> ghist;
+	path_history<16> phist;
+	folded_history index_fold[ITTAGE_TABLES], tag_fold[ITTAGE_TABLES][2];
+	unsigned int tick, seed;
+
+	ittage_update u;
+	branch_info bi;
+
+	void push (bool bit) {
+		ghist.push (bit);
+		for (int i=0; i<ITTAGE_TABLES; i++) {
+			unsigned int out = ghist.bit (ittage_history_length[i]);
+			index_fold[i].update (bit, out);
+			tag_fold[i][0].update (bit, out);
+			tag_fold[i][1].update (bit, out);
+		}
+	}
+
+	unsigned int random (void) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed;
+	}
+
+public:
+	ittage_predictor (void) : tick(0), seed(0x2545f491) {
+		memset (table, 0, sizeof (table));
+		for (int i=0; i<ITTAGE_TABLES; i++) {
+			index_fold[i].init (ittage_history_length[i], ITTAGE_LOG_ENTRIES);
+			tag_fold[i][0].init (ittage_history_length[i], ittage_tag_bits[i]);
+			tag_fold[i][1].init (ittage_history_length[i], ittage_tag_bits[i] - 1);
+		}
+	}
+
+	branch_update *predict (branch_info & b) {
+		bi = b;
+		u.direction_prediction (true);
+		if (b.br_flags & BR_RETURN) {
+			u.target_prediction (ras.predict ());
+		} else if (target_indirect (b)) {
+			unsigned int pc = b.address;
+			unsigned int p = phist.value ();
+			for (int i=0; i<ITTAGE_TABLES; i++) {
+				u.index[i] = (pc ^ (pc >> (ITTAGE_LOG_ENTRIES - i)) ^ index_fold[i].value ()
+					^ (p >> i)) & ((1u << ITTAGE_LOG_ENTRIES) - 1);
+				u.tag[i] = (pc ^ tag_fold[i][0].value () ^ (tag_fold[i][1].value () << 1))
+					& ((1u << ittage_tag_bits[i]) - 1);
+			}
+
+			// the longest matching history gives the target, unless
+			// it has no confidence in it yet and there is another
+
+			u.hit = u.alt = -1;
+			for (int i=ITTAGE_TABLES-1; i>=0; i--)
+				if (table[i][u.index[i]].tag == u.tag[i]) {
+					if (u.hit < 0) u.hit = i;
+					else {
+						u.alt = i;
+						break;
+					}
+				}
+			unsigned int alt = u.alt >= 0 ? table[u.alt][u.index[u.alt]].target : base.lookup (pc);
+			if (u.hit >= 0) {
+				ittage_entry *e = &table[u.hit][u.index[u.hit]];
+				u.target_prediction (e->ctr == 0 && alt ? alt : e->target);
+			} else {
+				u.target_prediction (alt);
+			}
+		} else {
+			u.target_prediction (0);
+		}
+		return &u;
+	}
+
+	void update (branch_update *bu, bool taken, unsigned int target) {
+		if (bi.br_flags & BR_RETURN) {
+			ras.ret (target);
+		} else if (target_indirect (bi)) {
+			ittage_update *tu = (ittage_update *) bu;
+			int hit = tu->hit;
+
+			// on a misprediction, allocate an entry with a longer
+			// history, or make the ones there more likely to be
+			// replaced next time
+
+			if (tu->target_prediction () != target && hit < ITTAGE_TABLES - 1) {
+				int start = hit + 1 + (hit + 2 < ITTAGE_TABLES && (random () & 3) == 0);
+				int i;
+				for (i=start; i<ITTAGE_TABLES; i++) {
+					ittage_entry *e = &table[i][tu->index[i]];
+					if (e->u == 0) {
+						e->tag = tu->tag[i];
+						e->target = target;
+						e->ctr = 0;
+						break;
+					}
+				}
+				if (i == ITTAGE_TABLES)
+					for (i=hit+1; i<ITTAGE_TABLES; i++) {
+						ittage_entry *e = &table[i][tu->index[i]];
+						if (e->u) e->u--;
+					}
+			}
+
+			// train the provider: more confidence if it was right,
+			// less or a new target if it was wrong.  it is useful if
+			// it was right and the alternate would have been wrong.
+
+			if (hit >= 0) {
+				ittage_entry *e = &table[hit][tu->index[hit]];
+				unsigned int alt = tu->alt >= 0 ? table[tu->alt][tu->index[tu->alt]].target
+					: base.lookup (bi.address);
+				if (e->target == target) {
+					if (e->ctr < 3) e->ctr++;
+					if (alt != target && e->u < 3) e->u++;
+				} else {
+					if (e->ctr > 0) e->ctr--;
+					else e->target = target;
+					if (alt == target && e->u > 0) e->u--;
+				}
+			}
+			base.update (bi.address, target);
+			if (++tick == ITTAGE_U_RESET) {
+				tick = 0;
+				for (int i=0; i<ITTAGE_TABLES; i++)
+					for (int j=0; j<(1<<ITTAGE_LOG_ENTRIES); j++) table[i][j].u >>= 1;
+			}
+		}
+		if (bi.br_flags & BR_CALL) ras.call (bi);
+
+		// the histories
+
+		if (bi.br_flags & BR_CONDITIONAL) {
+			push (taken);
+		} else {
+			push ((target >> 2) & 1);
+			push ((target >> 3) & 1);
+		}
+		phist.push (bi.address);
+	}
+
+	bool serialize (FILE *f) {
+		if (!(fwrite (table, sizeof (table), 1, f) == 1
+		 && base.serialize (f) && ras.serialize (f) && ghist.serialize (f) && phist.serialize (f)
+		 && fwrite (&tick, sizeof (tick), 1, f) == 1
+		 && fwrite (&seed, sizeof (seed), 1, f) == 1)) return false;
+		for (int i=0; i<ITTAGE_TABLES; i++)
+			if (!(index_fold[i].serialize (f) && tag_fold[i][0].serialize (f)
+			 && tag_fold[i][1].serialize (f))) return false;
+		return true;
+	}
+
+	bool deserialize (FILE *f) {
+		if (!(fread (table, sizeof (table), 1, f) == 1
+		 && base.deserialize (f) && ras.deserialize (f) && ghist.deserialize (f) && phist.deserialize (f)
+		 && fread (&tick, sizeof (tick), 1, f) == 1
+		 && fread (&seed, sizeof (seed), 1, f) == 1)) return false;
+		for (int i=0; i<ITTAGE_TABLES; i++)
+			if (!(index_fold[i].deserialize (f) && tag_fold[i][0].deserialize (f)
+			 && tag_fold[i][1].deserialize (f))) return false;
+		return true;
+	}
+};
@@ -9,9 +9,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <bzlib.h>
 
 #include "branch.h"
 #include "trace.h"
+#include "trace2.h"
 
 // A trace is a piece of information about a branch.  The external 
 // representation of a trace is 9 bytes:
@@ -30,10 +43,17 @@
 // - A four byte little-endian branch target.  This is the address in memory 
 // where the branch jumped.
 //
+// Nothing in a trace says how many instructions it stands for.  The CBP-2
+// trace files are 100 million instructions each (TRACE_INSTRUCTIONS), and
+// predict --instructions gives the count for any other, e.g. from gen.
+// The compressor in compress/ passes along records of a byte 0x87 and a
+// two-byte instruction count in front of a trace, but none of the trace
+// files have them and this file doesn't read them.
+//
 // The input file is usually compressed either with gzip or bzip2 and this
-// file contains code to support reading from these formats by piping the
-// output of the decompressors.  However, this file s does another kind of
-// decompression on the traces after they have been decompressed by gzip
+// file contains code to support reading from these formats by linking
+// the decompressors into the program.  However, this file s does another kind
+// of decompression on the traces after they have been decompressed by gzip
 // or bzip2.  If the upper four bits of the first byte read are either
 // 0 or 8 then the byte indicates that the trace has been compressed
 // from the 9 byte representation to a 1 or 2 byte representation.  This
@@ -41,66 +61,251 @@
 // achieved is not impressive -- Huffman coding would do much better -- but
 // the purpose is to allow the stream of bytes fed to gzip or bzip2 to be
 // much more redundant and hence more compressible.
+//
+// A trace file starting with TRACE2_MAGIC is in the version 2 format
+// described in trace2.h, where the same prediction is followed by an
+// entropy coder instead of gzip or bzip2.
+
+// number of decompressed bytes to produce at once
+
+#define BUFSIZE	(1<<20)
+
+// number of compressed bytes to read at once from the file
+
+#define INBUFSIZE	(1<<18)
+
+// the longest encoding of a single trace: a return address patch prefix
+// followed by a code, address and target
+
+#define MAX_TRACE_BYTES	10
+
+// a bzip2 block of a trace file, from the file's index; see seek_trace
+
+struct index_block {
+
+	// the bits of the file holding the block, from its magic number
+	// up to the next block's or the end of the stream
+
+	long long int bit_start, bit_end;
+
+	// number of decompressed bytes before the block
+
+	long long int out_offset;
+};
+
+// a trace file and the buffer of bytes decompressed from it
 
-// number of bytes to read at once from the decompressor
+struct trace_input {
 
-#define BUFSIZE	10000
+	// how the bytes in the trace file are stored
 
-// file pointer for the pipe from the decompressor
+	enum { RAW, GZIP, BZIP2, CALLBACK, V2 } format;
 
-FILE *tracefp;
+	// for CALLBACK, the function that supplies the bytes
 
-// buffer to read bytes into
+	size_t (*source) (void *, unsigned char *, size_t);
+	void *source_arg;
 
-unsigned char buf[BUFSIZE];
+	// file pointer for the trace file
 
-// current position in buffer
-unsigned int bufpos;
+	FILE *fp;
 
-// number of bytes read into buffer
+	// name of the trace file, for error messages
 
-unsigned int bufsize;
+	char *name;
 
-// true when end of file is reached
+	// decompressor states; only the one for format is in use
 
-bool end_of_file;
+	z_stream zs;
+	bz_stream bzs;
 
-// read a single byte from the trace file
+	// buffer to read compressed bytes into
 
-unsigned char read_byte (void) {
+	unsigned char inbuf[INBUFSIZE] __attribute__ ((aligned (64)));
 
-	// if the buffer is empty...
+	// number of bytes in inbuf not yet consumed by open_input, and
+	// where they start
 
-	if (bufpos == bufsize) {
+	unsigned int inavail;
+	unsigned char *innext;
 
-		// get a BUFSIZE-sized chunk of bytes from the input
+	// true when there are no more compressed bytes in the file
 
-		bufpos = 0;
-		bufsize = fread (buf, 1, BUFSIZE, tracefp);
+	bool end_of_input;
 
-		// nothing to read?  we must be done.
+	// when reading a bzip2 file from the middle, the blocks still to
+	// read, and the block being read made into a bzip2 stream of its
+	// own; blocks is NULL when reading the file from the start
 
-		if (bufsize == 0) {
-			end_of_file = true;
+	index_block *blocks;
+	long long int nblocks;
+	unsigned char *block_stream;
+	size_t block_size, block_pos;
+
+	// buffer to decompress bytes into, with room for padding at the end
+
+	unsigned char buf[BUFSIZE+MAX_TRACE_BYTES] __attribute__ ((aligned (64)));
+
+	// current position in buffer
+
+	unsigned int bufpos;
+
+	// number of bytes read into buffer
+
+	unsigned int bufsize;
+
+	// number of decompressed bytes that came before the buffer
+
+	long long int offset;
+
+	// true when end of file is reached
+
+	bool end_of_file;
+};
+
+static bool next_block_stream (trace_input *in);
+
+// read the next chunk of compressed bytes into inbuf; return the number
+// of bytes read, or 0 if the file is exhausted
+
+static unsigned int fill_input (trace_input *in) {
+	if (in->end_of_input) return 0;
+	if (in->blocks) {
+		if (in->block_pos == in->block_size && !next_block_stream (in)) {
+			in->end_of_input = true;
 			return 0;
 		}
+		unsigned int n = in->block_size - in->block_pos < INBUFSIZE 
+			? in->block_size - in->block_pos : INBUFSIZE;
+		memcpy (in->inbuf, in->block_stream + in->block_pos, n);
+		in->block_pos += n;
+		return n;
+	}
+	unsigned int n = fread (in->inbuf, 1, INBUFSIZE, in->fp);
+	if (n == 0) {
+		if (ferror (in->fp)) {
+			perror (in->name);
+			exit (1);
+		}
+		in->end_of_input = true;
 	}
+	return n;
+}
+
+// decompress up to size bytes into dst; return the number of bytes
+
+static unsigned int fill_buffer (trace_input *in, unsigned char *dst, unsigned int size) {
+	unsigned int n = 0;
+
+	switch (in->format) {
+	case trace_input::RAW:
+	case trace_input::V2:
 
-	// one more byte 
+		// plain files and version 2 traces are read directly,
+		// starting with whatever open_input left in inbuf when it
+		// looked for a magic number
 
-	return buf[bufpos++];
+		if (in->inavail) {
+			n = in->inavail < size ? in->inavail : size;
+			memcpy (dst, in->innext, n);
+			in->innext += n;
+			in->inavail -= n;
+		}
+		if (!in->end_of_input && n < size) 
+			n += fread (dst + n, 1, size - n, in->fp);
+		break;
+	case trace_input::GZIP:
+		in->zs.next_out = dst;
+		in->zs.avail_out = size;
+		while (in->zs.avail_out) {
+			if (!in->zs.avail_in) {
+				in->zs.avail_in = fill_input (in);
+				in->zs.next_in = in->inbuf;
+				if (!in->zs.avail_in) break;
+			}
+			int ret = inflate (&in->zs, Z_NO_FLUSH);
+			if (ret == Z_STREAM_END) {
+
+				// gzip files may be concatenated; keep
+				// going like "gzip -dc" does
+
+				inflateReset (&in->zs);
+			} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+				fprintf (stderr, "%s: gzip error %d\n", in->name, ret);
+				exit (1);
+			}
+		}
+		n = size - in->zs.avail_out;
+		break;
+	case trace_input::BZIP2:
+		in->bzs.next_out = (char *) dst;
+		in->bzs.avail_out = size;
+		while (in->bzs.avail_out) {
+			if (!in->bzs.avail_in) {
+				in->bzs.avail_in = fill_input (in);
+				in->bzs.next_in = (char *) in->inbuf;
+				if (!in->bzs.avail_in) break;
+			}
+			int ret = BZ2_bzDecompress (&in->bzs);
+			if (ret == BZ_STREAM_END) {
+
+				// likewise for concatenated bzip2 files
+
+				unsigned int avail = in->bzs.avail_in;
+				char *next = in->bzs.next_in, *out = in->bzs.next_out;
+				unsigned int avail_out = in->bzs.avail_out;
+				BZ2_bzDecompressEnd (&in->bzs);
+				BZ2_bzDecompressInit (&in->bzs, 0, 0);
+				in->bzs.avail_in = avail;
+				in->bzs.next_in = next;
+				in->bzs.next_out = out;
+				in->bzs.avail_out = avail_out;
+			} else if (ret != BZ_OK) {
+				fprintf (stderr, "%s: bzip2 error %d\n", in->name, ret);
+				exit (1);
+			}
+		}
+		n = size - in->bzs.avail_out;
+		break;
+	case trace_input::CALLBACK:
+		n = in->source (in->source_arg, dst, size);
+		break;
+	}
+	return n;
 }
 
-// read an unsigned integer in little endian format from the trace file
+// make sure at least MAX_TRACE_BYTES bytes are in the buffer so a whole
+// trace can be decoded without checking for the end of the buffer.  near
+// the end of the file there may be fewer; the buffer is padded with zeros
+// so a truncated trace still can't run off the end.  return false if there
+// is nothing left.
+
+static bool fill_trace (trace_input *in) {
+	unsigned int left = in->bufsize - in->bufpos;
+	if (left >= MAX_TRACE_BYTES || in->end_of_file) return left > 0;
+
+	// move the partial trace to the front and read more after it
+
+	memmove (in->buf, in->buf + in->bufpos, left);
+	in->offset += in->bufpos;
+	in->bufpos = 0;
+	in->bufsize = left;
+	while (in->bufsize < MAX_TRACE_BYTES) {
+		unsigned int n = fill_buffer (in, in->buf + in->bufsize, BUFSIZE - in->bufsize);
+		if (n == 0) {
+			in->end_of_file = true;
+			memset (in->buf + in->bufsize, 0, MAX_TRACE_BYTES);
+			break;
+		}
+		in->bufsize += n;
+	}
+	return in->bufsize > 0;
+}
 
-unsigned int read_uint (void) {
-	unsigned int x0, x1, x2, x3;
+// get an unsigned integer in little endian format from the trace buffer
 
-	x0 = read_byte ();
-	x1 = read_byte ();
-	x2 = read_byte ();
-	x3 = read_byte ();
-	return x0 | (x1 << 8) | (x2 << 16) | (x3 << 24);
+static inline unsigned int get_uint (unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
 }
 
 // these "remember" structs and functions handle decompressing certain traces
@@ -113,7 +318,6 @@ struct remember {
 	bool taken;
 	unsigned char code; 
 	unsigned int address, target;
-	unsigned int lru_time;
 
 	// constructor
 
@@ -122,7 +326,6 @@ struct remember {
 		address = 0;
 		target = 0;
 		taken = 0;
-		lru_time = 0;
 	}
 
 	// return true if two remember structs are equivalent.  optionally
@@ -141,92 +344,295 @@ struct remember {
 // a return address stack
                                                                                 
 #define RAS_SIZE        100
-                                                                                
-unsigned int ras[RAS_SIZE];
-int ras_top = RAS_SIZE;
+
+// parameters for the predictor table
+
+#define N_REMEMBER	(1<<16)
+#define ASSOC		8
+
+// one set of the predictor table.  each field of the ASSOC ways is kept in
+// its own array so the whole set takes two cache lines: the codes, the
+// LRU order and the addresses in the first and the targets in the second.
+// every trace that is remembered is a taken branch (the code tells us if
+// a conditional branch was not taken) so taken is not kept.
+//
+// the LRU order is a permutation of the ways, one per nibble: nibble 0
+// is the most recently used way and nibble 7 the least recently used.
+// the original code kept a 32-bit time stamp per way and replaced the
+// way with the smallest one, taking the lowest way on a tie.  every
+// stamp starts at 0, so the starting order has way 0 least recently used,
+// then way 1, and so on, which gives exactly the same replacements.
+
+struct remember_set {
+	unsigned char code[ASSOC];
+	unsigned int lru;
+	unsigned int address[ASSOC];
+
+	// the set's last symbol in a version 2 trace; see trace2.h
+
+	unsigned char v2_last;
+	unsigned int target[ASSOC] __attribute__ ((aligned (64)));
+
+	// constructor
+
+	remember_set (void) {
+		memset (this, 0, sizeof (remember_set));
+		lru = 0x01234567;
+	}
+};
+
+// the state of the decoder for one trace file
+
+struct trace_decoder {
+
+	// the return address stack
+
+	unsigned int ras[RAS_SIZE];
+	int ras_top;
+
+	// false until the LRU order is first updated; see touch_remember
+
+	bool lru_started;
+
+	// target of the last trace seen
+
+	unsigned int last_target;
+
+	// the predictor table; a 64k-entry 8-way set associative memory.
+	// we can only remember up to 8 possible predictions per branch
+	// target because we're squeezing set indices into a 3-bit code so
+	// having a fixed set size is OK.  in practice, most branches need
+	// only 1 or 2 possible predictions, but some traces benefit from
+	// higher associativity.
+
+	remember_set rtab[N_REMEMBER];
+};
 
 // (re)initialize the return address stack
-void init_ras (void) {
-	ras_top = RAS_SIZE;
+static void init_ras (trace_decoder *d) {
+	d->ras_top = RAS_SIZE;
 }
 
 // push a target onto the return address stack
 
-void push_ras (unsigned int a) {
-	if (ras_top) ras[--ras_top] = a;
+static void push_ras (trace_decoder *d, unsigned int a) {
+	if (d->ras_top) d->ras[--d->ras_top] = a;
 }
 
 // pop a target from the return address stack
 
-unsigned int pop_ras (void) {
-	if (ras_top < RAS_SIZE) return ras[ras_top++];
+static unsigned int pop_ras (trace_decoder *d) {
+	if (d->ras_top < RAS_SIZE) return d->ras[d->ras_top++];
 	return 0;
 }
 
-// parameters for the predictor table
+// predict a trace
 
-#define N_REMEMBER	(1<<16)
-#define ASSOC		8
+static remember_set *predict_remember (trace_decoder *d) {
+	return &d->rtab[d->last_target & (N_REMEMBER-1)];
+}
 
-// the predictor table; a 64k-entry 8-way set associative memory.
-// a hash table with probing would probably be more space-efficient
-// but I think this is a little faster (neither has good locality).
-// we can only remember up to 8 possible predictions per branch target
-// because we're squeezing set indices into a 3-bit code so having
-// a fixed set size is OK.  in practice, most branches need only 1 or 2
-// possible predictions, but some traces benefit from higher associativity.
+// make a way of a set the most recently used
 
-remember rtab[N_REMEMBER][ASSOC];
+static inline void touch_remember (trace_decoder *d, remember_set *s, unsigned int way) {
 
-// this int keeps time for the LRU algorithm
+	// the first time stamp the original code handed out was 0, which
+	// is the same as an unused way's, so the first use changed nothing
 
-static unsigned int now = 0; 
+	if (!d->lru_started) {
+		d->lru_started = true;
+		return;
+	}
 
-// last trace seen
+	// nothing to do if it's already the most recently used, which is
+	// the usual case
 
-static remember last_one; 
+	if ((s->lru & 15) == way) return;
 
-// predict a trace
+	// find the nibble holding way.  x has a zero nibble there, and
+	// the lowest bit set in the mask below marks the lowest zero nibble.
+
+	unsigned int x = s->lru ^ (way * 0x11111111u);
+	unsigned int pos = __builtin_ctz ((x - 0x11111111u) & ~x & 0x88888888u) & ~3;
+
+	// move the ways used more recently than it down one place and
+	// put it at the front
 
-remember *predict_remember (void) {
-	unsigned int index = last_one.target & (N_REMEMBER-1);
-	remember *r = &rtab[index][0];
-	return r;
+	unsigned long long int below = (1ull << pos) - 1;
+	unsigned long long int above = ~0ull << (pos + 4);
+	s->lru = (s->lru & above) | ((s->lru & below) << 4) | way;
 }
 
 // update the predictor
 
-void update_remember (remember & me, remember *r, bool correct, int index) {
+static void update_remember (trace_decoder *d, remember & me, remember_set *s, bool correct, int index) {
 	if (correct) {
-		r[index].lru_time = now++;
+		touch_remember (d, s, index);
 	} else {
 		// throw out the LRU item and replace it with me
-		int lru = 0;
-		for (int i=1; i<ASSOC; i++)
-			if (r[i].lru_time < r[lru].lru_time) lru = i;
-		r[lru] = me;
-		r[lru].lru_time = now++;
+		int lru = s->lru >> 28;
+		s->code[lru] = me.code;
+		s->address[lru] = me.address;
+		s->target[lru] = me.target;
+		touch_remember (d, s, lru);
 	}
-	last_one = me;
+	d->last_target = me.target;
 }
 
-// read a single trace from the file
+// the rest of decoding a correctly predicted trace into t: way is the
+// way of the predicted set p that holds it.  return its code.
 
-trace *read_trace (void) {
-	static trace t;
+static inline unsigned char decode_hit (trace_decoder *d, trace & t, remember_set *p, int way,
+	bool ras_correct, bool ras_offby2, bool ras_offby3) {
+	remember r;
+	r.code = p->code[way];
+	r.address = p->address[way];
+	r.target = p->target[way];
+	r.taken = true;
+
+	// if this is a trace for a return...
+
+	if (r.code == 0x70) {
+
+		// pop the return address stack
+
+		unsigned int popd = pop_ras (d);
+
+		// if the return address stack prediction was
+		// correct...
+		if (ras_correct) {
+
+			// set the corresponding field of r
+
+			r.target = popd;
+
+			// and fix the target if need be
+
+			if (ras_offby2) r.target += 2;
+			else if (ras_offby3) r.target -= 3;
+		} else
+
+			// otherwise, we had a correct prediction
+			// but an incorrect return address prediction;
+			// flush the return address stack
+
+			init_ras (d);
+	}
+
+	// set the rest of the fields from the prediction
+
+	t.bi.address = r.address;
+	t.target = r.target;
+	t.taken = r.taken;
+
+	// update the predictor
+
+	update_remember (d, r, p, true, way);
+	return r.code;
+}
+
+// the rest of decoding a mispredicted trace into t, whose address and
+// target have been read and whose code is c
+
+static inline void decode_miss (trace_decoder *d, trace & t, remember_set *p, unsigned char c) {
+	remember r;
+
+	// assume the branch is taken; fix later
+
+	t.taken = true;
+
+	// prepare a remember struct for the predictor
+
+	r.address = t.bi.address;
+	r.target = t.target;
+	r.taken = t.taken;
+	r.code = c;
+
+	// if we have a return...
+	if (r.code == 0x70) {
+
+		// pop the return address stack
+
+		unsigned int popd = pop_ras (d);
+
+		// if we have a mispredicted return address,
+		// flush the return address stack.  why are we
+		// bothering about predicting when we know the
+		// prediction is incorrect?  because the original
+		// compressor maintains a return address stack 
+		// regardless of whether the trace is predicted
+		// correctly, so we have to also.
+
+		if (popd != t.target
+		 && popd != t.target - 2
+		 && popd != t.target + 3) init_ras (d);
+	}
+
+	// update the predictor
+
+	update_remember (d, r, p, false, -1);
+}
+
+// fill in the opcode and flags of a trace from its code and keep the
+// return address stack up to date
+
+static inline void decode_flags (trace_decoder *d, trace & t, unsigned char c) {
+
+	// get the conditional branch opcode, if any
+
+	t.bi.opcode = c & 15;
+
+	// br_flags gives information about the branch; initially empty
+
+	t.bi.br_flags = 0;
+
+	// get the high 4 bits of the code
+
+	c >>= 4;
+	switch (c) {
+	case 1: // taken conditional branch
+		t.bi.br_flags |= BR_CONDITIONAL;
+		break;
+	case 2: // not taken conditional branch
+		t.taken = false;
+		t.bi.br_flags |= BR_CONDITIONAL;
+		break;
+	case 3: // unconditional branch
+		break;
+	case 4: // indirect branch
+		t.bi.br_flags |= BR_INDIRECT;
+		break;
+	case 5: // call
+		t.bi.br_flags |= BR_CALL;
+		push_ras (d, t.bi.address + 5);
+		break;
+	case 6: // indirect call
+		t.bi.br_flags |= BR_CALL | BR_INDIRECT;
+		push_ras (d, t.bi.address + 2);
+		break;
+	case 7: // return
+		t.bi.br_flags |= BR_RETURN;
+		break;
+	// this should "never" happen
+	default: fprintf (stderr, "%d\n", c); fflush (stderr); assert (0);
+	}
+}
+
+// decode a single trace starting at q into t; return a pointer to the
+// byte after it
+
+static inline unsigned char *decode_trace (trace_decoder *d, trace & t, unsigned char *q) {
 	bool ras_correct, ras_offby2, ras_offby3, correct;
 
 	// read the next byte; it will either be a code, a set index for
 	// a correct prediction, or a prefix for patching a return address 
 	// prediction.
 
-	unsigned char c = read_byte ();
-	if (end_of_file) return NULL;
-	remember r;
+	unsigned char c = *q++;
 
 	// predict the next trace
 
-	remember *p = predict_remember ();
+	remember_set *p = predict_remember (d);
 
 	// assume return address prediction is correct
 
@@ -256,7 +662,7 @@ trace *read_trace (void) {
 		// read the next byte; it should be the set index for
 		// a correct return address prediction
 
-		c = read_byte ();
+		c = *q++;
 	}
 
 	// the byte is a correct prediction if it is less than 8;
@@ -274,188 +680,1623 @@ trace *read_trace (void) {
 
 		if (ras_correct) c -= ASSOC;
 
-		// at this point we have the predicted set in p
-		// and the index into the predicted set in c.
+		c = decode_hit (d, t, p, c, ras_correct, ras_offby2, ras_offby3);
+	} else {
 
-		r = p[c];
+		// the predictor was incorrect.  just read the trace from
+		// the input.  this happens rarely, often less than 1% of the
+		// time, but it has to happen sometime because this is where
+		// the actual information comes from
 
-		// if this is a trace for a return...
+		// read the branch address
 
-		if (r.code == 0x70) {
+		t.bi.address = get_uint (q);
 
-			// pop the return address stack
+		// read the branch target
 
-			unsigned int popd = pop_ras();
+		t.target = get_uint (q + 4);
+		q += 8;
 
-			// if the return address stack prediction was
-			// correct...
-			if (ras_correct) {
+		decode_miss (d, t, p, c);
+	}
+	decode_flags (d, t, c);
+	return q;
+}
 
-				// set the corresponding field of r
+// the state of reading a version 2 trace; see trace2.h
 
-				r.target = popd;
+struct trace2_pool;
 
-				// and fix the target if need be
+struct trace2_reader {
+	trace2_model model;
+	trace2_tables tables;
 
-				if (ras_offby2) r.target += 2;
-				else if (ras_offby3) r.target -= 3;
-			} else
+	// the bytes of the current chunk, with room for padding after them
 
-				// otherwise, we had a correct prediction
-				// but an incorrect return address prediction;
-				// flush the return address stack
+	unsigned char *chunk;
+	size_t chunk_size;
 
-				init_ras();
-		}
+	// the rANS state and where its next bytes come from, and where
+	// they end; and the same for the varints
 
-		// set the rest of the fields from the prediction
+	unsigned int x[2];
+	unsigned char *q, *q_end, *vq, *vq_end;
 
-		t.bi.address = r.address;
-		t.target = r.target;
-		t.taken = r.taken;
+	// number of traces left in the chunk
 
-		// update the predictor
+	unsigned int left;
 
-		update_remember (r, p, true, (int) c);
+	// for a file written in blocks, its directory, with nblocks + 1
+	// entries, and the threads decoding its blocks if there are any
 
-		// get the code into c for later use
+	trace2_block *blocks;
+	long long int nblocks;
+	trace2_pool *pool;
+};
 
-		c = r.code;
-	} else {
+// more than the bytes decoding a trace or a table can read past the end
+// of a chunk
 
-		// the predictor was incorrect.  just read the trace from
-		// the input.  this happens rarely, often less than 1% of the
-		// time, but it has to happen sometime because this is where
-		// the actual information comes from
+#define TRACE2_PAD	(TRACE2_MAX_BYTES * 2)
 
-		// read the branch address
+// the most bytes a chunk can have
 
-		t.bi.address = read_uint ();
+#define TRACE2_CHUNK_BYTES	(TRACE2_CONTEXTS * 769 + 10 + (size_t) TRACE2_CHUNK * TRACE2_MAX_BYTES + 4)
 
-		// read the branch target
+struct trace_index;
+static void free_index (trace_index *);
 
-		t.target = read_uint ();
+// everything needed to read one trace file
 
-		// assume the branch is taken; fix later
+struct trace_reader {
+	trace_input in;
+	trace_decoder dec;
 
-		t.taken = true;
+	// number of traces read so far
 
-		// prepare a remember struct for the predictor
+	long long int ntraces;
 
-		r.address = t.bi.address;
-		r.target = t.target;
-		r.taken = t.taken;
-		r.code = c;
+	// the index of the trace file, loaded by the first seek_trace;
+	// index_loaded is true once it has been tried
 
-		// if we have a return...
-		if (r.code == 0x70) {
+	trace_index *index;
+	bool index_loaded;
 
-			// pop the return address stack
+	// for a version 2 trace, the state of reading it; NULL otherwise
 
-			unsigned int popd = pop_ras ();
+	trace2_reader *v2;
+};
 
-			// if we have a mispredicted return address,
-			// flush the return address stack.  why are we
-			// bothering about predicting when we know the
-			// prediction is incorrect?  because the original
-			// compressor maintains a return address stack 
-			// regardless of whether the trace is predicted
-			// correctly, so we have to also.
+// start decoding a version 2 trace over from nothing
 
-			if (popd != t.target
-			 && popd != t.target - 2
-			 && popd != t.target + 3) init_ras();
+static void reset_v2 (trace_decoder *d, trace2_reader *v) {
+	for (int i=0; i<N_REMEMBER; i++) d->rtab[i] = remember_set ();
+	init_ras (d);
+	d->lru_started = false;
+	d->last_target = 0;
+	init_model (&v->model);
+	v->left = 0;
+}
+
+// check the header of a chunk and make room for its bytes
+
+static void check_chunk (trace2_reader *v, trace2_chunk *h, char *name) {
+	size_t size = h->bytes;
+	if (h->ntraces == 0 || h->ntraces > TRACE2_CHUNK || size < 4 || size > TRACE2_CHUNK_BYTES
+	 || (h->flags & ~TRACE2_RESET)) {
+		fprintf (stderr, "%s: bad chunk\n", name);
+		exit (1);
+	}
+	if (size + TRACE2_PAD > v->chunk_size) {
+		v->chunk_size = size + TRACE2_PAD;
+		v->chunk = (unsigned char *) realloc (v->chunk, v->chunk_size);
+	}
+}
+
+// start decoding a chunk whose bytes have been put in v->chunk
+
+static void start_chunk (trace2_reader *v, trace_decoder *d, trace2_chunk *h, char *name) {
+	if (h->flags & TRACE2_RESET) reset_v2 (d, v);
+	unsigned char *end = v->chunk + h->bytes;
+	memset (end, 0, TRACE2_PAD);
+	unsigned char *p = read_tables (&v->tables, v->chunk, end);
+	int nvarints = -1;
+	if (p) p = get_varint (p, &nvarints);
+	if (!p || nvarints < 0 || p + nvarints + 8 > end) {
+		fprintf (stderr, "%s: bad chunk\n", name);
+		exit (1);
+	}
+	v->vq = p;
+	v->vq_end = v->q = p + nvarints;
+	v->x[0] = rans_init (&v->q);
+	v->x[1] = rans_init (&v->q);
+	v->q_end = end;
+	v->left = h->ntraces;
+}
+
+// read exactly n bytes of a version 2 trace into dst; return false if
+// the file ends first
+
+static bool read_v2 (trace_input *in, unsigned char *dst, size_t n) {
+	while (n) {
+		unsigned int m = fill_buffer (in, dst, n < BUFSIZE ? n : BUFSIZE);
+		if (m == 0) return false;
+		in->offset += m;
+		dst += m;
+		n -= m;
+	}
+	return true;
+}
+
+// read the next chunk of a version 2 trace; return false at the end of
+// the file or its directory
+
+static bool next_chunk (trace_reader *tr) {
+	trace_input *in = &tr->in;
+	trace2_reader *v = tr->v2;
+	trace2_chunk h;
+	long long int start = in->offset;
+	if (!read_v2 (in, (unsigned char *) &h, sizeof (h))) {
+		if (in->offset != start) {
+			fprintf (stderr, "%s: truncated trace\n", in->name);
+			exit (1);
 		}
+		return false;
+	}
+	if (h.flags == TRACE2_DIRECTORY) {
 
-		// update the predictor
+		// the rest of the file is the directory
 
-		update_remember (r, p, false, -1);
+		in->inavail = 0;
+		in->end_of_input = true;
+		return false;
+	}
+	check_chunk (v, &h, in->name);
+	if (!read_v2 (in, v->chunk, h.bytes)) {
+		fprintf (stderr, "%s: truncated trace\n", in->name);
+		exit (1);
 	}
+	start_chunk (v, &tr->dec, &h, in->name);
+	return true;
+}
 
-	// get the conditional branch opcode, if any
+// decode n traces from the current chunk, which must have that many left
+
+static void decode_v2 (trace2_reader *v, trace_decoder *d, trace *out, size_t n, char *name) {
+
+	// the two rANS states take turns, the one for the next symbol in x;
+	// they and the stream are kept in locals so they can stay in
+	// registers
+
+	int turn = (v->left - 1) & 1;
+	unsigned int x = v->x[turn], y = v->x[!turn];
+	unsigned char *q = v->q;
+	v->left -= n;
+	for (size_t i=0; i<n; i++) {
+		trace & t = out[i];
+		remember_set *p = predict_remember (d);
+		int sym = decode_symbol (&v->model, &v->tables, &p->v2_last, &x, &q);
+		unsigned int z = x;
+		x = y;
+		y = z;
+		if (sym >= TRACE2_SYMBOLS) {
+			fprintf (stderr, "%s: bad chunk\n", name);
+			exit (1);
+		}
+		unsigned char c;
+		if (sym < TRACE2_MISS) {
+
+			// a hit gives the rank of the way in the LRU order
+
+			int way = (p->lru >> 4 * (sym & 7)) & 15;
+			c = decode_hit (d, t, p, way, sym & 8, sym >> 4 == 1, sym >> 4 == 2);
+		} else {
+			unsigned int set = d->last_target & (N_REMEMBER-1);
+			if (sym >= TRACE2_VICTIM) 
+				take_victim (&v->model, set, sym - TRACE2_VICTIM, &c, &t.bi.address, &t.target);
+			else {
+				int da, dt;
+				c = sym - TRACE2_MISS + 0x10;
+				v->vq = get_varint (v->vq, &da);
+				v->vq = get_varint (v->vq, &dt);
+				t.bi.address = d->last_target + da;
+				t.target = t.bi.address + dt;
+			}
+
+			// the way about to be replaced becomes a victim
+
+			int lru = p->lru >> 28;
+			add_victim (&v->model, set, p->code[lru], p->address[lru], p->target[lru]);
+			decode_miss (d, t, p, c);
+		}
+		if (q > v->q_end || v->vq > v->vq_end) {
+			fprintf (stderr, "%s: bad chunk\n", name);
+			exit (1);
+		}
+		decode_flags (d, t, c);
+	}
+	turn = (v->left - 1) & 1;
+	v->x[turn] = x;
+	v->x[!turn] = y;
+	v->q = q;
+}
 
-	t.bi.opcode = c & 15;
+// read the directory of a version 2 trace written in blocks, if it has
+// one.  it's trusted only if it fits the file exactly and its blocks are
+// in order.
+
+static void load_directory (trace_input *in, trace2_reader *v) {
+	int fd = fileno (in->fp);
+	struct stat st;
+	long long int where;
+	trace2_chunk h;
+	v->blocks = NULL;
+	v->nblocks = 0;
+	if (fstat (fd, &st) < 0 || st.st_size < 4 + (long long int) (sizeof (h) + sizeof (where))
+	 || pread (fd, &where, sizeof (where), st.st_size - sizeof (where)) != sizeof (where)
+	 || where < 4 || where > st.st_size 
+	 || pread (fd, &h, sizeof (h), where) != sizeof (h)
+	 || h.flags != TRACE2_DIRECTORY
+	 || h.bytes != (h.ntraces + 1ULL) * sizeof (trace2_block)
+	 || where + sizeof (h) + h.bytes + sizeof (where) != (unsigned long long int) st.st_size) return;
+	trace2_block *b = (trace2_block *) malloc (h.bytes);
+	bool ok = pread (fd, b, h.bytes, where + sizeof (h)) == h.bytes 
+		&& b[0].offset == 4 && b[0].first == 0 && b[h.ntraces].offset == where;
+	for (unsigned int i=0; ok && i<h.ntraces; i++) 
+		ok = b[i].offset < b[i+1].offset && b[i].first < b[i+1].first;
+	if (!ok) {
+		free (b);
+		return;
+	}
+	v->blocks = b;
+	v->nblocks = h.ntraces;
+}
 
-	// br_flags gives information about the branch; initially empty
+// decoding the blocks of a version 2 trace in parallel.  each worker
+// thread takes the next block and decodes all of it with a decoder of its
+// own into the slot for the block; the reader takes the traces from the
+// slots in order and frees each slot for the block nslots later once it
+// has read it.
 
-	t.bi.br_flags = 0;
+static int v2_threads = -1;
 
-	// get the high 4 bits of the code
+struct trace2_slot {
+	trace *traces;
+	size_t ntraces, max;
+	bool ready;
+};
 
-	c >>= 4;
-	switch (c) {
-	case 1: // taken conditional branch
-		t.bi.br_flags |= BR_CONDITIONAL;
-		break;
-	case 2: // not taken conditional branch
-		t.taken = false;
-		t.bi.br_flags |= BR_CONDITIONAL;
-		break;
-	case 3: // unconditional branch
-		break;
-	case 4: // indirect branch
-		t.bi.br_flags |= BR_INDIRECT;
-		break;
-	case 5: // call
-		t.bi.br_flags |= BR_CALL;
-		push_ras (t.bi.address + 5);
-		break;
-	case 6: // indirect call
-		t.bi.br_flags |= BR_CALL | BR_INDIRECT;
-		push_ras (t.bi.address + 2);
-		break;
-	case 7: // return
-		t.bi.br_flags |= BR_RETURN;
-		break;
-	// this should "never" happen
-	default: fprintf (stderr, "%d\n", c); fflush (stderr); assert (0);
+struct trace2_pool {
+	trace_reader *tr;
+	int nthreads, nslots;
+	pthread_t *threads;
+	trace2_slot *slots;
+
+	// the next block for a worker, the block being read and where in
+	// it the reader is
+
+	long long int next, current;
+	size_t pos;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+};
+
+// decode a whole block into a slot
+
+static void decode_block (trace_reader *tr, trace2_reader *v, trace_decoder *d, long long int b,
+	trace2_slot *s) {
+	trace2_block *blk = &tr->v2->blocks[b];
+	size_t size = blk[1].offset - blk[0].offset, ntraces = blk[1].first - blk[0].first;
+	unsigned char *bytes = (unsigned char *) malloc (size), *p = bytes;
+	if (pread (fileno (tr->in.fp), bytes, size, blk->offset) != (ssize_t) size) {
+		fprintf (stderr, "%s: truncated trace\n", tr->in.name);
+		exit (1);
+	}
+	if (s->max < ntraces) {
+		delete[] s->traces;
+		s->traces = new trace[ntraces];
+		s->max = ntraces;
+	}
+	size_t n = 0;
+	while (p < bytes + size) {
+		trace2_chunk h;
+		if (p + sizeof (h) > bytes + size) break;
+		memcpy (&h, p, sizeof (h));
+		p += sizeof (h);
+		check_chunk (v, &h, tr->in.name);
+
+		// each block has to start over
+
+		if ((p == bytes + sizeof (h)) != !!(h.flags & TRACE2_RESET) 
+		 || p + h.bytes > bytes + size || n + h.ntraces > ntraces) break;
+		memcpy (v->chunk, p, h.bytes);
+		p += h.bytes;
+		start_chunk (v, d, &h, tr->in.name);
+		decode_v2 (v, d, s->traces + n, h.ntraces, tr->in.name);
+		n += h.ntraces;
 	}
-	return & t;
+	if (p != bytes + size || n != ntraces) {
+		fprintf (stderr, "%s: bad block\n", tr->in.name);
+		exit (1);
+	}
+	s->ntraces = n;
+	free (bytes);
 }
 
-// open the trace file for reading
+static void *block_worker (void *arg) {
+	trace2_pool *pool = (trace2_pool *) arg;
+	trace2_reader *v = (trace2_reader *) malloc (sizeof (trace2_reader));
+	trace_decoder *d = new trace_decoder;
+	v->chunk = NULL;
+	v->chunk_size = 0;
+	for (;;) {
+		pthread_mutex_lock (&pool->lock);
+		while (!pool->stop && (pool->next == pool->tr->v2->nblocks 
+		 || pool->next == pool->current + pool->nslots)) 
+			pthread_cond_wait (&pool->changed, &pool->lock);
+		if (pool->stop) {
+			pthread_mutex_unlock (&pool->lock);
+			break;
+		}
+		long long int b = pool->next++;
+		pthread_mutex_unlock (&pool->lock);
+		trace2_slot *s = &pool->slots[b % pool->nslots];
+		decode_block (pool->tr, v, d, b, s);
+		pthread_mutex_lock (&pool->lock);
+		s->ready = true;
+		pthread_cond_broadcast (&pool->changed);
+		pthread_mutex_unlock (&pool->lock);
+	}
+	free (v->chunk);
+	free (v);
+	delete d;
+	return NULL;
+}
+
+// start decoding the blocks of a trace from block b with the threads
+
+static void start_pool (trace_reader *tr, long long int b) {
+	trace2_pool *pool = new trace2_pool;
+	pool->tr = tr;
+	pool->nthreads = v2_threads;
+	pool->nslots = v2_threads + 1;
+	pool->slots = new trace2_slot[pool->nslots];
+	for (int i=0; i<pool->nslots; i++) {
+		pool->slots[i].traces = NULL;
+		pool->slots[i].max = 0;
+		pool->slots[i].ready = false;
+	}
+	pool->next = b;
+	pool->current = b;
+	pool->pos = 0;
+	pool->stop = false;
+	pthread_mutex_init (&pool->lock, NULL);
+	pthread_cond_init (&pool->changed, NULL);
+	pool->threads = new pthread_t[pool->nthreads];
+	for (int i=0; i<pool->nthreads; i++) pthread_create (&pool->threads[i], NULL, block_worker, pool);
+	tr->v2->pool = pool;
+}
+
+static void stop_pool (trace_reader *tr) {
+	trace2_pool *pool = tr->v2->pool;
+	if (!pool) return;
+	pthread_mutex_lock (&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast (&pool->changed);
+	pthread_mutex_unlock (&pool->lock);
+	for (int i=0; i<pool->nthreads; i++) pthread_join (pool->threads[i], NULL);
+	for (int i=0; i<pool->nslots; i++) delete[] pool->slots[i].traces;
+	delete[] pool->slots;
+	delete[] pool->threads;
+	pthread_mutex_destroy (&pool->lock);
+	pthread_cond_destroy (&pool->changed);
+	delete pool;
+	tr->v2->pool = NULL;
+}
+
+// read up to n traces from the blocks decoded by the threads
+
+static size_t read_pool (trace_reader *tr, trace *out, size_t n) {
+	trace2_pool *pool = tr->v2->pool;
+	size_t i = 0;
+	while (i < n && pool->current < tr->v2->nblocks) {
+		trace2_slot *s = &pool->slots[pool->current % pool->nslots];
+		pthread_mutex_lock (&pool->lock);
+		while (!s->ready) pthread_cond_wait (&pool->changed, &pool->lock);
+		pthread_mutex_unlock (&pool->lock);
+		size_t m = n - i < s->ntraces - pool->pos ? n - i : s->ntraces - pool->pos;
+		memcpy (out + i, s->traces + pool->pos, m * sizeof (trace));
+		i += m;
+		pool->pos += m;
+		if (pool->pos == s->ntraces) {
+			pthread_mutex_lock (&pool->lock);
+			s->ready = false;
+			pool->current++;
+			pool->pos = 0;
+			pthread_cond_broadcast (&pool->changed);
+			pthread_mutex_unlock (&pool->lock);
+		}
+	}
+	tr->ntraces += i;
+	return i;
+}
+
+// set the number of threads decoding a version 2 trace written in blocks;
+// 1 decodes it in the thread reading it
+
+void trace_threads (int n) {
+	v2_threads = n < 1 ? 1 : n;
+}
+
+// the number of threads set by trace_threads, or else from the
+// TRACE_THREADS environment variable, or else one per processor up to
+// TRACE2_THREADS.  decoding in parallel holds nthreads+1 whole blocks in
+// memory, so more threads than this have to be asked for.
+
+#define TRACE2_THREADS	2
+
+static int block_threads (void) {
+	if (v2_threads < 0) {
+		char *s = getenv ("TRACE_THREADS");
+		int n = s ? atoi (s) : sysconf (_SC_NPROCESSORS_ONLN);
+		if (!s && n > TRACE2_THREADS) n = TRACE2_THREADS;
+		v2_threads = n < 1 ? 1 : n;
+	}
+	return v2_threads;
+}
+
+// the block of a version 2 trace holding trace number record
+
+static long long int find_block (trace2_reader *v, long long int record) {
+	long long int lo = 0, hi = v->nblocks - 1;
+	while (lo < hi) {
+		long long int mid = (lo + hi + 1) / 2;
+		if (v->blocks[mid].first <= record) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+// read up to n traces from a version 2 trace; see read_traces.  a trace
+// written in blocks is handed to threads whenever reading gets to the
+// start of a block.
+
+static size_t read_traces_v2 (trace_reader *tr, trace *out, size_t n) {
+	trace2_reader *v = tr->v2;
+	if (!v->pool && v->nblocks && !v->left && block_threads () > 1) {
+		long long int b = find_block (v, tr->ntraces);
+		if (v->blocks[b].first == tr->ntraces && b < v->nblocks) start_pool (tr, b);
+	}
+	if (v->pool) return read_pool (tr, out, n);
+	size_t i = 0;
+	while (i < n && (v->left || next_chunk (tr))) {
+		size_t m = n - i < v->left ? n - i : v->left;
+		decode_v2 (v, &tr->dec, out + i, m, tr->in.name);
+		i += m;
+	}
+	tr->ntraces += i;
+	return i;
+}
+
+// read up to n traces from a trace file into out; return the number read,
+// which is 0 at the end of the file
+
+size_t read_traces (trace_reader *tr, trace *out, size_t n) {
+	if (tr->v2) return read_traces_v2 (tr, out, n);
+	trace_input *in = &tr->in;
+	size_t i = 0;
+	while (i < n && fill_trace (in)) {
+
+		// decode every trace that is sure to be whole in the buffer
+		// before checking the buffer again
+
+		unsigned char *q = in->buf + in->bufpos, *end = in->buf + in->bufsize;
+		if (!in->end_of_file) end -= MAX_TRACE_BYTES - 1;
+		while (i < n && q < end) q = decode_trace (&tr->dec, out[i++], q);
+		in->bufpos = q - in->buf;
+	}
+	tr->ntraces += i;
+	return i;
+}
+
+// open a trace file for reading
 
 #define GZIP_MAGIC     "\037\213"
 #define BZIP2_MAGIC	"BZ"
 
+// TRACE2_MAGIC, for version 2 traces, is in trace2.h
+
+static void open_input (trace_input *in, char *fname) {
+	in->name = fname;
+	in->fp = fopen (fname, "rb");
+	if (!in->fp) {
+		perror (fname);
+		exit (1);
+	}
+	in->end_of_input = false;
+	in->blocks = NULL;
+	in->block_stream = NULL;
+	in->block_size = 0;
+	in->block_pos = 0;
+
+	// read the first chunk of the file and figure out the compression
+	// method from the magic number
+
+	in->inavail = fill_input (in);
+	in->innext = in->inbuf;
+	if (in->inavail >= 2 && memcmp (in->innext, GZIP_MAGIC, 2) == 0) {
+		in->format = trace_input::GZIP;
+		memset (&in->zs, 0, sizeof (in->zs));
+
+		// 15+32 lets zlib parse the gzip header itself
+
+		if (inflateInit2 (&in->zs, 15+32) != Z_OK) {
+			fprintf (stderr, "%s: can't initialize zlib\n", fname);
+			exit (1);
+		}
+		in->zs.next_in = in->innext;
+		in->zs.avail_in = in->inavail;
+	} else if (in->inavail >= 2 && memcmp (in->innext, BZIP2_MAGIC, 2) == 0) {
+		in->format = trace_input::BZIP2;
+		memset (&in->bzs, 0, sizeof (in->bzs));
+		if (BZ2_bzDecompressInit (&in->bzs, 0, 0) != BZ_OK) {
+			fprintf (stderr, "%s: can't initialize libbz2\n", fname);
+			exit (1);
+		}
+		in->bzs.next_in = (char *) in->innext;
+		in->bzs.avail_in = in->inavail;
+	} else if (in->inavail >= 4 && memcmp (in->innext, TRACE2_MAGIC, 4) == 0) {
+		in->format = trace_input::V2;
+		in->innext += 4;
+		in->inavail -= 4;
+	} else
+		in->format = trace_input::RAW;
+	in->bufpos = 0;
+	in->bufsize = 0;
+	in->offset = 0;
+	in->end_of_file = false;
+}
+
+// close a trace file
+
+static void close_input (trace_input *in) {
+	if (in->format == trace_input::CALLBACK) return;
+	free (in->block_stream);
+	if (in->format == trace_input::GZIP) inflateEnd (&in->zs);
+	else if (in->format == trace_input::BZIP2) BZ2_bzDecompressEnd (&in->bzs);
+	fclose (in->fp);
+}
+
+// open a trace file and start a fresh decoder for it.  any number of
+// trace files can be open at once, e.g. one per thread.
+
+trace_reader *open_trace (char *fname) {
+	trace_reader *tr = new trace_reader;
+	open_input (&tr->in, fname);
+	init_ras (&tr->dec);
+	tr->dec.lru_started = false;
+	tr->dec.last_target = 0;
+	tr->ntraces = 0;
+	tr->index = NULL;
+	tr->index_loaded = false;
+	tr->v2 = NULL;
+	if (tr->in.format == trace_input::V2) {
+		tr->v2 = (trace2_reader *) malloc (sizeof (trace2_reader));
+		init_model (&tr->v2->model);
+		tr->v2->chunk = NULL;
+		tr->v2->chunk_size = 0;
+		tr->v2->left = 0;
+		tr->v2->pool = NULL;
+		load_directory (&tr->in, tr->v2);
+	}
+	return tr;
+}
+
+// start a decoder whose decompressed bytes come from calling source
+// rather than from a file.  source should copy up to size bytes into
+// its buffer argument and return how many it copied, or 0 at the end.
+// this lets the decompression and decoding run in different threads.
+
+trace_reader *open_trace_decoder (size_t (*source) (void *, unsigned char *, size_t), void *arg) {
+	trace_reader *tr = new trace_reader;
+	trace_input *in = &tr->in;
+	in->format = trace_input::CALLBACK;
+	in->source = source;
+	in->source_arg = arg;
+	in->name = (char *) "(decoder)";
+	in->fp = NULL;
+	in->end_of_input = false;
+	in->blocks = NULL;
+	in->block_stream = NULL;
+	in->block_size = 0;
+	in->block_pos = 0;
+	in->inavail = 0;
+	in->bufpos = 0;
+	in->bufsize = 0;
+	in->offset = 0;
+	in->end_of_file = false;
+	init_ras (&tr->dec);
+	tr->dec.lru_started = false;
+	tr->dec.last_target = 0;
+	tr->ntraces = 0;
+	tr->index = NULL;
+	tr->index_loaded = false;
+	tr->v2 = NULL;
+	return tr;
+}
+
+// read up to n decompressed bytes of a trace file into dst without
+// decoding them; return the number read, which is 0 at the end of the
+// file.  a trace_reader should be used either for this or for
+// read_traces, not both.  a version 2 trace has no such bytes.
+
+size_t read_trace_bytes (trace_reader *tr, unsigned char *dst, size_t n) {
+	if (tr->v2) {
+		fprintf (stderr, "%s: a version 2 trace can only be read a trace at a time\n", tr->in.name);
+		exit (1);
+	}
+	return fill_buffer (&tr->in, dst, n);
+}
+
+// the number of instructions a trace file represents
+
+static long long int file_instructions = TRACE_INSTRUCTIONS;
+
+void trace_instructions (long long int n) {
+	file_instructions = n;
+}
+
+long long int trace_file_instructions (void) {
+	return file_instructions;
+}
+
+// the version of the format of a trace file
+
+int trace_version (trace_reader *tr) {
+	return tr->v2 ? 2 : 1;
+}
+
+// write the state of a trace_reader to f: the offset in the decompressed
+// bytes of the next trace and the state of the decoder.  a version 2
+// trace has no such offset and gets -1.  return false if it can't be
+// written.
+
+bool save_trace (trace_reader *tr, FILE *f) {
+	long long int pos = tr->v2 ? -1 : tr->in.offset + tr->in.bufpos;
+	return fwrite (&pos, sizeof (pos), 1, f) == 1
+		&& fwrite (&tr->ntraces, sizeof (tr->ntraces), 1, f) == 1
+		&& fwrite (&tr->dec, sizeof (trace_decoder), 1, f) == 1;
+}
+
+// skip decompressed bytes up to offset pos without decoding them; return
+// false if the file ends first
+
+static bool skip_input (trace_input *in, long long int pos) {
+	while (in->offset < pos) {
+		unsigned int size = pos - in->offset < BUFSIZE ? pos - in->offset : BUFSIZE;
+		unsigned int n = fill_buffer (in, in->buf, size);
+		if (n == 0) return false;
+		in->offset += n;
+	}
+	return true;
+}
+
+// restore the state written by save_trace to a trace_reader that has
+// just been opened on the same trace file.  the bytes before the saved
+// offset still have to be decompressed, but they aren't decoded.  a
+// version 2 trace is decoded up to the saved trace instead.  return false
+// if the state can't be read.
+
+bool restore_trace (trace_reader *tr, FILE *f) {
+	long long int pos, ntraces;
+	if (fread (&pos, sizeof (pos), 1, f) != 1
+	 || fread (&ntraces, sizeof (ntraces), 1, f) != 1) return false;
+	if (pos < 0) {
+		if (!tr->v2 || fseeko (f, sizeof (trace_decoder), SEEK_CUR) < 0) return false;
+		return seek_trace (tr, ntraces) == ntraces;
+	}
+	tr->ntraces = ntraces;
+	return fread (&tr->dec, sizeof (trace_decoder), 1, f) == 1 && skip_input (&tr->in, pos);
+}
+
+// close a trace file opened with open_trace
+
+void close_trace (trace_reader *tr) {
+	close_input (&tr->in);
+	free_index (tr->index);
+	if (tr->v2) {
+		stop_pool (tr);
+		free (tr->v2->chunk);
+		free (tr->v2->blocks);
+	}
+	free (tr->v2);
+	delete tr;
+}
+
+// the trace file read by init_trace, read_trace, and end_trace
+
+static trace_reader *the_trace;
+
+// open the trace file for reading
+
 void init_trace (char *fname) {
-	char *dc;
-	char s[2] = { 0, 0 };
-	char cmd[1000];
+	the_trace = open_trace (fname);
+}
+
+// read up to n traces from the file into out
+
+size_t read_traces (trace *out, size_t n) {
+	return read_traces (the_trace, out, n);
+}
+
+// read a single trace from the file
+
+trace *read_trace (void) {
+	static trace t;
+	return read_traces (the_trace, &t, 1) ? &t : NULL;
+}
 
-	// figure out the compression method from the magic number
+// close the trace file
 
-	FILE *f = fopen (fname, "r");
+void end_trace (void) {
+	close_trace (the_trace);
+	the_trace = NULL;
+}
+
+// A trace cache is a file holding a trace that has already been decompressed
+// and decoded, so that later runs can map it into memory and go straight
+// to predicting.  The file starts with a 64-byte trace_cache_header and is
+// followed by 16-byte cached_trace records, four to a cache line.  Cache
+// files live in the directory named by the TRACE_CACHE_DIR environment
+// variable and are rebuilt whenever the size, modification time or inode
+// of the trace file they came from changes.
+//
+// With trace_shared (true), a trace is instead decoded into shared memory,
+// a file of the same format in /dev/shm, that is removed when the last run
+// using it is done.  Many runs on the same trace at once then decode it
+// only once between them and share one copy of the decoded traces in
+// memory, with none of them decompressing or keeping a decoder.  Each run
+// using it holds a shared flock on it as its reference, and the one that
+// finds it can take an exclusive lock when it is done is the last and
+// removes it.  Making, attaching to and detaching from it are done under an
+// exclusive flock on a lock file next to it, removed along with it.  The
+// locks go away with a run that dies, so what it was using is removed by
+// the next run on the same trace to finish, or left in /dev/shm if there
+// isn't one.  A run that dies while decoding it leaves a temporary file,
+// which the next run to attach removes.
+
+#define CACHE_MAGIC	"BPTCACHE"
+#define CACHE_VERSION	1
+
+struct trace_cache_header {
+	char magic[8];
+	unsigned int version, record_size;
+	long long int ntraces, ninstructions;
+
+	// identify the trace file this cache was made from
+
+	long long int src_size, src_mtime_sec, src_mtime_nsec, src_ino;
+};
+
+// fill in the fields of a cache header that identify the source trace
+
+static void cache_header_init (trace_cache_header *h, struct stat *st) {
+	memset (h, 0, sizeof (trace_cache_header));
+	memcpy (h->magic, CACHE_MAGIC, 8);
+	h->version = CACHE_VERSION;
+	h->record_size = sizeof (cached_trace);
+	h->ninstructions = TRACE_INSTRUCTIONS;
+	h->src_size = st->st_size;
+	h->src_mtime_sec = st->st_mtim.tv_sec;
+	h->src_mtime_nsec = st->st_mtim.tv_nsec;
+	h->src_ino = st->st_ino;
+}
+
+// make the name of the cache file for a trace.  the name has the base name
+// of the trace for people and a hash of its full path so that traces with
+// the same name in different directories don't keep evicting each other.
+
+static void cache_name (char *fname, const char *dir, char *name, size_t n) {
+	char path[PATH_MAX];
+	if (!realpath (fname, path)) {
+		strncpy (path, fname, PATH_MAX-1);
+		path[PATH_MAX-1] = 0;
+	}
+
+	// 64-bit FNV-1a hash of the path
+
+	unsigned long long int hash = 14695981039346656037ULL;
+	for (char *p=path; *p; p++) {
+		hash ^= (unsigned char) *p;
+		hash *= 1099511628211ULL;
+	}
+	const char *base = strrchr (path, '/');
+	base = base ? base + 1 : path;
+	snprintf (name, n, "%s/%s.%016llx.cache", dir, base, hash);
+}
+
+// map an existing cache file; return false if it is missing or stale
+
+static bool map_cache (char *name, trace_cache_header *want, trace_map *m) {
+	int fd = open (name, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (trace_cache_header)) {
+		close (fd);
+		return false;
+	}
+	void *base = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (base == MAP_FAILED) return false;
+	trace_cache_header *h = (trace_cache_header *) base;
+	if (memcmp (h->magic, want->magic, 8)
+	 || h->version != want->version
+	 || h->record_size != want->record_size
+	 || h->src_size != want->src_size
+	 || h->src_mtime_sec != want->src_mtime_sec
+	 || h->src_mtime_nsec != want->src_mtime_nsec
+	 || h->src_ino != want->src_ino
+	 || st.st_size != (off_t) (sizeof (trace_cache_header) 
+		+ h->ntraces * sizeof (cached_trace))) {
+		munmap (base, st.st_size);
+		return false;
+	}
+	madvise (base, st.st_size, MADV_SEQUENTIAL);
+	m->shared_fd = -1;
+	m->shared_name = NULL;
+	m->base = base;
+	m->length = st.st_size;
+	m->traces = (cached_trace *) (h + 1);
+	m->ntraces = h->ntraces;
+	m->ninstructions = file_instructions;
+	return true;
+}
+
+// decode a trace into a new cache file.  the file is written under a
+// temporary name and renamed into place so that concurrent runs never
+// see a partial cache.
+
+static bool build_cache (char *fname, char *name, trace_cache_header *h) {
+	char tmp[PATH_MAX+96];
+	snprintf (tmp, sizeof (tmp), "%s.tmp.%d", name, (int) getpid ());
+	FILE *f = fopen (tmp, "wb");
 	if (!f) {
+		perror (tmp);
+		return false;
+	}
+
+	// the header is written again at the end once we know the count
+
+	fwrite (h, sizeof (trace_cache_header), 1, f);
+	trace_reader *tr = open_trace (fname);
+	trace *t = new trace[TRACE_BATCH];
+	cached_trace *c = new cached_trace[TRACE_BATCH];
+	memset (c, 0, TRACE_BATCH * sizeof (cached_trace));
+	for (;;) {
+		size_t n = read_traces (tr, t, TRACE_BATCH);
+		if (!n) break;
+		for (size_t i=0; i<n; i++) {
+			c[i].address = t[i].bi.address;
+			c[i].target = t[i].target;
+			c[i].opcode = t[i].bi.opcode;
+			c[i].br_flags = t[i].bi.br_flags;
+			c[i].taken = t[i].taken;
+		}
+		fwrite (c, sizeof (cached_trace), n, f);
+		h->ntraces += n;
+	}
+	close_trace (tr);
+	delete[] t;
+	delete[] c;
+	rewind (f);
+	fwrite (h, sizeof (trace_cache_header), 1, f);
+	if (fclose (f) != 0 || rename (tmp, name) != 0) {
+		perror (tmp);
+		unlink (tmp);
+		return false;
+	}
+	return true;
+}
+
+// where shared traces go
+
+#define SHARED_DIR	"/dev/shm"
+
+static bool shared_traces;
+
+void trace_shared (bool b) {
+	shared_traces = b;
+}
+
+// lock the lock file of a shared trace, making sure it is the one in the
+// directory and not one just removed by the last run detaching; return its
+// descriptor, or -1 if it can't be locked
+
+static int lock_shared (char *name) {
+	for (;;) {
+		int fd = open (name, O_RDWR | O_CREAT, 0666);
+		if (fd < 0) {
+			perror (name);
+			return -1;
+		}
+		if (flock (fd, LOCK_EX) < 0) {
+			perror (name);
+			close (fd);
+			return -1;
+		}
+		struct stat a, b;
+		if (fstat (fd, &a) == 0 && stat (name, &b) == 0 
+		 && a.st_dev == b.st_dev && a.st_ino == b.st_ino) return fd;
+		close (fd);
+	}
+}
+
+// remove the temporary files left in dir by runs that died while decoding
+// the trace cached in name, that is name.tmp.<pid> for a pid that is gone.
+// only a run holding the lock decodes a shared trace, but a cache in the
+// same directory is decoded without it, so the pid has to be checked.
+
+static void remove_stale (const char *dir, char *name) {
+	const char *base = strrchr (name, '/') + 1;
+	size_t n = strlen (base);
+	DIR *d = opendir (dir);
+	if (!d) return;
+	struct dirent *e;
+	while ((e = readdir (d))) {
+		if (strncmp (e->d_name, base, n) || strncmp (e->d_name + n, ".tmp.", 5)) continue;
+		char *end;
+		long pid = strtol (e->d_name + n + 5, &end, 10);
+		if (*end || pid <= 0 || pid == getpid () || kill (pid, 0) == 0 || errno != ESRCH) continue;
+		char path[PATH_MAX+96];
+		snprintf (path, sizeof (path), "%s/%s", dir, e->d_name);
+		unlink (path);
+	}
+	closedir (d);
+}
+
+// attach to the shared copy of a trace, decoding it first if no other run
+// has
+
+static bool map_shared (char *fname, trace_cache_header *h, trace_map *m) {
+	char name[PATH_MAX+64], lock[PATH_MAX+72];
+	cache_name (fname, SHARED_DIR, name, sizeof (name));
+	snprintf (lock, sizeof (lock), "%s.lock", name);
+	int lfd = lock_shared (lock);
+	if (lfd < 0) return false;
+	remove_stale (SHARED_DIR, name);
+	bool ok = map_cache (name, h, m) || (build_cache (fname, name, h) && map_cache (name, h, m));
+	if (ok) {
+
+		// take a reference; nobody can hold an exclusive lock on it
+		// without the lock file, so this doesn't wait
+
+		int fd = open (name, O_RDONLY);
+		if (fd < 0 || flock (fd, LOCK_SH) < 0) {
+			perror (name);
+			if (fd >= 0) close (fd);
+			munmap (m->base, m->length);
+			ok = false;
+		} else {
+			m->shared_fd = fd;
+			m->shared_name = strdup (name);
+		}
+	}
+	close (lfd);
+	return ok;
+}
+
+// let go of a shared trace, removing it if this was the last run using it
+
+static void unmap_shared (trace_map *m) {
+	char lock[PATH_MAX+72];
+	snprintf (lock, sizeof (lock), "%s.lock", m->shared_name);
+	int lfd = lock_shared (lock);
+	if (lfd >= 0 && flock (m->shared_fd, LOCK_EX | LOCK_NB) == 0) {
+
+		// make sure it hasn't been replaced by a newer copy that
+		// others are using
+
+		struct stat a, b;
+		if (fstat (m->shared_fd, &a) == 0 && stat (m->shared_name, &b) == 0 
+		 && a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+			unlink (m->shared_name);
+			unlink (lock);
+		}
+	}
+	close (m->shared_fd);
+	if (lfd >= 0) close (lfd);
+	free (m->shared_name);
+}
+
+// map the cached or shared version of a trace, making it first if needed.
+// return false if neither is turned on or it can't be made, in which case
+// the caller should read the trace with read_trace.
+
+bool map_trace (char *fname, trace_map *m) {
+	char *dir = getenv ("TRACE_CACHE_DIR");
+	if (!shared_traces && (!dir || !*dir)) return false;
+	struct stat st;
+	if (stat (fname, &st) < 0) {
 		perror (fname);
+		exit (1);
 	}
-	fread (s, 1, 2, f);
-	fclose (f);
-	if (strncmp (s, GZIP_MAGIC, 2) == 0) 
-		dc = ZCAT;
-	else if (strncmp (s, BZIP2_MAGIC, 2) == 0)
-		dc = BZCAT;
-	else
-		dc = CAT;
+	trace_cache_header h;
+	cache_header_init (&h, &st);
+	if (shared_traces) return map_shared (fname, &h, m);
+	char name[PATH_MAX+64];
+	cache_name (fname, dir, name, sizeof (name));
+	if (map_cache (name, &h, m)) return true;
+	return build_cache (fname, name, &h) && map_cache (name, &h, m);
+}
+
+// unmap a trace cache or shared trace
+
+void unmap_trace (trace_map *m) {
+	munmap (m->base, m->length);
+	if (m->shared_fd >= 0) unmap_shared (m);
+}
+
+// An index is a file next to a trace file, with ".idx" added to its name,
+// that makes it possible to start decoding a trace file from the middle.
+// Decoding a trace needs the state of the decoder left by all the traces
+// before it, so every so many traces the index has a snapshot of that
+// state and the offset of the next trace in the decompressed bytes.  The
+// snapshots keep only the sets of the predictor table that have been
+// used and are compressed with zlib.
+//
+// Getting to an offset in the decompressed bytes is easy for a file that
+// isn't compressed.  A bzip2 file is a series of independently compressed
+// blocks that start at arbitrary bit positions, so the index also lists
+// where each block starts and how many decompressed bytes come before it;
+// reading from the middle turns each block into a bzip2 stream of its own
+// and decompresses only from the block holding the offset.  A gzip file
+// can't be entered in the middle, so it is decompressed from the start up
+// to the offset, which still saves decoding everything before it.  A
+// trace cache doesn't need an index at all.
+
+#define INDEX_MAGIC	"BPTINDEX"
+#define INDEX_VERSION	1
+
+// the magic numbers starting a bzip2 block and ending a bzip2 stream
 
-	// make a command that will decompress the file to stdout
+#define BZ_BLOCK_MAGIC	0x314159265359ULL
+#define BZ_EOS_MAGIC	0x177245385090ULL
 
-	sprintf (cmd, "%s %s", dc, fname);
+struct trace_index_header {
+	char magic[8];
+	unsigned int version, pad;
 
-	// pipe that stdout to tracefp
+	// identify the trace file this index was made from
 
-	tracefp = popen (cmd, "r");
-	if (!tracefp) {
+	long long int src_size, src_mtime_sec, src_mtime_nsec, src_ino;
+
+	// traces between snapshots and in the whole file
+
+	long long int every, ntraces;
+
+	// where the lists of blocks and snapshots are in the index file
+
+	long long int nblocks, blocks_offset, nsnapshots, snapshots_offset;
+};
+
+// a snapshot of the decoder
+
+struct index_snapshot {
+
+	// number of traces and of decompressed bytes before it
+
+	long long int record, out_offset;
+
+	// where the compressed decoder state is in the index file
+
+	long long int state_offset, state_size;
+};
+
+// an index file read into memory; the snapshots' states are read from
+// fd when they are needed
+
+struct trace_index {
+	trace_index_header h;
+	index_block *blocks;
+	index_snapshot *snapshots;
+	int fd;
+};
+
+// fill in the fields of an index header that identify the trace file
+
+static void index_header_init (trace_index_header *h, struct stat *st, long long int every) {
+	memset (h, 0, sizeof (trace_index_header));
+	memcpy (h->magic, INDEX_MAGIC, 8);
+	h->version = INDEX_VERSION;
+	h->src_size = st->st_size;
+	h->src_mtime_sec = st->st_mtim.tv_sec;
+	h->src_mtime_nsec = st->st_mtim.tv_nsec;
+	h->src_ino = st->st_ino;
+	h->every = every;
+}
+
+// make the name of the index of a trace file
+
+static void index_name (char *fname, char *name, size_t n) {
+	snprintf (name, n, "%s.idx", fname);
+}
+
+// writing bits most significant first, the way bzip2 stores them
+
+struct bit_writer {
+	unsigned char *p;
+	unsigned long long int acc;
+	int nacc;
+};
+
+static void put_bits (bit_writer *w, unsigned long long int v, int n) {
+	w->acc = (w->acc << n) | (v & ((1ULL << n) - 1));
+	w->nacc += n;
+	while (w->nacc >= 8) {
+		w->nacc -= 8;
+		*w->p++ = w->acc >> w->nacc;
+	}
+}
+
+// get n <= 8 bits starting at bit i of p; p must have a byte after them
+
+static inline unsigned int get_bits (unsigned char *p, long long int i, int n) {
+	unsigned int x = (p[i>>3] << 8) | p[(i>>3)+1];
+	return (x >> (16 - (i & 7) - n)) & ((1 << n) - 1);
+}
+
+// make a bzip2 block of a file into a bzip2 stream of its own: a stream
+// header, the block, and an end of stream marker with a CRC that, for
+// a single block, is the block's own.  return false if it can't be read.
+
+static bool make_block_stream (int fd, index_block *b, unsigned char **stream, size_t *size) {
+	long long int first = b->bit_start / 8;
+	size_t nbytes = (b->bit_end + 7) / 8 - first;
+	unsigned char *src = (unsigned char *) malloc (nbytes + 1);
+	if (pread (fd, src, nbytes, first) != (ssize_t) nbytes) {
+		free (src);
+		return false;
+	}
+	src[nbytes] = 0;
+	*stream = (unsigned char *) realloc (*stream, nbytes + 16);
+	bit_writer w = { *stream, 0, 0 };
+	put_bits (&w, 'B', 8);
+	put_bits (&w, 'Z', 8);
+	put_bits (&w, 'h', 8);
+	put_bits (&w, '9', 8);
+	long long int start = b->bit_start & 7, nbits = b->bit_end - b->bit_start, i;
+	for (i=0; i+8<=nbits; i+=8) put_bits (&w, get_bits (src, start + i, 8), 8);
+	if (i < nbits) put_bits (&w, get_bits (src, start + i, nbits - i), nbits - i);
+
+	// the block's CRC is the 32 bits after its magic number
+
+	unsigned int crc = 0;
+	for (int k=0; k<4; k++) crc = (crc << 8) | get_bits (src, start + 48 + k * 8, 8);
+	put_bits (&w, BZ_EOS_MAGIC >> 24, 24);
+	put_bits (&w, BZ_EOS_MAGIC, 24);
+	put_bits (&w, crc, 32);
+	if (w.nacc) put_bits (&w, 0, 8 - w.nacc);
+	*size = w.p - *stream;
+	free (src);
+	return true;
+}
+
+// make the next block into the stream read by fill_input; return false
+// if there are no more blocks
+
+static bool next_block_stream (trace_input *in) {
+	if (!in->nblocks) return false;
+	if (!make_block_stream (fileno (in->fp), in->blocks, &in->block_stream, &in->block_size)) {
+		perror (in->name);
+		exit (1);
+	}
+	in->blocks++;
+	in->nblocks--;
+	in->block_pos = 0;
+	return true;
+}
+
+// find where the blocks of a bzip2 file start and end by looking for the
+// magic numbers at every bit position; return the number of blocks
+
+static long long int find_blocks (FILE *fp, index_block **blocks) {
+	long long int n = 0, pos = 0;
+	bool open = false;
+	unsigned long long int reg = 0;
+	unsigned char buf[1<<16];
+	size_t k;
+	*blocks = NULL;
+	while ((k = fread (buf, 1, sizeof (buf), fp)) > 0) {
+		for (size_t i=0; i<k; i++) for (int j=7; j>=0; j--) {
+			reg = (reg << 1) | ((buf[i] >> j) & 1);
+			pos++;
+			unsigned long long int m = reg & 0xffffffffffffULL;
+			if (pos < 48 || (m != BZ_BLOCK_MAGIC && m != BZ_EOS_MAGIC)) continue;
+			if (open) (*blocks)[n-1].bit_end = pos - 48;
+			open = m == BZ_BLOCK_MAGIC;
+			if (open) {
+				*blocks = (index_block *) realloc (*blocks, (n + 1) * sizeof (index_block));
+				(*blocks)[n].bit_start = pos - 48;
+				(*blocks)[n].bit_end = pos;
+				(*blocks)[n].out_offset = 0;
+				n++;
+			}
+		}
+	}
+
+	// a block without an end means a truncated file; leave it out
+
+	if (open) n--;
+	return n;
+}
+
+// decompress a block on its own and return the number of bytes in it, or
+// -1 if it isn't a good block
+
+static long long int block_length (int fd, index_block *b) {
+	unsigned char *stream = NULL, out[1<<16];
+	size_t size;
+	long long int n = -1;
+	if (make_block_stream (fd, b, &stream, &size)) {
+		bz_stream bzs;
+		memset (&bzs, 0, sizeof (bzs));
+		BZ2_bzDecompressInit (&bzs, 0, 0);
+		bzs.next_in = (char *) stream;
+		bzs.avail_in = size;
+		long long int total = 0;
+		int ret;
+		do {
+			bzs.next_out = (char *) out;
+			bzs.avail_out = sizeof (out);
+			ret = BZ2_bzDecompress (&bzs);
+			total += sizeof (out) - bzs.avail_out;
+		} while (ret == BZ_OK && (bzs.avail_in || !bzs.avail_out));
+		if (ret == BZ_STREAM_END) n = total;
+		BZ2_bzDecompressEnd (&bzs);
+	}
+	free (stream);
+	return n;
+}
+
+// find the blocks of a bzip2 file and how many decompressed bytes come
+// before each.  the block magic number could by chance turn up in the
+// middle of a block, so each block is checked by decompressing it; one
+// that fails is joined to the next.  return the number of blocks, or 0
+// if they can't be made sense of.
+
+static long long int index_blocks (char *fname, index_block **blocks) {
+	FILE *fp = fopen (fname, "rb");
+	if (!fp) {
 		perror (fname);
 		exit (1);
 	}
-	bufpos = 0;
-	bufsize = 0;
-	end_of_file = false;
+	long long int n = find_blocks (fp, blocks), m = 0, out = 0;
+	for (long long int i=0; i<n; i++) {
+		index_block b = (*blocks)[i];
+		long long int len;
+		while ((len = block_length (fileno (fp), &b)) < 0 && i + 1 < n) 
+			b.bit_end = (*blocks)[++i].bit_end;
+		if (len < 0) {
+			free (*blocks);
+			*blocks = NULL;
+			m = 0;
+			break;
+		}
+		b.out_offset = out;
+		out += len;
+		(*blocks)[m++] = b;
+	}
+	fclose (fp);
+	return m;
 }
 
-// close the trace file
+// pack the state of a decoder into a zlib-compressed buffer: the return
+// address stack and other small fields, a bit for each set of the
+// predictor table telling whether it has been used, and the used sets
+
+static unsigned char *pack_decoder (trace_decoder *d, unsigned long int *size) {
+	static remember_set empty;
+	size_t fixed = sizeof (d->ras) + sizeof (d->ras_top) + sizeof (d->lru_started) + sizeof (d->last_target);
+	size_t max = fixed + N_REMEMBER / 8 + sizeof (d->rtab);
+	unsigned char *raw = (unsigned char *) calloc (max, 1), *p = raw;
+	memcpy (p, d->ras, sizeof (d->ras)); p += sizeof (d->ras);
+	memcpy (p, &d->ras_top, sizeof (d->ras_top)); p += sizeof (d->ras_top);
+	memcpy (p, &d->lru_started, sizeof (d->lru_started)); p += sizeof (d->lru_started);
+	memcpy (p, &d->last_target, sizeof (d->last_target)); p += sizeof (d->last_target);
+	unsigned char *used = p;
+	p += N_REMEMBER / 8;
+	for (int i=0; i<N_REMEMBER; i++) if (memcmp (&d->rtab[i], &empty, sizeof (remember_set))) {
+		used[i/8] |= 1 << (i % 8);
+		memcpy (p, &d->rtab[i], sizeof (remember_set));
+		p += sizeof (remember_set);
+	}
+	*size = compressBound (p - raw);
+	unsigned char *packed = (unsigned char *) malloc (*size);
+	if (compress2 (packed, size, raw, p - raw, 1) != Z_OK) {
+		fprintf (stderr, "can't compress decoder state\n");
+		exit (1);
+	}
+	free (raw);
+	return packed;
+}
 
-void end_trace (void) {
-	fclose (tracefp);
+// unpack a decoder state made by pack_decoder; return false if it's bad
+
+static bool unpack_decoder (trace_decoder *d, unsigned char *packed, unsigned long int size) {
+	size_t fixed = sizeof (d->ras) + sizeof (d->ras_top) + sizeof (d->lru_started) + sizeof (d->last_target);
+	unsigned long int max = fixed + N_REMEMBER / 8 + sizeof (d->rtab);
+	unsigned char *raw = (unsigned char *) malloc (max), *p = raw;
+	if (uncompress (raw, &max, packed, size) != Z_OK || max < fixed + N_REMEMBER / 8) {
+		free (raw);
+		return false;
+	}
+	memcpy (d->ras, p, sizeof (d->ras)); p += sizeof (d->ras);
+	memcpy (&d->ras_top, p, sizeof (d->ras_top)); p += sizeof (d->ras_top);
+	memcpy (&d->lru_started, p, sizeof (d->lru_started)); p += sizeof (d->lru_started);
+	memcpy (&d->last_target, p, sizeof (d->last_target)); p += sizeof (d->last_target);
+	unsigned char *used = p;
+	p += N_REMEMBER / 8;
+	for (int i=0; i<N_REMEMBER; i++) {
+		if (used[i/8] & (1 << (i % 8))) {
+			if (p + sizeof (remember_set) > raw + max) {
+				free (raw);
+				return false;
+			}
+			memcpy (&d->rtab[i], p, sizeof (remember_set));
+			p += sizeof (remember_set);
+		} else
+			d->rtab[i] = remember_set ();
+	}
+	free (raw);
+	return true;
+}
+
+// write an index for a trace file with a snapshot every so many traces.
+// like a trace cache, it is written under a temporary name and renamed.
+
+bool build_index (char *fname, long long int every) {
+	struct stat st;
+	if (stat (fname, &st) < 0) {
+		perror (fname);
+		return false;
+	}
+	trace_index_header h;
+	index_header_init (&h, &st, every);
+	char name[PATH_MAX+8], tmp[PATH_MAX+32];
+	index_name (fname, name, sizeof (name));
+	snprintf (tmp, sizeof (tmp), "%s.tmp.%d", name, (int) getpid ());
+	trace_reader *tr = open_trace (fname);
+	index_block *blocks = NULL;
+	if (tr->in.format == trace_input::BZIP2) h.nblocks = index_blocks (fname, &blocks);
+	FILE *f = fopen (tmp, "wb");
+	if (!f) {
+		perror (tmp);
+		close_trace (tr);
+		free (blocks);
+		return false;
+	}
+	fwrite (&h, sizeof (h), 1, f);
+
+	// decode the trace, taking a snapshot every so many traces
+
+	index_snapshot *snapshots = NULL;
+	trace *t = new trace[TRACE_BATCH];
+	for (;;) {
+		long long int left = every - tr->ntraces % every;
+		size_t n = read_traces (tr, t, left < TRACE_BATCH ? left : TRACE_BATCH);
+		if (!n) break;
+
+		// a version 2 trace is only counted; it has no offsets to
+		// start decoding from
+
+		if (tr->ntraces % every || tr->v2) continue;
+		snapshots = (index_snapshot *) realloc (snapshots, (h.nsnapshots + 1) * sizeof (index_snapshot));
+		index_snapshot *s = &snapshots[h.nsnapshots++];
+		s->record = tr->ntraces;
+		s->out_offset = tr->in.offset + tr->in.bufpos;
+		unsigned long int size;
+		unsigned char *packed = pack_decoder (&tr->dec, &size);
+		s->state_offset = ftello (f);
+		s->state_size = size;
+		fwrite (packed, 1, size, f);
+		free (packed);
+	}
+	delete[] t;
+	h.ntraces = tr->ntraces;
+
+	// the blocks must add up to the whole file; if they don't, leave them
+	// out and read from the start
+
+	long long int total = tr->in.offset + tr->in.bufsize;
+	if (h.nblocks && blocks[h.nblocks-1].out_offset + block_length (fileno (tr->in.fp), 
+		&blocks[h.nblocks-1]) != total) {
+		fprintf (stderr, "%s: can't index the bzip2 blocks\n", fname);
+		h.nblocks = 0;
+	}
+	close_trace (tr);
+	h.blocks_offset = ftello (f);
+	fwrite (blocks, sizeof (index_block), h.nblocks, f);
+	h.snapshots_offset = ftello (f);
+	fwrite (snapshots, sizeof (index_snapshot), h.nsnapshots, f);
+	rewind (f);
+	fwrite (&h, sizeof (h), 1, f);
+	free (blocks);
+	free (snapshots);
+	if (ferror (f) | (fclose (f) != 0) || rename (tmp, name) != 0) {
+		perror (tmp);
+		unlink (tmp);
+		return false;
+	}
+	return true;
+}
+
+// read the index of a trace file; return NULL if there isn't one or it's
+// out of date
+
+static trace_index *load_index (char *fname) {
+	char name[PATH_MAX+8];
+	index_name (fname, name, sizeof (name));
+	int fd = open (name, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	trace_index_header want;
+	trace_index *x = new trace_index;
+	x->fd = fd;
+	x->blocks = NULL;
+	x->snapshots = NULL;
+	if (stat (fname, &st) < 0 
+	 || pread (fd, &x->h, sizeof (x->h), 0) != sizeof (x->h)) {
+		free_index (x);
+		return NULL;
+	}
+	index_header_init (&want, &st, x->h.every);
+	if (memcmp (x->h.magic, want.magic, 8)
+	 || x->h.version != want.version
+	 || x->h.src_size != want.src_size
+	 || x->h.src_mtime_sec != want.src_mtime_sec
+	 || x->h.src_mtime_nsec != want.src_mtime_nsec
+	 || x->h.src_ino != want.src_ino) {
+		free_index (x);
+		return NULL;
+	}
+	size_t bsize = x->h.nblocks * sizeof (index_block);
+	size_t ssize = x->h.nsnapshots * sizeof (index_snapshot);
+	x->blocks = (index_block *) malloc (bsize + 1);
+	x->snapshots = (index_snapshot *) malloc (ssize + 1);
+	if (pread (fd, x->blocks, bsize, x->h.blocks_offset) != (ssize_t) bsize
+	 || pread (fd, x->snapshots, ssize, x->h.snapshots_offset) != (ssize_t) ssize) {
+		free_index (x);
+		return NULL;
+	}
+	return x;
+}
+
+static void free_index (trace_index *x) {
+	if (!x) return;
+	close (x->fd);
+	free (x->blocks);
+	free (x->snapshots);
+	delete x;
+}
+
+// start reading a trace file over from a snapshot in its index
+
+static bool restore_snapshot (trace_reader *tr, index_snapshot *s) {
+	trace_index *x = tr->index;
+	trace_input *in = &tr->in;
+	unsigned char *packed = (unsigned char *) malloc (s->state_size);
+	bool ok = pread (x->fd, packed, s->state_size, s->state_offset) == s->state_size
+		&& unpack_decoder (&tr->dec, packed, s->state_size);
+	free (packed);
+	if (!ok) return false;
+	close_input (in);
+	open_input (in, in->name);
+	if (in->format == trace_input::RAW) {
+
+		// a plain file can just be read from the offset
+
+		if (fseeko (in->fp, s->out_offset, SEEK_SET) < 0) return false;
+		in->inavail = 0;
+		in->offset = s->out_offset;
+	} else if (in->format == trace_input::BZIP2 && x->h.nblocks) {
+
+		// start decompressing at the block holding the offset
+
+		long long int b = x->h.nblocks - 1;
+		while (b > 0 && x->blocks[b].out_offset > s->out_offset) b--;
+		BZ2_bzDecompressEnd (&in->bzs);
+		memset (&in->bzs, 0, sizeof (in->bzs));
+		BZ2_bzDecompressInit (&in->bzs, 0, 0);
+		in->blocks = &x->blocks[b];
+		in->nblocks = x->h.nblocks - b;
+		in->offset = x->blocks[b].out_offset;
+	}
+	if (!skip_input (in, s->out_offset)) return false;
+	tr->ntraces = s->record;
+	return true;
+}
+
+// move a trace_reader to the trace numbered record, counting from 0, so
+// that it's the next one read_traces gives.  if the trace file has an
+// index, this starts from the last snapshot before record when that's
+// closer than where the reader is, and a version 2 trace written in
+// blocks starts from the block holding record; otherwise every trace
+// before record has to be decoded.  return the number of the trace the reader got to,
+// which is less than record if the file ends first.
+
+long long int seek_trace (trace_reader *tr, long long int record) {
+	trace_input *in = &tr->in;
+	if (tr->v2 && tr->v2->nblocks) {
+
+		// a version 2 trace written in blocks can start from the
+		// block holding record
+
+		trace2_reader *v = tr->v2;
+		long long int b = find_block (v, record);
+		if (record < tr->ntraces || v->blocks[b].first > tr->ntraces) {
+			stop_pool (tr);
+			if (fseeko (in->fp, v->blocks[b].offset, SEEK_SET) < 0) {
+				perror (in->name);
+				exit (1);
+			}
+			in->inavail = 0;
+			in->end_of_input = false;
+			in->offset = v->blocks[b].offset - 4;
+			reset_v2 (&tr->dec, v);
+			tr->ntraces = v->blocks[b].first;
+		}
+	} else if (in->format != trace_input::CALLBACK) {
+		if (!tr->index_loaded) {
+			tr->index = load_index (in->name);
+			tr->index_loaded = true;
+		}
+		index_snapshot *s = NULL;
+		if (tr->index) for (long long int i=0; i<tr->index->h.nsnapshots; i++) {
+			if (tr->index->snapshots[i].record > record) break;
+			s = &tr->index->snapshots[i];
+		}
+		if (s && (record < tr->ntraces || s->record > tr->ntraces)) {
+			if (!restore_snapshot (tr, s)) {
+				fprintf (stderr, "%s: bad index\n", in->name);
+				exit (1);
+			}
+		} else if (record < tr->ntraces) {
+
+			// go back to the start
+
+			close_input (in);
+			open_input (in, in->name);
+			for (int i=0; i<N_REMEMBER; i++) tr->dec.rtab[i] = remember_set ();
+			init_ras (&tr->dec);
+			tr->dec.lru_started = false;
+			tr->dec.last_target = 0;
+			tr->ntraces = 0;
+			if (tr->v2) {
+				stop_pool (tr);
+				reset_v2 (&tr->dec, tr->v2);
+			}
+		}
+	}
+	trace *t = new trace[TRACE_BATCH];
+	while (tr->ntraces < record) {
+		long long int left = record - tr->ntraces;
+		if (!read_traces (tr, t, left < TRACE_BATCH ? left : TRACE_BATCH)) break;
+	}
+	delete[] t;
+	return tr->ntraces;
+}
+
+// the number of traces in the file read by a trace_reader, from its
+// index or the directory of a version 2 trace written in blocks, or -1 if
+// it has neither
+
+long long int count_traces (trace_reader *tr) {
+	if (tr->in.format == trace_input::CALLBACK) return -1;
+	if (tr->v2 && tr->v2->nblocks) return tr->v2->blocks[tr->v2->nblocks].first;
+	if (!tr->index_loaded) {
+		tr->index = load_index (tr->in.name);
+		tr->index_loaded = true;
+	}
+	return tr->index ? tr->index->h.ntraces : -1;
 }
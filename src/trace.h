@@ -1,13 +1,10 @@
 // trace.h
 // This file declares functions and a struct for reading trace files.
 
-// these #define the Unix commands for decompressing gzip, bzip2, and
-// plain files.  If they are somewhere else on your system, change these
-// definitions.
+// each trace file represents exactly 100 million instructions, unless told
+// otherwise with trace_instructions
 
-#define ZCAT            "/bin/gzip -dc"
-#define BZCAT           "/usr/bin/bzip2 -dc"
-#define CAT             "/bin/cat"
+#define TRACE_INSTRUCTIONS	100000000LL
 
 struct trace {
 	bool	taken;
@@ -15,6 +12,89 @@ struct trace {
 	branch_info bi;
 };
 
+// a good number of traces to ask read_traces for at once
+
+#define TRACE_BATCH	4096
+
+// reading a trace file.  init_trace, read_trace, read_traces and
+// end_trace work on one trace file at a time; open_trace returns a
+// trace_reader for reading more than one at a time.
+
+struct trace_reader;
+
 void init_trace (char *);
 trace *read_trace (void);
+size_t read_traces (trace *, size_t);
 void end_trace (void);
+trace_reader *open_trace (char *);
+size_t read_traces (trace_reader *, trace *, size_t);
+void close_trace (trace_reader *);
+
+// splitting decompression from decoding, e.g. to run them in different
+// threads: read_trace_bytes gets decompressed bytes from a trace file, and
+// a reader made by open_trace_decoder decodes bytes from a function
+
+size_t read_trace_bytes (trace_reader *, unsigned char *, size_t);
+trace_reader *open_trace_decoder (size_t (*) (void *, unsigned char *, size_t), void *);
+
+// set the number of instructions a trace file represents, for the MPKI of
+// a trace that isn't one of the CBP-2 traces, e.g. one made by gen, and
+// get it; it is TRACE_INSTRUCTIONS unless set
+
+void trace_instructions (long long int);
+long long int trace_file_instructions (void);
+
+// the version of the format of a trace file: 1 for the original format,
+// whether compressed with gzip or bzip2 or not, and 2 for the entropy-coded
+// format of trace2.h, which has no decompressed bytes to read
+
+int trace_version (trace_reader *);
+
+// the number of threads decoding the blocks of a version 2 trace written
+// by ct -b; by default the TRACE_THREADS environment variable or else one
+// per processor up to 2.  1 decodes in the reading thread; more hold a
+// whole decoded block of TRACE2_BLOCK traces, about 40MB, for each thread
+// and one more
+
+void trace_threads (int);
+
+// saving the state of a trace_reader in a checkpoint and restoring it to
+// a freshly opened one
+
+bool save_trace (trace_reader *, FILE *);
+bool restore_trace (trace_reader *, FILE *);
+
+// random access to a trace file.  build_index writes an index file next to
+// a trace file with a snapshot of the decoder every so many traces, which
+// lets seek_trace start decoding from the middle of the file and
+// count_traces tell how many traces there are without reading them.
+
+bool build_index (char *, long long int);
+long long int seek_trace (trace_reader *, long long int);
+long long int count_traces (trace_reader *);
+
+// a trace as it is stored in a trace cache file
+
+struct cached_trace {
+	unsigned int address, target;
+	unsigned char opcode, br_flags, taken, pad[5];
+};
+
+// a trace cache file or shared trace mapped into memory
+
+struct trace_map {
+	cached_trace *traces;
+	long long int ntraces, ninstructions;
+	void *base;
+	size_t length;
+	int shared_fd;		// holding a reference to a shared trace, or -1
+	char *shared_name;
+};
+
+bool map_trace (char *, trace_map *);
+void unmap_trace (trace_map *);
+
+// have map_trace decode traces into shared memory, once for all the runs
+// using a trace at the same time, rather than into the trace cache
+
+void trace_shared (bool);
@@ -0,0 +1,402 @@
+// trace2.h
+// This file contains the parts of the version 2 trace format that are
+// shared by the compressor in compress/ and the reader in trace.cc.
+//
+// A version 2 trace keeps the prediction of the original format: the same
+// remember table and return address stack predict each trace.  Rather
+// than writing the result as bytes for gzip or bzip2 to compress, each
+// trace becomes one symbol:
+// - a correct prediction is the rank of the predicted way in the LRU order
+// of its set, which is almost always 0 or 1, plus whether the return
+// address stack was right and how its prediction was patched;
+// - a misprediction of a trace that was thrown out of its set recently
+// is its place in the set's list of victims, the last TRACE2_VICTIMS
+// traces thrown out, most recent first;
+// - any other misprediction is the trace's code.  Its address is written
+// as the difference from the last target and its target as the
+// difference from its address, as zigzag varints kept apart from the
+// symbols.
+//
+// The symbols are entropy coded with static rANS: each chunk starts with
+// tables of how often each symbol came up in each of TRACE2_CONTEXTS
+// contexts, and the decoder looks each symbol up in a table built from
+// them rather than working it out bit by bit.  The context of a trace is
+// the last symbol of its set and a guess at its symbol: a table indexed by
+// a hash of about the last 30 symbols of the whole trace remembers the
+// symbol that last followed them, and how many times in a row it was
+// right.  What is coded is TRACE2_GUESSED if the guess is right, and the
+// symbol otherwise.  The varints aren't entropy coded; their bytes are
+// kept as they are.
+//
+// The file starts with TRACE2_MAGIC and is followed by chunks of up to
+// TRACE2_CHUNK traces, each a trace2_chunk header and its bytes: the
+// tables, the number of bytes of varints and the varints, both as
+// varints, and then the rANS-coded symbols.  The remember table, return
+// address stack and guesses carry over from one chunk to the next unless
+// the chunk has the TRACE2_RESET flag, which starts them over.
+//
+// A file written in blocks by ct -b starts them over every TRACE2_BLOCK
+// traces, so each block can be coded and decoded on its own.  After the
+// last block comes a directory: a chunk header with the TRACE2_DIRECTORY
+// flag, ntraces giving the number of blocks and bytes the size of the
+// rest, a trace2_block for each block and one more for the end of the
+// last, and finally the offset of the directory's header in the file as
+// a long long int, so a reader can find it from the end.
+
+#define TRACE2_MAGIC	"\x89" "BT2"
+
+// traces in a chunk, and the most bytes a trace can take: a symbol takes
+// at most 12 bits of rANS and two varints at most 5 bytes each
+
+#define TRACE2_CHUNK		(1<<20)
+#define TRACE2_MAX_BYTES	12
+
+// symbols: a hit is rank + 8 * (return address stack right) + 16 * patch,
+// where patch is 0 for none, 1 for +2 and 2 for -3; a miss is
+// TRACE2_MISS + code - 0x10, or TRACE2_VICTIM + its place in the victims
+
+#define TRACE2_VICTIMS	16
+#define TRACE2_MISS	48
+#define TRACE2_VICTIM	(TRACE2_MISS + 0x70)
+#define TRACE2_SYMBOLS	(TRACE2_VICTIM + TRACE2_VICTIMS)
+
+// coded for a symbol that was guessed right
+
+#define TRACE2_GUESSED	255
+
+struct trace2_chunk {
+	unsigned int ntraces, flags, bytes;
+};
+
+#define TRACE2_RESET		1
+#define TRACE2_DIRECTORY	2
+
+// traces in a block, and where a block's first chunk is in the file and
+// how many traces come before it.  a reader decoding blocks on several
+// threads holds a few whole blocks, 40MB each at this size; much smaller
+// blocks make the file noticeably bigger, since every block has to learn
+// the branches of the program over again.
+
+#define TRACE2_BLOCK		(1<<21)
+
+struct trace2_block {
+	long long int offset, first;
+};
+
+// rANS with 32-bit state and renormalization 16 bits at a time.  the
+// frequencies of a context add up to 1<<TRACE2_SCALE_BITS.
+
+#define TRACE2_SCALE_BITS	12
+#define TRACE2_SCALE		(1<<TRACE2_SCALE_BITS)
+#define TRACE2_RANS_L		(1u<<16)
+
+// the contexts: the set's last symbol if it was a hit without a patch, or
+// 16 if not, times 8, plus 0 to 3 for how many times in a row the guess
+// was right, and 4 more if the guess isn't the last symbol
+
+#define TRACE2_SETS		(1<<16)
+#define TRACE2_GUESS_BITS	20
+#define TRACE2_CONTEXTS		(17 * 8)
+
+// the victims of a set
+
+struct trace2_victims {
+	unsigned char code[TRACE2_VICTIMS];
+	unsigned int address[TRACE2_VICTIMS], target[TRACE2_VICTIMS];
+};
+
+struct trace2_model {
+	trace2_victims victims[TRACE2_SETS];
+
+	// the guesses, each a symbol plus 256 times how many times in a row
+	// it was right, up to 3
+
+	unsigned short guess[1<<TRACE2_GUESS_BITS];
+
+	// the recent symbols, each shifted 2 bits further left by each
+	// symbol after it until it falls off the end
+
+	unsigned long long int hash;
+
+	// the guess for the next symbol, chosen by the hash as it was
+	// before the last symbol.  leaving the last symbol out costs little,
+	// and lets the decoder load the guess while it decodes that symbol.
+
+	unsigned short *next;
+};
+
+static inline unsigned short *guess_entry (trace2_model *m, unsigned long long int hash) {
+	return &m->guess[(hash * 0x9e3779b97f4a7c15ull) >> (64 - TRACE2_GUESS_BITS)];
+}
+
+static void init_model (trace2_model *m) {
+	memset (m->victims, 0, sizeof (m->victims));
+	memset (m->guess, 0, sizeof (m->guess));
+	m->hash = 0;
+	m->next = guess_entry (m, m->hash);
+}
+
+// the context of the next trace in a set whose last symbol was last,
+// given the guess for it
+
+static inline int symbol_context (int last, unsigned int guess) {
+	return (last < 16 ? last : 16) * 8 + ((guess & 255) != (unsigned int) last) * 4 + (guess >> 8);
+}
+
+// the model has seen a symbol, which had the guess g, in the set whose last
+// symbol is at last
+
+static inline void model_seen (trace2_model *m, unsigned char *last, int sym, unsigned short *g) {
+	unsigned int old = *g;
+	*g = (old & 255) == (unsigned int) sym ? old + (old < 0x300 ? 256 : 0) : sym;
+	*last = sym;
+	m->next = guess_entry (m, m->hash);
+	m->hash = (m->hash << 2) ^ sym;
+}
+
+// find a trace among the victims of a set; return its place or -1
+
+static inline int find_victim (trace2_model *m, unsigned int set, unsigned char code, 
+	unsigned int address, unsigned int target) {
+	trace2_victims *v = &m->victims[set];
+	for (int i=0; i<TRACE2_VICTIMS; i++) 
+		if (v->code[i] == code && v->address[i] == address && v->target[i] == target) return i;
+	return -1;
+}
+
+// take the victim in place i out of a set's list
+
+static inline void take_victim (trace2_model *m, unsigned int set, int i, unsigned char *code,
+	unsigned int *address, unsigned int *target) {
+	trace2_victims *v = &m->victims[set];
+	*code = v->code[i];
+	*address = v->address[i];
+	*target = v->target[i];
+	for (; i<TRACE2_VICTIMS-1; i++) {
+		v->code[i] = v->code[i+1];
+		v->address[i] = v->address[i+1];
+		v->target[i] = v->target[i+1];
+	}
+	v->code[i] = 0;
+}
+
+// put a trace thrown out of a set at the front of its victims, unless the
+// way it was thrown out of was never used
+
+static inline void add_victim (trace2_model *m, unsigned int set, unsigned char code,
+	unsigned int address, unsigned int target) {
+	if (!code) return;
+	trace2_victims *v = &m->victims[set];
+	memmove (v->code + 1, v->code, TRACE2_VICTIMS - 1);
+	memmove (v->address + 1, v->address, (TRACE2_VICTIMS - 1) * sizeof (unsigned int));
+	memmove (v->target + 1, v->target, (TRACE2_VICTIMS - 1) * sizeof (unsigned int));
+	v->code[0] = code;
+	v->address[0] = address;
+	v->target[0] = target;
+}
+
+// a symbol to be encoded and its context
+
+struct trace2_event {
+	unsigned char context, sym;
+};
+
+// zigzag varints
+
+static inline unsigned char *put_varint (unsigned char *p, int v) {
+	unsigned int x = ((unsigned int) v << 1) ^ (unsigned int) (v >> 31);
+	while (x >= 0x80) {
+		*p++ = x | 0x80;
+		x >>= 7;
+	}
+	*p++ = x;
+	return p;
+}
+
+// at most 5 bytes are read, even from a bad varint
+
+static inline unsigned char *get_varint (unsigned char *p, int *v) {
+	unsigned int x = 0;
+	int shift = 0;
+	while ((*p & 0x80) && shift < 28) {
+		x |= (*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	x |= *p++ << shift;
+	*v = (int) (x >> 1) ^ -(int) (x & 1);
+	return p;
+}
+
+// the event for the symbol of a trace in the set whose last symbol is at
+// last, updating the model
+
+static inline trace2_event model_symbol (trace2_model *m, unsigned char *last, int sym) {
+	unsigned short *g = m->next;
+	trace2_event e;
+	e.context = symbol_context (*last, *g);
+	e.sym = (*g & 255) == sym ? TRACE2_GUESSED : sym;
+	model_seen (m, last, sym, g);
+	return e;
+}
+
+// scale the counts of the symbols in a context to frequencies adding up
+// to TRACE2_SCALE, giving every symbol seen at least 1
+
+static inline void normalize_counts (unsigned int *count, unsigned int *freq) {
+	unsigned long long int total = 0;
+	for (int i=0; i<256; i++) total += count[i];
+	for (int i=0; i<256; i++) {
+		freq[i] = 0;
+		if (count[i]) {
+			freq[i] = count[i] * (unsigned long long int) TRACE2_SCALE / total;
+			if (!freq[i]) freq[i] = 1;
+		}
+	}
+	if (!total) return;
+
+	// the rounding is made up by the most frequent symbol
+
+	for (;;) {
+		int sum = 0, big = 0;
+		for (int i=0; i<256; i++) {
+			sum += freq[i];
+			if (freq[i] > freq[big]) big = i;
+		}
+		if (sum == TRACE2_SCALE) break;
+		if (sum < TRACE2_SCALE) 
+			freq[big] += TRACE2_SCALE - sum;
+		else if (sum - TRACE2_SCALE < (int) freq[big]) 
+			freq[big] -= sum - TRACE2_SCALE;
+		else
+			freq[big] = 1;
+	}
+}
+
+// the tables of a chunk: the frequency of each symbol in each context and
+// where its range starts, and for the decoder the symbol of each slot
+
+struct trace2_tables {
+	unsigned short freq[TRACE2_CONTEXTS][256], start[TRACE2_CONTEXTS][256];
+	unsigned int slot[TRACE2_CONTEXTS][TRACE2_SCALE];
+};
+
+// make the tables for the events of a chunk and write them to p; return
+// the end of what was written, at most TRACE2_CONTEXTS * 769 bytes.  a
+// context is written as its number of symbols, then each symbol and its
+// frequency as a varint.
+
+static inline unsigned char *write_tables (trace2_tables *t, trace2_event *ev, size_t n, unsigned char *p) {
+	unsigned int (*count)[256] = (unsigned int (*)[256]) calloc (TRACE2_CONTEXTS, sizeof (*count));
+	for (size_t i=0; i<n; i++) count[ev[i].context][ev[i].sym]++;
+	for (int c=0; c<TRACE2_CONTEXTS; c++) {
+		unsigned int freq[256];
+		normalize_counts (count[c], freq);
+		int nsyms = 0;
+		for (int i=0; i<256; i++) nsyms += freq[i] != 0;
+		p = put_varint (p, nsyms);
+		unsigned int at = 0;
+		for (int i=0; i<256; i++) {
+			t->freq[c][i] = freq[i];
+			t->start[c][i] = at;
+			if (!freq[i]) continue;
+			at += freq[i];
+			*p++ = i;
+			p = put_varint (p, freq[i]);
+		}
+	}
+	free (count);
+	return p;
+}
+
+// read the tables of a chunk from p, which must be followed by at least
+// 6 bytes of padding; return the end of them, or NULL if they are bad or
+// go past end
+
+static unsigned char *read_tables (trace2_tables *t, unsigned char *p, unsigned char *end) {
+	for (int c=0; c<TRACE2_CONTEXTS; c++) {
+		int nsyms;
+		if (p >= end) return NULL;
+		p = get_varint (p, &nsyms);
+		if (nsyms < 0 || nsyms > 256) return NULL;
+		int at = 0, prev = -1;
+		for (int i=0; i<nsyms; i++) {
+			if (p >= end) return NULL;
+			int sym = *p++, freq;
+			p = get_varint (p, &freq);
+			if (sym <= prev || freq < 1 || at + freq > TRACE2_SCALE) return NULL;
+			if (sym >= TRACE2_SYMBOLS && sym != TRACE2_GUESSED) return NULL;
+			t->freq[c][sym] = freq;
+			t->start[c][sym] = at;
+			for (int j=0; j<freq; j++) t->slot[c][at + j] = sym | (freq - 1) << 8 | j << 20;
+			at += freq;
+			prev = sym;
+		}
+		if (nsyms && at != TRACE2_SCALE) return NULL;
+
+		// a context with no symbols can't come up in a good chunk; make
+		// one that does decode as a bad symbol
+
+		if (!nsyms) {
+			for (int j=0; j<TRACE2_SCALE; j++) t->slot[c][j] = TRACE2_SYMBOLS | (TRACE2_SCALE - 1) << 8 | j << 20;
+			t->freq[c][TRACE2_SYMBOLS] = TRACE2_SCALE;
+			t->start[c][TRACE2_SYMBOLS] = 0;
+		}
+	}
+	return p > end ? NULL : p;
+}
+
+// encode a symbol.  rANS works backward, so the symbols are encoded last
+// to first and the bytes are written downward from p.
+
+static inline unsigned char *rans_encode (unsigned int *x, unsigned char *p, unsigned int freq, 
+	unsigned int start) {
+	if (*x >= ((unsigned long long int) (TRACE2_RANS_L >> TRACE2_SCALE_BITS) << 16) * freq) {
+		p -= 2;
+		p[0] = *x;
+		p[1] = *x >> 8;
+		*x >>= 16;
+	}
+	*x = ((*x / freq) << TRACE2_SCALE_BITS) + (*x % freq) + start;
+	return p;
+}
+
+// write the final state; the decoder reads it first
+
+static inline unsigned char *rans_flush (unsigned int x, unsigned char *p) {
+	p -= 4;
+	p[0] = x >> 24;
+	p[1] = x >> 16;
+	p[2] = x >> 8;
+	p[3] = x;
+	return p;
+}
+
+static inline unsigned int rans_init (unsigned char **p) {
+	unsigned char *q = *p;
+	*p += 4;
+	return (q[0] << 24) | (q[1] << 16) | (q[2] << 8) | q[3];
+}
+
+// decode the symbol of a trace in a set, the inverse of model_symbol.  the
+// caller pads the stream so a truncated one reads zeros rather than past
+// the end.
+
+static inline int decode_symbol (trace2_model *m, trace2_tables *t, unsigned char *last, 
+	unsigned int *x, unsigned char **q) {
+	unsigned short *g = m->next;
+	int c = symbol_context (*last, *g);
+	unsigned int slot = *x & (TRACE2_SCALE - 1);
+	unsigned int e = t->slot[c][slot];
+	int sym = e & 255;
+	*x = ((e >> 8 & (TRACE2_SCALE - 1)) + 1) * (*x >> TRACE2_SCALE_BITS) + (e >> 20);
+
+	// renormalize without a branch, which would be mispredicted often
+
+	unsigned int w = (*q)[0] | ((*q)[1] << 8);
+	int renorm = *x < TRACE2_RANS_L;
+	*x = renorm ? (*x << 16) | w : *x;
+	*q += renorm * 2;
+	if (sym == TRACE2_GUESSED) sym = *g & 255;
+	if (sym < TRACE2_SYMBOLS) model_seen (m, last, sym, g);
+	return sym;
+}